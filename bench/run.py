@@ -0,0 +1,296 @@
+#!/usr/bin/env python3
+"""
+End to end benchmark for pastebinc (make bench).
+
+Starts the stand-in paste server (bench/server.py) on loopback, runs a fixed
+set of scenarios against a pastebinc built to read bench/etc, and writes the
+results as JSON so runs of different versions can be compared.  Every
+scenario reports wall time percentiles, throughput and the peak RSS of the
+pastebinc process (sampled from /proc while it runs).
+"""
+
+import argparse
+import json
+import os
+import platform
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+PORT = 18765  # must match the urls in bench/etc/*.conf
+
+SIZES = [
+    ('1K', 1 << 10),
+    ('64K', 64 << 10),
+    ('1M', 1 << 20),
+    ('16M', 16 << 20),
+    ('256M', 256 << 20),
+    ('1G', 1 << 30),
+]
+
+
+def parse_size(text):
+    units = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+    text = text.upper()
+    if text[-1] in units:
+        return int(text[:-1]) * units[text[-1]]
+    return int(text)
+
+
+def make_block():
+    """1 MB of numbered text lines, the same every run."""
+    lines = []
+    size = 0
+    n = 0
+    while size < (1 << 20):
+        line = b'%08d pastebinc benchmark line, the quick brown fox jumps over the lazy dog\n' % n
+        lines.append(line)
+        size += len(line)
+        n += 1
+    return b''.join(lines)[:1 << 20]
+
+
+BLOCK = make_block()
+
+
+def feed_bytes(size):
+    def feed(pipe):
+        left = size
+        while left > 0:
+            n = min(left, len(BLOCK))
+            pipe.write(BLOCK[:n])
+            left -= n
+    return feed
+
+
+def feed_slowly(size, chunk, interval):
+    def feed(pipe):
+        sent = 0
+        while sent < size:
+            n = min(chunk, size - sent)
+            pipe.write(BLOCK[sent % len(BLOCK):][:n])
+            pipe.flush()
+            sent += n
+            time.sleep(interval)
+    return feed
+
+
+def drain(pipe):
+    while pipe.read(1 << 20):
+        pass
+
+
+def watch_peak_rss(pid, peak):
+    """
+    Samples the process's VmHWM until it exits.  wait4()'s ru_maxrss can't be
+    used: it includes the python process the child was forked from.
+    """
+    path = '/proc/%d/status' % pid
+    while True:
+        try:
+            with open(path) as status:
+                for line in status:
+                    if line.startswith('VmHWM:'):
+                        peak[0] = max(peak[0], int(line.split()[1]))
+                        break
+                else:
+                    return  # exited, only the zombie is left
+        except OSError:
+            return
+        time.sleep(0.001)
+
+
+def run_once(binary, args, feed, env, pipe_stdout=False, expect_url=True):
+    """
+    Runs the binary once, feeding its stdin.  With pipe_stdout its stdout is
+    a pipe that gets drained (like the middle of a pipeline) instead of
+    /dev/null.  Returns (seconds, peak RSS in KB, ok).
+    """
+    start = time.perf_counter()
+    proc = subprocess.Popen([binary] + args, stdin=subprocess.PIPE,
+                            stdout=subprocess.PIPE if pipe_stdout else subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, env=env)
+
+    def write_input():
+        try:
+            feed(proc.stdin)
+        except BrokenPipeError:
+            pass
+        finally:
+            try:
+                proc.stdin.close()
+            except BrokenPipeError:
+                pass
+
+    stderr = []
+    peak = [0]
+    watcher = threading.Thread(target=watch_peak_rss, args=(proc.pid, peak))
+    watcher.start()
+    feeder = threading.Thread(target=write_input)
+    reader = threading.Thread(target=lambda: stderr.append(proc.stderr.read()))
+    feeder.start()
+    reader.start()
+    if pipe_stdout:
+        drainer = threading.Thread(target=drain, args=(proc.stdout,))
+        drainer.start()
+
+    # wait without reaping, so the watcher can't read some other process's status
+    os.waitid(os.P_PID, proc.pid, os.WEXITED | os.WNOWAIT)
+    elapsed = time.perf_counter() - start
+    watcher.join()
+    proc.wait()
+    feeder.join()
+    reader.join()
+    if pipe_stdout:
+        drainer.join()
+
+    ok = proc.returncode == 0 and (b'/p/' in stderr[0] or not expect_url)
+    if not ok:
+        sys.stderr.write('pastebinc %s failed: %s\n' % (' '.join(args), stderr[0].decode(errors='replace').strip()))
+    return elapsed, peak[0], ok
+
+
+def percentile(sorted_values, pct):
+    """Nearest-rank percentile."""
+    rank = max(1, -(-len(sorted_values) * pct // 100))
+    return sorted_values[int(rank) - 1]
+
+
+def scenario(name, description, binary, args, feed, runs, env, size=None, cold=False, **run_args):
+    times = []
+    rss = 0
+    failures = 0
+
+    for _ in range(runs):
+        run_env = env
+        if cold:
+            # a cache dir nobody has used: the config has to be compiled again
+            run_env = dict(env, XDG_CACHE_HOME=tempfile.mkdtemp(prefix='pastebinc-bench-'))
+        elapsed, peak, ok = run_once(binary, args, feed, run_env, **run_args)
+        times.append(elapsed * 1000)
+        rss = max(rss, peak)
+        failures += 0 if ok else 1
+
+    times.sort()
+    result = {
+        'name': name,
+        'description': description,
+        'args': args,
+        'runs': runs,
+        'failures': failures,
+        'wall_ms': {
+            'min': round(times[0], 3),
+            'p50': round(percentile(times, 50), 3),
+            'p90': round(percentile(times, 90), 3),
+            'p99': round(percentile(times, 99), 3),
+            'max': round(times[-1], 3),
+            'mean': round(sum(times) / len(times), 3),
+        },
+        'peak_rss_kb': rss,
+    }
+    if size is not None:
+        result['bytes'] = size
+        result['mb_per_s'] = round(size / (1 << 20) / (percentile(times, 50) / 1000), 3)
+
+    print('%-22s %6d runs  p50 %10.2f ms  p99 %10.2f ms  %s rss %7d KB%s' % (
+        name, runs, result['wall_ms']['p50'], result['wall_ms']['p99'],
+        ('%9.2f MB/s' % result['mb_per_s']) if 'mb_per_s' in result else ' ' * 14, rss,
+        ('  (%d failed)' % failures) if failures else ''))
+    sys.stdout.flush()
+    return result
+
+
+def start_server():
+    server = subprocess.Popen([sys.executable, os.path.join(HERE, 'server.py'), '--port', str(PORT)])
+    deadline = time.time() + 10
+    while time.time() < deadline:
+        try:
+            socket.create_connection(('127.0.0.1', PORT), timeout=1).close()
+            return server
+        except OSError:
+            time.sleep(0.05)
+    server.kill()
+    sys.exit('the stand-in server did not start on port %d' % PORT)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--binary', default=os.path.join(HERE, 'pastebinc'))
+    parser.add_argument('--out', default=os.path.join(HERE, 'results.json'))
+    parser.add_argument('--runs', type=int, default=5, help='runs per scenario (large inputs get fewer)')
+    parser.add_argument('--max-size', default='1G', help='largest input size to try')
+    parser.add_argument('--small-pastes', type=int, default=200, help='pastes in the many-small-pastes scenarios')
+    parser.add_argument('--quick', action='store_true', help='up to 16M, 3 runs, 50 small pastes')
+    args = parser.parse_args()
+
+    if args.quick:
+        args.runs = 3
+        args.max_size = '16M'
+        args.small_pastes = 50
+    max_size = parse_size(args.max_size)
+
+    version = subprocess.run([args.binary, '-h'], stderr=subprocess.PIPE, stdout=subprocess.DEVNULL)
+    version = version.stderr.decode().splitlines()[0]
+
+    cache = tempfile.mkdtemp(prefix='pastebinc-bench-')
+    env = dict(os.environ, XDG_CACHE_HOME=cache)
+    env.pop('http_proxy', None)
+
+    server = start_server()
+    results = []
+    try:
+        for label, size in SIZES:
+            if size > max_size:
+                break
+            runs = args.runs if size <= (16 << 20) else min(args.runs, 2)
+            results.append(scenario('size-%s' % label, '%s of input, spooled' % label,
+                                    args.binary, [], feed_bytes(size), runs, env, size))
+            results.append(scenario('size-%s-tee' % label, '%s of input, spooled, with -t into a pipe' % label,
+                                    args.binary, ['-t'], feed_bytes(size), runs, env, size, pipe_stdout=True))
+            # what -t should come close to: plain pass-through
+            results.append(scenario('cat-%s' % label, '%s through cat into a pipe, for comparison with -t' % label,
+                                    'cat', [], feed_bytes(size), runs, env, size, pipe_stdout=True, expect_url=False))
+
+        results.append(scenario('small-pastes', '1K pastes one after another (200 response)',
+                                args.binary, [], feed_bytes(1 << 10), args.small_pastes, env, 1 << 10))
+        results.append(scenario('small-pastes-302', '1K pastes one after another (302 response)',
+                                args.binary, ['-p', 'bench-302'], feed_bytes(1 << 10), args.small_pastes, env, 1 << 10))
+        results.append(scenario('slow-server', '1K pastes to a server that takes 200ms to answer',
+                                args.binary, ['-p', 'bench-slow'], feed_bytes(1 << 10), args.runs, env, 1 << 10))
+        results.append(scenario('slow-producer', '64K written 1K every 5ms, spooled',
+                                args.binary, [], feed_slowly(64 << 10, 1 << 10, 0.005), args.runs, env, 64 << 10))
+        results.append(scenario('slow-producer-stream', '64K written 1K every 5ms, streamed with -s',
+                                args.binary, ['-s'], feed_slowly(64 << 10, 1 << 10, 0.005), args.runs, env, 64 << 10))
+        results.append(scenario('cold-start', '1K paste with an empty cache dir',
+                                args.binary, [], feed_bytes(1 << 10), args.small_pastes // 4, env, cold=True))
+        results.append(scenario('warm-start', '1K paste with the config cache already built',
+                                args.binary, [], feed_bytes(1 << 10), args.small_pastes // 4, env))
+    finally:
+        server.terminate()
+        server.wait()
+
+    report = {
+        'version': version,
+        'date': time.strftime('%Y-%m-%dT%H:%M:%S%z'),
+        'host': {
+            'system': platform.system(),
+            'release': platform.release(),
+            'machine': platform.machine(),
+            'cpus': os.cpu_count(),
+        },
+        'scenarios': results,
+    }
+    with open(args.out, 'w') as out:
+        json.dump(report, out, indent=2)
+        out.write('\n')
+    print('results written to %s' % args.out)
+
+    return 1 if any(r['failures'] for r in results) else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
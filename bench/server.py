@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""
+Loopback stand-in for a paste site, used by `make bench`.
+
+POST /paste answers 200 with the paste URL as the body, and POST /redirect
+answers 302 with the paste URL in Location: the two response styles that
+pastebinc understands.  ?delay=MS makes the server wait that long before
+answering, to act like a slow node.  The posted form is read (chunked or
+not) and thrown away.  HEAD (pastebinc's connection warm-up) gets an empty
+200, and connections are kept open.
+"""
+
+import argparse
+import itertools
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+READ_SIZE = 1 << 20
+paste_ids = itertools.count(1)
+paste_ids_lock = threading.Lock()
+
+
+class PasteHandler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def do_POST(self):
+        url = urlparse(self.path)
+        delay = float(parse_qs(url.query).get('delay', ['0'])[0]) / 1000
+
+        self.drain_body()
+        if delay > 0:
+            time.sleep(delay)
+
+        with paste_ids_lock:
+            paste_id = next(paste_ids)
+        paste_url = 'http://%s:%d/p/%d' % (self.server.server_address + (paste_id,))
+
+        if url.path == '/redirect':
+            self.send_response(302)
+            self.send_header('Location', paste_url)
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+        elif url.path == '/paste':
+            body = paste_url.encode()
+            self.send_response(200)
+            self.send_header('Content-Type', 'text/plain')
+            self.send_header('Content-Length', str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+        else:
+            self.send_error(404)
+
+    def do_HEAD(self):
+        self.send_response(200)
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+
+    def drain_body(self):
+        if self.headers.get('Transfer-Encoding', '').lower() == 'chunked':
+            while True:
+                size = int(self.rfile.readline().split(b';')[0], 16)
+                if size == 0:
+                    # trailers, then the blank line that ends the body
+                    while self.rfile.readline() not in (b'\r\n', b'\n', b''):
+                        pass
+                    return
+                self.read_exactly(size)
+                self.rfile.readline()
+        else:
+            self.read_exactly(int(self.headers.get('Content-Length', '0')))
+
+    def read_exactly(self, size):
+        while size > 0:
+            chunk = self.rfile.read(min(size, READ_SIZE))
+            if not chunk:
+                return
+            size -= len(chunk)
+
+    def log_message(self, format, *args):
+        pass
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--port', type=int, default=18765)
+    args = parser.parse_args()
+
+    server = ThreadingHTTPServer(('127.0.0.1', args.port), PasteHandler)
+    server.daemon_threads = True
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
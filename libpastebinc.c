@@ -0,0 +1,6580 @@
+/* libpastebinc.c:
+ *
+ * Copyright (C) 2011 Jeremy Thomerson - http://www.jeremythomerson.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "pastebinc-internal.h"
+
+/*
+ * Hash used by the compiled config cache's perfect hash tables: FNV-1a over
+ * both strings (with a separator), seeded by the displacement, then mixed so
+ * the low bits are usable for the modulo.
+ */
+uint64_t conf_hash(uint64_t seed, const char *a, const char *b) {
+  uint64_t h = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+
+  for (; *a; a++) {
+    h ^= (unsigned char) *a;
+    h *= 0x100000001b3ULL;
+  }
+  h ^= 0xff;
+  h *= 0x100000001b3ULL;
+  for (; *b; b++) {
+    h ^= (unsigned char) *b;
+    h *= 0x100000001b3ULL;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/*
+ * Builds a minimal-ish perfect hash ("hash and displace") for n string pairs:
+ * keys are grouped into buckets by their unseeded hash and each bucket gets
+ * the first displacement that puts all of its keys into free slots.  A lookup
+ * is then one bucket read, one hash and one compare.  Slots hold index + 1.
+ */
+void conf_build_phash(const char **a, const char **b, uint32_t n, struct conf_phash_build *ph) {
+  uint32_t *bucket_of, *order, *count, *start, *fill;
+  uint32_t i, j, k, d;
+  uint32_t *tried = NULL;
+
+  ph->m = n + n / 4 + 1;
+  ph->r = n / 4 + 1;
+
+  while (1) {
+    ph->slots = calloc(ph->m, sizeof(uint32_t));
+    ph->disp = calloc(ph->r, sizeof(uint32_t));
+    bucket_of = malloc((n + 1) * sizeof(uint32_t));
+    count = calloc(ph->r, sizeof(uint32_t));
+    start = calloc(ph->r + 1, sizeof(uint32_t));
+    fill = calloc(ph->r, sizeof(uint32_t));
+    order = malloc((n + 1) * sizeof(uint32_t));
+    tried = realloc(tried, (n + 1) * sizeof(uint32_t));
+
+    // counting sort of the keys by bucket
+    for (i = 0; i < n; i++) {
+      bucket_of[i] = conf_hash(0, a[i], b[i]) % ph->r;
+      count[bucket_of[i]]++;
+    }
+    for (i = 0; i < ph->r; i++)
+      start[i + 1] = start[i] + count[i];
+    for (i = 0; i < n; i++)
+      order[start[bucket_of[i]] + fill[bucket_of[i]]++] = i;
+
+    // place the biggest buckets first, while the table is still empty
+    for (k = n; k > 0; k--) {
+      for (i = 0; i < ph->r; i++) {
+        if (count[i] != k)
+          continue;
+
+        for (d = 1; d < (1 << 20); d++) {
+          for (j = 0; j < k; j++) {
+            uint32_t slot = conf_hash(d, a[order[start[i] + j]], b[order[start[i] + j]]) % ph->m;
+            uint32_t l;
+            if (ph->slots[slot] != 0)
+              break;
+            for (l = 0; l < j && tried[l] != slot; l++)
+              ;
+            if (l < j)
+              break;
+            tried[j] = slot;
+          }
+          if (j == k)
+            break;
+        }
+
+        if (d == (1 << 20))
+          goto grow;
+
+        ph->disp[i] = d;
+        for (j = 0; j < k; j++)
+          ph->slots[tried[j]] = order[start[i] + j] + 1;
+      }
+    }
+
+    free(bucket_of);
+    free(count);
+    free(start);
+    free(fill);
+    free(order);
+    free(tried);
+    return;
+
+grow:
+    free(ph->slots);
+    free(ph->disp);
+    free(bucket_of);
+    free(count);
+    free(start);
+    free(fill);
+    free(order);
+    ph->m *= 2;
+  }
+}
+
+/*
+ * Finds the slot for a string pair in one of the image's perfect hash tables.
+ * Returns the index stored there (which the caller must verify), or -1.
+ */
+int64_t conf_phash_lookup(const struct conf_image *img, uint32_t m, uint32_t r, uint32_t slots_off, uint32_t disp_off, const char *a, const char *b) {
+  const uint32_t *slots = (const uint32_t *)(img->base + slots_off);
+  const uint32_t *disp = (const uint32_t *)(img->base + disp_off);
+  uint32_t slot;
+
+  if (m == 0)
+    return -1;
+
+  slot = slots[conf_hash(disp[conf_hash(0, a, b) % r], a, b) % m];
+  return slot == 0 ? -1 : (int64_t) slot - 1;
+}
+
+const char *conf_str(const struct conf_image *img, uint32_t off) {
+  return img->base + img->hdr->strings + off;
+}
+
+const struct conf_entry *conf_entries(const struct conf_image *img) {
+  return (const struct conf_entry *)(img->base + img->hdr->entries);
+}
+
+const struct conf_value *conf_values(const struct conf_image *img) {
+  return (const struct conf_value *)(img->base + img->hdr->values);
+}
+
+/*
+ * Looks up a key in the compiled config.  Returns NULL if it isn't there.
+ */
+const struct conf_entry *conf_find(const struct conf_image *img, const char *group, const char *key) {
+  const struct conf_entry *entry;
+  int64_t idx;
+
+  if (img == NULL)
+    return NULL;
+
+  idx = conf_phash_lookup(img, img->hdr->key_slots, img->hdr->key_buckets, img->hdr->key_slot_tab, img->hdr->key_disp_tab, group, key);
+  if (idx < 0)
+    return NULL;
+
+  entry = &conf_entries(img)[idx];
+  if (strcmp(conf_str(img, entry->group), group) != 0 || strcmp(conf_str(img, entry->key), key) != 0)
+    return NULL;
+
+  return entry;
+}
+
+/*
+ * The value of a key in the compiled config, or NULL.  Points into the
+ * image, so it lives as long as the image and must not be freed.
+ */
+const char *conf_get(const struct conf_image *img, const char *group, const char *key) {
+  const struct conf_entry *entry = conf_find(img, group, key);
+  return entry != NULL ? conf_str(img, entry->value) : NULL;
+}
+
+int conf_has_key(const struct conf_image *img, const char *group, const char *key) {
+  return conf_find(img, group, key) != NULL;
+}
+
+int conf_get_int(const struct conf_image *img, const char *group, const char *key, int def) {
+  const char *value = conf_get(img, group, key);
+  return value != NULL ? atoi(value) : def;
+}
+
+/*
+ * The entries of a group in file order (count is 0 if there is no such group).
+ */
+const struct conf_entry *conf_group(const struct conf_image *img, const char *group, uint32_t *count) {
+  const struct conf_group *groups;
+  uint32_t i;
+
+  *count = 0;
+  if (img == NULL)
+    return NULL;
+
+  groups = (const struct conf_group *)(img->base + img->hdr->groups);
+  for (i = 0; i < img->hdr->ngroups; i++) {
+    if (strcmp(conf_str(img, groups[i].name), group) == 0) {
+      *count = groups[i].nentries;
+      return &conf_entries(img)[groups[i].first_entry];
+    }
+  }
+
+  return NULL;
+}
+
+int conf_has_group(const struct conf_image *img, const char *group) {
+  uint32_t count;
+  return conf_group(img, group, &count) != NULL;
+}
+
+/*
+ * Finds an allowed value (its post_value) of a [user_fields] field in O(1).
+ */
+const struct conf_value *conf_find_option(const struct conf_image *img, const char *field, const char *post_value) {
+  const struct conf_value *value;
+  int64_t idx;
+
+  if (img == NULL)
+    return NULL;
+
+  idx = conf_phash_lookup(img, img->hdr->opt_slots, img->hdr->opt_buckets, img->hdr->opt_slot_tab, img->hdr->opt_disp_tab, field, post_value);
+  if (idx < 0)
+    return NULL;
+
+  value = &conf_values(img)[idx];
+  if (strcmp(conf_str(img, value->field), field) != 0 || strcmp(conf_str(img, value->post_value), post_value) != 0)
+    return NULL;
+
+  return value;
+}
+
+/*
+ * Appends a string to the image's string pool, returning its offset.
+ */
+uint32_t conf_pool_add(GString *pool, const char *str) {
+  uint32_t off = pool->len;
+  g_string_append_len(pool, str, strlen(str) + 1);
+  return off;
+}
+
+/*
+ * Parses an INI file with GKeyFile and compiles it into a flat image: group,
+ * entry and user field value tables, perfect hash tables over (group, key)
+ * and (user field, allowed value), and a string pool.  All references are
+ * offsets, so the image can be written out and mmap'd back as is.
+ */
+char *conf_compile(const char *path, const struct stat *src, size_t *size) {
+  GKeyFile *keyfile = g_key_file_new();
+  GError *error = NULL;
+  GString *pool = g_string_new(NULL);
+  struct conf_cache_header hdr;
+  struct conf_group *groups = NULL;
+  struct conf_entry *entries = NULL;
+  struct conf_value *values = NULL;
+  const char **key_a = NULL, **key_b = NULL, **opt_a = NULL, **opt_b = NULL;
+  struct conf_phash_build keys, opts;
+  gchar **group_names, **group;
+  uint32_t nentries = 0, nvalues = 0, ngroups = 0, off, i;
+  char *image;
+
+  if (!g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, &error)) {
+    fprintf(stderr, "ERROR: can not load config file [%s]: %s\n", path, error->message);
+    g_error_free(error);
+    g_key_file_free(keyfile);
+    g_string_free(pool, TRUE);
+    return NULL;
+  }
+
+  group_names = g_key_file_get_groups(keyfile, NULL);
+  for (group = group_names; *group != NULL; group++) {
+    gchar **key_names = g_key_file_get_keys(keyfile, *group, NULL, NULL);
+    gchar **key;
+
+    groups = realloc(groups, (ngroups + 1) * sizeof(struct conf_group));
+    groups[ngroups].name = conf_pool_add(pool, *group);
+    groups[ngroups].first_entry = nentries;
+    groups[ngroups].nentries = 0;
+
+    for (key = key_names; *key != NULL; key++) {
+      gchar *value = g_key_file_get_string(keyfile, *group, *key, NULL);
+      struct conf_entry *entry;
+
+      entries = realloc(entries, (nentries + 1) * sizeof(struct conf_entry));
+      entry = &entries[nentries++];
+      entry->group = groups[ngroups].name;
+      entry->key = conf_pool_add(pool, *key);
+      entry->value = conf_pool_add(pool, value != NULL ? value : "");
+      entry->first_value = nvalues;
+      entry->nvalues = 0;
+      groups[ngroups].nentries++;
+      g_free(value);
+
+      // user fields are lists of post_value:user_value pairs
+      if (strcmp(*group, "user_fields") == 0) {
+        gchar **list = g_key_file_get_string_list(keyfile, *group, *key, NULL, NULL);
+        gchar **item;
+
+        for (item = list; item != NULL && *item != NULL; item++) {
+          char *sep = strchr(*item, ':');
+          if (**item == 0)
+            continue;
+          if (sep != NULL)
+            *sep++ = 0;
+
+          // a value listed twice would hash to the same slot every time, so
+          // only its first listing counts
+          for (i = entry->first_value; i < nvalues && strcmp(pool->str + values[i].post_value, *item) != 0; i++)
+            ;
+          if (i < nvalues)
+            continue;
+
+          values = realloc(values, (nvalues + 1) * sizeof(struct conf_value));
+          values[nvalues].field = entry->key;
+          values[nvalues].post_value = conf_pool_add(pool, *item);
+          values[nvalues].user_value = conf_pool_add(pool, sep != NULL ? sep : *item);
+          nvalues++;
+          entry->nvalues++;
+        }
+        g_strfreev(list);
+      }
+    }
+    ngroups++;
+    g_strfreev(key_names);
+  }
+  g_strfreev(group_names);
+  g_key_file_free(keyfile);
+
+  // the hash builders need the strings, so resolve them against the pool
+  key_a = malloc((nentries + 1) * sizeof(char *));
+  key_b = malloc((nentries + 1) * sizeof(char *));
+  for (i = 0; i < nentries; i++) {
+    key_a[i] = pool->str + entries[i].group;
+    key_b[i] = pool->str + entries[i].key;
+  }
+  opt_a = malloc((nvalues + 1) * sizeof(char *));
+  opt_b = malloc((nvalues + 1) * sizeof(char *));
+  for (i = 0; i < nvalues; i++) {
+    opt_a[i] = pool->str + values[i].field;
+    opt_b[i] = pool->str + values[i].post_value;
+  }
+  conf_build_phash(key_a, key_b, nentries, &keys);
+  conf_build_phash(opt_a, opt_b, nvalues, &opts);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = CONF_CACHE_MAGIC;
+  hdr.version = CONF_CACHE_VERSION;
+  hdr.src_mtime_sec = src->st_mtim.tv_sec;
+  hdr.src_mtime_nsec = src->st_mtim.tv_nsec;
+  hdr.src_size = src->st_size;
+  hdr.ngroups = ngroups;
+  hdr.nentries = nentries;
+  hdr.nvalues = nvalues;
+  hdr.key_slots = keys.m;
+  hdr.key_buckets = keys.r;
+  hdr.opt_slots = opts.m;
+  hdr.opt_buckets = opts.r;
+
+  off = sizeof(hdr);
+  hdr.groups = off;       off += ngroups * sizeof(struct conf_group);
+  hdr.entries = off;      off += nentries * sizeof(struct conf_entry);
+  hdr.values = off;       off += nvalues * sizeof(struct conf_value);
+  hdr.key_slot_tab = off; off += keys.m * sizeof(uint32_t);
+  hdr.key_disp_tab = off; off += keys.r * sizeof(uint32_t);
+  hdr.opt_slot_tab = off; off += opts.m * sizeof(uint32_t);
+  hdr.opt_disp_tab = off; off += opts.r * sizeof(uint32_t);
+  hdr.strings = off;      off += pool->len;
+  hdr.size = off;
+
+  image = malloc(off);
+  memcpy(image, &hdr, sizeof(hdr));
+  memcpy(image + hdr.groups, groups, ngroups * sizeof(struct conf_group));
+  memcpy(image + hdr.entries, entries, nentries * sizeof(struct conf_entry));
+  memcpy(image + hdr.values, values, nvalues * sizeof(struct conf_value));
+  memcpy(image + hdr.key_slot_tab, keys.slots, keys.m * sizeof(uint32_t));
+  memcpy(image + hdr.key_disp_tab, keys.disp, keys.r * sizeof(uint32_t));
+  memcpy(image + hdr.opt_slot_tab, opts.slots, opts.m * sizeof(uint32_t));
+  memcpy(image + hdr.opt_disp_tab, opts.disp, opts.r * sizeof(uint32_t));
+  memcpy(image + hdr.strings, pool->str, pool->len);
+  *size = off;
+
+  free(groups);
+  free(entries);
+  free(values);
+  free(key_a);
+  free(key_b);
+  free(opt_a);
+  free(opt_b);
+  free(keys.slots);
+  free(keys.disp);
+  free(opts.slots);
+  free(opts.disp);
+  g_string_free(pool, TRUE);
+
+  return image;
+}
+
+/*
+ * Whether a table of an image (count elements of elem bytes at off) lies
+ * within it, after the header.
+ */
+int conf_table_valid(size_t size, uint32_t off, uint32_t count, size_t elem) {
+  return off >= sizeof(struct conf_cache_header) && off % sizeof(uint32_t) == 0
+    && off <= size && (uint64_t) count * elem <= size - off;
+}
+
+/*
+ * Checks a cache image before it is trusted: every table and every offset
+ * into the tables and the string pool has to be inside the image, and the
+ * pool has to end in a NUL.  A cache that was cut short or damaged fails
+ * this and gets compiled again.
+ */
+int conf_image_valid(const char *base, size_t size) {
+  const struct conf_cache_header *hdr = (const struct conf_cache_header *) base;
+  const struct conf_group *groups;
+  const struct conf_entry *entries;
+  const struct conf_value *values;
+  const uint32_t *slots;
+  size_t pool;
+  uint32_t i;
+
+  if (!conf_table_valid(size, hdr->groups, hdr->ngroups, sizeof(struct conf_group))
+      || !conf_table_valid(size, hdr->entries, hdr->nentries, sizeof(struct conf_entry))
+      || !conf_table_valid(size, hdr->values, hdr->nvalues, sizeof(struct conf_value))
+      || !conf_table_valid(size, hdr->key_slot_tab, hdr->key_slots, sizeof(uint32_t))
+      || !conf_table_valid(size, hdr->key_disp_tab, hdr->key_buckets, sizeof(uint32_t))
+      || !conf_table_valid(size, hdr->opt_slot_tab, hdr->opt_slots, sizeof(uint32_t))
+      || !conf_table_valid(size, hdr->opt_disp_tab, hdr->opt_buckets, sizeof(uint32_t))
+      || hdr->strings < sizeof(struct conf_cache_header) || hdr->strings > size)
+    return 0;
+
+  // lookups take the slot modulo m and the bucket modulo r
+  if ((hdr->key_slots > 0 && hdr->key_buckets == 0) || (hdr->opt_slots > 0 && hdr->opt_buckets == 0))
+    return 0;
+
+  pool = size - hdr->strings;
+  if (pool > 0 && base[size - 1] != 0)
+    return 0;
+
+  groups = (const struct conf_group *)(base + hdr->groups);
+  for (i = 0; i < hdr->ngroups; i++) {
+    if (groups[i].name >= pool || groups[i].first_entry > hdr->nentries
+        || groups[i].nentries > hdr->nentries - groups[i].first_entry)
+      return 0;
+  }
+
+  entries = (const struct conf_entry *)(base + hdr->entries);
+  for (i = 0; i < hdr->nentries; i++) {
+    if (entries[i].group >= pool || entries[i].key >= pool || entries[i].value >= pool
+        || entries[i].first_value > hdr->nvalues || entries[i].nvalues > hdr->nvalues - entries[i].first_value)
+      return 0;
+  }
+
+  values = (const struct conf_value *)(base + hdr->values);
+  for (i = 0; i < hdr->nvalues; i++) {
+    if (values[i].field >= pool || values[i].post_value >= pool || values[i].user_value >= pool)
+      return 0;
+  }
+
+  // slots hold an index + 1, or 0 for an empty slot
+  slots = (const uint32_t *)(base + hdr->key_slot_tab);
+  for (i = 0; i < hdr->key_slots; i++) {
+    if (slots[i] > hdr->nentries)
+      return 0;
+  }
+  slots = (const uint32_t *)(base + hdr->opt_slot_tab);
+  for (i = 0; i < hdr->opt_slots; i++) {
+    if (slots[i] > hdr->nvalues)
+      return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Loads a config file through its compiled cache in the user's cache dir.
+ * If the cache matches the file's mtime and size it is simply mmap'd;
+ * otherwise the file is compiled and the cache rewritten (atomically) for
+ * next time.  Returns NULL if the config file can not be loaded.
+ */
+struct conf_image *conf_load(const char *path, int verbose) {
+  struct conf_image *img;
+  const struct conf_cache_header *hdr;
+  struct stat src, st;
+  char *abspath, *base, *cachedir, *cachefile, *tmpfile, *p;
+  const char *name;
+  char *image;
+  size_t size;
+  int fd, written;
+
+  if (stat(path, &src) == -1)
+    return NULL;
+
+  img = calloc(1, sizeof(struct conf_image));
+
+  // named by a hash of the full path, so different paths can't collide
+  // (realpath can still fail, say on a dir we can't search; then the path
+  // as given will do)
+  abspath = realpath(path, NULL);
+  name = abspath != NULL ? abspath : path;
+  base = g_path_get_basename(name);
+  cachedir = g_build_filename(g_get_user_cache_dir(), PROGNAME, NULL);
+  p = g_strdup_printf("%s-%016" G_GINT64_MODIFIER "x.cache", base, conf_hash(0, name, ""));
+  cachefile = g_build_filename(cachedir, p, NULL);
+  g_free(p);
+  g_free(base);
+  free(abspath);
+
+  if ((fd = open(cachefile, O_RDONLY)) != -1) {
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct conf_cache_header)
+        && (image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+      hdr = (const struct conf_cache_header *) image;
+      if (hdr->magic == CONF_CACHE_MAGIC && hdr->version == CONF_CACHE_VERSION && hdr->size == st.st_size
+          && hdr->src_mtime_sec == src.st_mtim.tv_sec && hdr->src_mtime_nsec == src.st_mtim.tv_nsec
+          && hdr->src_size == src.st_size && conf_image_valid(image, st.st_size)) {
+        img->base = image;
+        img->size = st.st_size;
+        img->mapped = 1;
+      } else {
+        munmap(image, st.st_size);
+      }
+    }
+    close(fd);
+  }
+
+  if (img->base == NULL) {
+    if ((image = conf_compile(path, &src, &size)) == NULL) {
+      free(img);
+      g_free(cachedir);
+      g_free(cachefile);
+      return NULL;
+    }
+    img->base = image;
+    img->size = size;
+
+    // failing to write the cache only costs us the compile next time
+    tmpfile = g_strdup_printf("%s.%d", cachefile, getpid());
+    if (g_mkdir_with_parents(cachedir, 0700) == 0 && (fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0600)) != -1) {
+      written = write(fd, image, size) == size;
+      if (close(fd) == 0 && written)
+        rename(tmpfile, cachefile);
+      else
+        unlink(tmpfile);
+    }
+    g_free(tmpfile);
+
+    if (verbose)
+      fprintf(stderr, "DEBUG: compiled config cache: %s\n", cachefile);
+  } else if (verbose) {
+    fprintf(stderr, "DEBUG: using config cache: %s\n", cachefile);
+  }
+
+  img->hdr = (const struct conf_cache_header *) img->base;
+  g_free(cachedir);
+  g_free(cachefile);
+  return img;
+}
+
+void conf_free(struct conf_image *img) {
+  if (img == NULL)
+    return;
+
+  if (img->mapped)
+    munmap((void *) img->base, img->size);
+  else
+    free((void *) img->base);
+  free(img);
+}
+
+/*
+ * Streaming XXH64, used to fingerprint the input for the dedupe cache.  It
+ * runs over a mapping of the tmp file once the input is spooled (see
+ * write_input_to_paste_info), at several GB/s.
+ */
+uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME64_2;
+  acc = (acc << 31) | (acc >> 33);
+  return acc * XXH_PRIME64_1;
+}
+
+uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh64_round(0, val);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t xxh64_read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return GUINT64_FROM_LE(v);
+}
+
+uint32_t xxh64_read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return GUINT32_FROM_LE(v);
+}
+
+void xxh64_init(struct xxh64_state *st) {
+  memset(st, 0, sizeof(struct xxh64_state));
+  st->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+  st->v[1] = XXH_PRIME64_2;
+  st->v[2] = 0;
+  st->v[3] = -XXH_PRIME64_1;
+}
+
+void xxh64_update(struct xxh64_state *st, const void *data, size_t len) {
+  const unsigned char *p = data;
+  const unsigned char *end = p + len;
+  int i;
+
+  st->total += len;
+
+  if (st->buflen + len < 32) {
+    memcpy(st->buf + st->buflen, p, len);
+    st->buflen += len;
+    return;
+  }
+
+  if (st->buflen > 0) {
+    memcpy(st->buf + st->buflen, p, 32 - st->buflen);
+    p += 32 - st->buflen;
+    for (i = 0; i < 4; i++)
+      st->v[i] = xxh64_round(st->v[i], xxh64_read64(st->buf + i * 8));
+    st->buflen = 0;
+  }
+
+  for (; p + 32 <= end; p += 32) {
+    st->v[0] = xxh64_round(st->v[0], xxh64_read64(p));
+    st->v[1] = xxh64_round(st->v[1], xxh64_read64(p + 8));
+    st->v[2] = xxh64_round(st->v[2], xxh64_read64(p + 16));
+    st->v[3] = xxh64_round(st->v[3], xxh64_read64(p + 24));
+  }
+
+  memcpy(st->buf, p, end - p);
+  st->buflen = end - p;
+}
+
+uint64_t xxh64_digest(const struct xxh64_state *st) {
+  const unsigned char *p = st->buf;
+  const unsigned char *end = p + st->buflen;
+  uint64_t h;
+
+  if (st->total >= 32) {
+    h = ((st->v[0] << 1) | (st->v[0] >> 63)) + ((st->v[1] << 7) | (st->v[1] >> 57))
+      + ((st->v[2] << 12) | (st->v[2] >> 52)) + ((st->v[3] << 18) | (st->v[3] >> 46));
+    h = xxh64_merge(h, st->v[0]);
+    h = xxh64_merge(h, st->v[1]);
+    h = xxh64_merge(h, st->v[2]);
+    h = xxh64_merge(h, st->v[3]);
+  } else {
+    h = st->v[2] + XXH_PRIME64_5;
+  }
+  h += st->total;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh64_round(0, xxh64_read64(p));
+    h = ((h << 27) | (h >> 37)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t) xxh64_read32(p) * XXH_PRIME64_1;
+    h = ((h << 23) | (h >> 41)) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= (*p) * XXH_PRIME64_5;
+    h = ((h << 11) | (h >> 53)) * XXH_PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+/*
+ * Writes all of buf to fd, riding out short writes and EINTR.
+ */
+int write_all(int fd, const char *buf, size_t len) {
+  ssize_t written;
+
+  while (len > 0) {
+    if ((written = write(fd, buf, len)) == -1) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    buf += written;
+    len -= written;
+  }
+  return 0;
+}
+
+/*
+ * The tee engine: copies all of stdin to out (the tmp file, or the socket to
+ * the daemon), echoing it to stdout when echo is set.  When stdin (and, when
+ * echoing, stdout) is a pipe the data never comes into userspace: tee(2)
+ * duplicates it onto stdout and splice(2) moves it to out.  Otherwise, or if
+ * the kernel can't splice to out, it falls back to large read()/write()s.
+ * Returns the number of bytes copied, or -1 on error.
+ */
+ssize_t tee_input(int out, int echo) {
+  struct stat st;
+  ssize_t n, total = 0;
+  size_t echoed = 0, skip; // echoed: on stdout already, not yet in out
+  char *buf;
+  int zero_copy;
+
+  zero_copy = fstat(STDIN_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+  if (zero_copy && echo)
+    zero_copy = fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+
+  // anything already in the stdio buffer has to come out first
+  if (echo)
+    fflush(stdout);
+
+  if (zero_copy) {
+    // bigger pipes mean fewer trips into the kernel; fine if we can't
+    fcntl(STDIN_FILENO, F_SETPIPE_SZ, TEE_CHUNK);
+    if (echo)
+      fcntl(STDOUT_FILENO, F_SETPIPE_SZ, TEE_CHUNK);
+  }
+
+  while (zero_copy) {
+    if (echo && echoed == 0) {
+      n = tee(STDIN_FILENO, STDOUT_FILENO, TEE_CHUNK, 0);
+      if (n == 0)
+        return total;
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == -1 && errno == EINVAL && total == 0) {
+        zero_copy = 0;
+        break;
+      }
+      if (n == -1) {
+        fprintf(stderr, "Error copying input to stdout: %s\n", strerror(errno));
+        return -1;
+      }
+      echoed = n;
+    }
+
+    n = splice(STDIN_FILENO, NULL, out, NULL, echo ? echoed : TEE_CHUNK, SPLICE_F_MOVE);
+    if (n == 0 && !echo)
+      return total;
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EINVAL && total == 0) {
+      zero_copy = 0; // whatever was echoed still has to go to out
+      break;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "Error copying input: %s\n", n == 0 ? "unexpected end of input" : strerror(errno));
+      return -1;
+    }
+    total += n;
+    if (echo)
+      echoed -= n;
+  }
+
+  if ((buf = malloc(TEE_CHUNK)) == NULL) {
+    fprintf(stderr, "Error allocating %d memory for stdin read buffer: %s\n", TEE_CHUNK, strerror(errno));
+    return -1;
+  }
+
+  while ((n = read(STDIN_FILENO, buf, TEE_CHUNK)) != 0) {
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+      total = -1;
+      break;
+    }
+
+    skip = MIN(echoed, (size_t) n);
+    echoed -= skip;
+    if (echo && write_all(STDOUT_FILENO, buf + skip, n - skip)) {
+      fprintf(stderr, "Error copying input to stdout: %s\n", strerror(errno));
+      total = -1;
+      break;
+    }
+    if (write_all(out, buf, n)) {
+      fprintf(stderr, "Error copying input: %s\n", strerror(errno));
+      total = -1;
+      break;
+    }
+    total += n;
+  }
+
+  free(buf);
+  return total;
+}
+
+/*
+ * Takes stdin input and writes it to a temporary file that will be used
+ * to post to a pastebin site.  Fills paste_info with the appropriate info
+ * about what it did (file path and pointer to written file).
+ */
+int write_input_to_paste_info(struct pastebinc_config *config, struct paste_info *pi) {
+  ssize_t copied;
+  char *data;
+
+  strcpy(pi->tmpname, TMPNAME);
+
+  if ((pi->fd = mkstemp(pi->tmpname)) == -1 || (pi->content = fdopen(pi->fd, "w+")) == NULL) {
+    if (pi->fd != -1) {
+      unlink(pi->tmpname);
+      close(pi->fd);
+    }
+    fprintf(stderr, "Error opening tmp file (%s): %s\n", pi->tmpname, strerror(errno));
+    return 1;
+  }
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: Writing to tmp file: %s\n", pi->tmpname);
+
+  if (config->keep)
+    copied = keep_input(config, pi->fd);
+  else if (config->redact != NULL || config->normalize)
+    copied = redact_input(config, pi->fd);
+  else
+    copied = tee_input(pi->fd, config->tee);
+  if (copied == -1)
+    return 1;
+  pi->bytes_read = copied;
+
+  // the dedupe cache key; hashed from the page cache since the input may
+  // never have passed through our buffers
+  if (config->dedupe && copied > 0) {
+    if ((data = mmap(NULL, copied, PROT_READ, MAP_SHARED, pi->fd, 0)) == MAP_FAILED) {
+      fprintf(stderr, "Error mapping tmp file (%s): %s\n", pi->tmpname, strerror(errno));
+      return 1;
+    }
+    madvise(data, copied, MADV_SEQUENTIAL);
+    xxh64_update(&pi->hash, data, copied);
+    munmap(data, copied);
+  }
+
+  return 0;
+}
+
+/*
+ * Reads the next piece of input for a paste: first anything left in the
+ * paste_info prefix, then whatever one read() of its fd returns.  Echoes the
+ * data to stdout when teeing.  Returns 0 at EOF and -1 on error.
+ */
+ssize_t paste_raw_read(struct paste_info *pi, char *buffer, size_t len) {
+  ssize_t readval;
+
+  if (pi->prefix_len > 0) {
+    readval = pi->prefix_len < len ? pi->prefix_len : len;
+    memcpy(buffer, pi->prefix, readval);
+    pi->prefix += readval;
+    pi->prefix_len -= readval;
+    pi->bytes_read += readval;
+    return readval;
+  }
+
+  if (pi->fd == -1) // content was all in the prefix
+    return 0;
+
+  do {
+    readval = read(pi->fd, buffer, len);
+  } while (readval == -1 && errno == EINTR);
+
+  if (readval == -1) {
+    fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (pi->tee && readval > 0)
+    fwrite(buffer, 1, readval, stdout);
+
+  pi->bytes_read += readval;
+  return readval;
+}
+
+/*
+ * Checks the UTF-8 sequence at p, whose first byte is not ASCII, against
+ * the well-formed byte ranges of the Unicode standard (so no overlong forms,
+ * surrogates or code points past U+10FFFF).  Returns its length if it is
+ * valid, 0 if the data ends before it does, or minus the length of its
+ * longest valid start (at least 1) if it is bad.
+ */
+int utf8_sequence(const unsigned char *p, size_t avail) {
+  unsigned char lo = 0x80, hi = 0xbf;
+  int len, i;
+
+  if (p[0] >= 0xc2 && p[0] <= 0xdf)
+    len = 2;
+  else if (p[0] >= 0xe0 && p[0] <= 0xef)
+    len = 3;
+  else if (p[0] >= 0xf0 && p[0] <= 0xf4)
+    len = 4;
+  else
+    return -1;
+
+  if (p[0] == 0xe0)
+    lo = 0xa0;
+  else if (p[0] == 0xed)
+    hi = 0x9f;
+  else if (p[0] == 0xf0)
+    lo = 0x90;
+  else if (p[0] == 0xf4)
+    hi = 0x8f;
+
+  for (i = 1; i < len; i++) {
+    if (i >= avail)
+      return 0;
+    if (p[i] < lo || p[i] > hi)
+      return -i;
+    lo = 0x80;
+    hi = 0xbf;
+  }
+  return len;
+}
+
+/*
+ * Finds the next byte at or after pos that one of the stages has to look
+ * at: a non-ASCII byte, ESC or CR.  With SSE2 that is 16 bytes at a time,
+ * so plain ASCII text is copied through at memory speed.  Returns len if
+ * there is none.
+ */
+size_t normalize_next_special(int stages, const unsigned char *buf, size_t pos, size_t len) {
+  int utf8 = stages & (NORMALIZE_UTF8 | NORMALIZE_UTF8_FIX);
+
+#ifdef __SSE2__
+  __m128i esc = _mm_set1_epi8(0x1b), cr = _mm_set1_epi8('\r');
+
+  for (; pos + 16 <= len; pos += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(buf + pos));
+    int mask = utf8 ? _mm_movemask_epi8(block) : 0;
+
+    if (stages & NORMALIZE_ANSI)
+      mask |= _mm_movemask_epi8(_mm_cmpeq_epi8(block, esc));
+    if (stages & NORMALIZE_CRLF)
+      mask |= _mm_movemask_epi8(_mm_cmpeq_epi8(block, cr));
+    if (mask != 0)
+      return pos + __builtin_ctz(mask);
+  }
+#endif
+
+  for (; pos < len; pos++) {
+    if ((utf8 && buf[pos] >= 0x80) || ((stages & NORMALIZE_ANSI) && buf[pos] == 0x1b)
+        || ((stages & NORMALIZE_CRLF) && buf[pos] == '\r'))
+      return pos;
+  }
+  return len;
+}
+
+/*
+ * Feeds one byte of an ANSI/VT escape sequence (ECMA-48: CSI, OSC and the
+ * other string controls, and plain ESC sequences) to the parser.  Returns 1
+ * if the byte is not part of the sequence after all and has to be looked at
+ * as text.
+ */
+int normalize_escape(struct normalize_stream *ns, unsigned char c) {
+  switch (ns->escape) {
+    case ESC_START:
+      if (c == '[')
+        ns->escape = ESC_CSI;
+      else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+        ns->escape = ESC_STRING;
+      else if (c >= 0x20 && c <= 0x2f)
+        ns->escape = ESC_INTERMEDIATE;
+      else if (c >= 0x30 && c <= 0x7e)
+        ns->escape = ESC_NONE;
+      else
+        break;
+      return 0;
+    case ESC_INTERMEDIATE:
+      if (c >= 0x20 && c <= 0x7e) {
+        if (c >= 0x30)
+          ns->escape = ESC_NONE;
+        return 0;
+      }
+      break;
+    case ESC_CSI:
+      if (c >= 0x20 && c <= 0x7e) {
+        if (c >= 0x40)
+          ns->escape = ESC_NONE;
+        return 0;
+      }
+      break;
+    case ESC_STRING:
+      // ended by BEL or ST (ESC \); a newline means it was never going to be
+      if (c == 0x07)
+        ns->escape = ESC_NONE;
+      else if (c == 0x1b)
+        ns->escape = ESC_STRING_END;
+      else if (c == '\n')
+        break;
+      return 0;
+    case ESC_STRING_END:
+      if (c == '\\') {
+        ns->escape = ESC_NONE;
+        return 0;
+      }
+      // the ESC starts a sequence of its own
+      ns->escape = ESC_START;
+      ns->escapes++;
+      return normalize_escape(ns, c);
+  }
+
+  ns->escape = ESC_NONE;
+  return 1;
+}
+
+/*
+ * Normalizes the len bytes at ns->in into ns->out.  What can't be decided
+ * until more input comes (a UTF-8 sequence or a CR at the very end) is moved
+ * to the start of ns->in.  Returns -1 if the input is not valid UTF-8 and
+ * that is an error.
+ */
+int normalize_chunk(struct normalize_stream *ns, size_t len) {
+  const unsigned char *in = (const unsigned char *) ns->in;
+  char *out = ns->out;
+  size_t pos = 0, next, o = 0;
+  int n;
+
+  while (pos < len) {
+    if (ns->escape != ESC_NONE) {
+      if (!normalize_escape(ns, in[pos]))
+        pos++;
+      continue;
+    }
+
+    next = normalize_next_special(ns->stages, in, pos, len);
+    memcpy(out + o, in + pos, next - pos);
+    o += next - pos;
+    if ((pos = next) == len)
+      break;
+
+    if (in[pos] == 0x1b) {
+      ns->escape = ESC_START;
+      ns->escapes++;
+      pos++;
+    } else if (in[pos] == '\r') {
+      if (pos + 1 == len && !ns->eof)
+        break;
+      out[o++] = '\n';
+      ns->endings++;
+      pos += pos + 1 < len && in[pos + 1] == '\n' ? 2 : 1;
+    } else {
+      if ((n = utf8_sequence(in + pos, len - pos)) == 0) {
+        if (!ns->eof)
+          break;
+        n = -(int)(len - pos);
+      }
+      if (n > 0) {
+        memcpy(out + o, in + pos, n);
+        o += n;
+        pos += n;
+      } else if (ns->stages & NORMALIZE_UTF8) {
+        fprintf(stderr, "ERROR: the input is not valid UTF-8 (at byte %zu); -N utf8fix replaces what is not\n", ns->offset + pos);
+        return -1;
+      } else {
+        memcpy(out + o, "\xef\xbf\xbd", 3); // U+FFFD REPLACEMENT CHARACTER
+        o += 3;
+        ns->repairs++;
+        pos += -n;
+      }
+    }
+  }
+
+  memmove(ns->in, ns->in + pos, len - pos);
+  ns->carried = len - pos;
+  ns->offset += pos;
+  ns->start = 0;
+  ns->end = o;
+  return 0;
+}
+
+/*
+ * Puts a normalization stage in front of a paste's input, if -N asked for
+ * one.  It sits below redaction, so patterns see the normalized text.
+ */
+void start_normalization(struct pastebinc_config *config, struct paste_info *pi) {
+  if (!config->normalize)
+    return;
+
+  pi->normalize = calloc(1, sizeof(struct normalize_stream));
+  pi->normalize->stages = config->normalize;
+  pi->normalize->in = malloc(NORMALIZE_CHUNK);
+  // a bad byte becomes the 3 byte U+FFFD
+  pi->normalize->out = malloc(NORMALIZE_CHUNK * 3);
+}
+
+void finish_normalization(struct pastebinc_config *config, struct paste_info *pi) {
+  struct normalize_stream *ns = pi->normalize;
+
+  if (ns == NULL)
+    return;
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: normalized input: %zu escape sequences stripped, %zu line endings folded, %zu bad UTF-8 sequences replaced\n",
+            ns->escapes, ns->endings, ns->repairs);
+
+  free(ns->in);
+  free(ns->out);
+  free(ns);
+  pi->normalize = NULL;
+}
+
+/*
+ * Reads the next piece of a paste's raw input, through the normalization
+ * stage if it has one.  Returns 0 at EOF and -1 on error (including input
+ * that -N utf8 rejects).
+ */
+ssize_t paste_source_read(struct paste_info *pi, char *buffer, size_t len) {
+  struct normalize_stream *ns = pi->normalize;
+  ssize_t readval;
+  size_t avail;
+
+  if (ns == NULL)
+    return paste_raw_read(pi, buffer, len);
+
+  while (ns->start == ns->end) {
+    if (ns->eof)
+      return 0;
+    if ((readval = paste_raw_read(pi, ns->in + ns->carried, NORMALIZE_CHUNK - ns->carried)) == -1)
+      return -1;
+    ns->eof = readval == 0;
+    if (normalize_chunk(ns, ns->carried + readval) == -1)
+      return -1;
+  }
+
+  avail = MIN(ns->end - ns->start, len);
+  memcpy(buffer, ns->out + ns->start, avail);
+  ns->start += avail;
+  return avail;
+}
+
+/*
+ * The fixed text a pattern always starts with: everything up to the first
+ * regex syntax, less the last character if a quantifier follows it.  A
+ * leading (?i) makes it caseless.  Patterns with alternatives have none, as
+ * do those starting with any other syntax.
+ */
+void redact_literal(struct redact_rule *rule, const char *pattern) {
+  size_t len;
+
+  if (strncmp(pattern, "(?i)", 4) == 0) {
+    rule->caseless = 1;
+    pattern += 4;
+  }
+  if (strchr(pattern, '|') != NULL)
+    return;
+
+  len = strcspn(pattern, "\\^$.|?*+()[]{}");
+  if (len > 0 && pattern[len] != 0 && strchr("?*{", pattern[len]) != NULL)
+    len--;
+
+  if (len > 0) {
+    rule->literal = g_strndup(pattern, len);
+    rule->literal_len = len;
+  }
+}
+
+/*
+ * Whether a pattern refers to its own groups, by number or by name (or
+ * names them at all), which only works in a regex of its own: in the one
+ * regex its groups are renumbered and names can clash.  Errs on the side of
+ * yes, which only costs speed.
+ */
+int redact_needs_own_regex(const char *pattern) {
+  const char *p;
+
+  for (p = pattern; *p != 0; p++) {
+    if (*p == '\\') {
+      if (p[1] == 0)
+        break;
+      p++;
+      if ((*p >= '1' && *p <= '9') || *p == 'g' || *p == 'k')
+        return 1;
+    } else if (p[0] == '(' && p[1] == '?') {
+      char c = p[2];
+      if (c == 'P' || c == '\'' || c == '&' || c == 'R' || (c >= '0' && c <= '9')
+          || ((c == '+' || c == '-') && p[3] >= '0' && p[3] <= '9') || (c == '<' && p[3] != '=' && p[3] != '!'))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Adds a pattern to a redactor; it is only searched for once the redactor
+ * is compiled.  what says where the pattern came from, for errors.
+ */
+int redactor_add_rule(struct redactor *redactor, const char *what, const char *name, const char *pattern) {
+  struct redact_rule *rule;
+  GError *error = NULL;
+  GRegex *regex;
+
+  // compiled on its own first, to blame the right pattern and count its groups
+  if ((regex = g_regex_new(pattern, G_REGEX_RAW, 0, &error)) == NULL) {
+    fprintf(stderr, "ERROR: bad %s pattern %s: %s\n", what, name, error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  redactor->rules = realloc(redactor->rules, (redactor->nrules + 1) * sizeof(struct redact_rule));
+  rule = &redactor->rules[redactor->nrules];
+  memset(rule, 0, sizeof(struct redact_rule));
+  rule->name = g_strdup(name);
+  rule->pattern = g_strdup(pattern);
+  rule->ngroups = g_regex_get_capture_count(regex);
+  redact_literal(rule, pattern);
+  g_regex_unref(regex);
+  redactor->nrules++;
+  return 0;
+}
+
+/*
+ * Compiles all of a redactor's patterns into the one regex (again), apart
+ * from those that need one of their own, and works out whether the one
+ * regex can be prefiltered on their literals.
+ */
+int redactor_compile(struct redactor *redactor, const char *what, int verbose) {
+  GString *source;
+  GError *error = NULL;
+  int j, group = 1, alone = 0;
+
+  // one alternative, in a group of its own, per pattern
+  source = g_string_new(NULL);
+  redactor->prefilter = 1;
+  memset(redactor->first, 0, sizeof(redactor->first));
+  for (j = 0; j < redactor->nrules; j++) {
+    struct redact_rule *rule = &redactor->rules[j];
+
+    if (rule->regex != NULL || redact_needs_own_regex(rule->pattern)) {
+      // checked by redactor_add_rule, so this compiles
+      if (rule->regex == NULL)
+        rule->regex = g_regex_new(rule->pattern, G_REGEX_RAW | G_REGEX_OPTIMIZE, 0, NULL);
+      rule->group = 0;
+      alone++;
+      continue;
+    }
+
+    g_string_append_printf(source, "%s(%s)", source->len > 0 ? "|" : "", rule->pattern);
+    rule->group = group;
+    group += 1 + rule->ngroups;
+
+    if (rule->literal == NULL) {
+      redactor->prefilter = 0;
+    } else {
+      redactor->first[(unsigned char) rule->literal[0]] = 1;
+      if (rule->caseless) {
+        redactor->first[(unsigned char) g_ascii_tolower(rule->literal[0])] = 1;
+        redactor->first[(unsigned char) g_ascii_toupper(rule->literal[0])] = 1;
+      }
+    }
+  }
+
+  if (redactor->regex != NULL)
+    g_regex_unref(redactor->regex);
+  redactor->regex = NULL;
+  if (alone == redactor->nrules)
+    redactor->prefilter = 0;
+  else if ((redactor->regex = g_regex_new(source->str, G_REGEX_RAW | G_REGEX_OPTIMIZE, 0, &error)) == NULL) {
+    fprintf(stderr, "ERROR: the %s patterns don't work together: %s\n", what, error->message);
+    g_error_free(error);
+    g_string_free(source, TRUE);
+    return 1;
+  }
+  g_string_free(source, TRUE);
+
+  if (verbose) {
+    fprintf(stderr, "DEBUG: %d %s patterns, %s\n", redactor->nrules - alone, what,
+      redactor->prefilter ? "prefiltered on their first bytes" : "searched with the regex (not every pattern starts with a literal)");
+    if (alone > 0)
+      fprintf(stderr, "DEBUG: %d %s patterns refer to their own groups and are searched with regexes of their own\n", alone, what);
+  }
+  return 0;
+}
+
+/*
+ * Adds the patterns in a config file's [redact] section (name=pattern) and
+ * compiles all patterns loaded so far into the one regex again.
+ */
+int load_redact_rules(struct pastebinc_config *config, const struct conf_image *img) {
+  const struct conf_entry *entries;
+  uint32_t count, i;
+
+  if ((entries = conf_group(img, "redact", &count)) == NULL || count == 0)
+    return 0;
+
+  if (config->redact == NULL)
+    config->redact = calloc(1, sizeof(struct redactor));
+
+  for (i = 0; i < count; i++) {
+    if (redactor_add_rule(config->redact, "[redact]", conf_str(img, entries[i].key), conf_str(img, entries[i].value)))
+      return 1;
+  }
+
+  return redactor_compile(config->redact, "[redact]", config->verbose);
+}
+
+/*
+ * Adds a -T pattern: the flight recorder takes a snapshot when it matches.
+ */
+int add_trigger_pattern(struct pastebinc_config *config, const char *pattern) {
+  if (config->trigger == NULL)
+    config->trigger = calloc(1, sizeof(struct redactor));
+  return redactor_add_rule(config->trigger, "-T", pattern, pattern);
+}
+
+void redactor_free(struct redactor *redactor) {
+  int i;
+
+  if (redactor == NULL)
+    return;
+
+  for (i = 0; i < redactor->nrules; i++) {
+    g_free(redactor->rules[i].name);
+    g_free(redactor->rules[i].pattern);
+    g_free(redactor->rules[i].literal);
+    if (redactor->rules[i].regex != NULL)
+      g_regex_unref(redactor->rules[i].regex);
+  }
+  if (redactor->regex != NULL)
+    g_regex_unref(redactor->regex);
+  free(redactor->rules);
+  free(redactor);
+}
+
+/*
+ * Finds the next position at or after pos where one of the literals may
+ * start.  With SSE2 that is 16 positions at a time, checking both the first
+ * and the last byte of each literal, which few places in ordinary text have
+ * by chance.  Returns len if there is none.
+ */
+size_t redact_next_candidate(const struct redactor *redactor, const unsigned char *buf, size_t pos, size_t len) {
+#ifdef __SSE2__
+  if (redactor->nrules <= REDACT_SIMD_RULES) {
+    __m128i first[REDACT_SIMD_RULES][2], last[REDACT_SIMD_RULES][2];
+    size_t offset[REDACT_SIMD_RULES], reach = 0;
+    int i, n = 0;
+
+    for (i = 0; i < redactor->nrules; i++) {
+      const struct redact_rule *rule = &redactor->rules[i];
+      char f, l;
+
+      if (rule->regex != NULL)
+        continue;
+      f = rule->literal[0];
+      l = rule->literal[rule->literal_len - 1];
+      offset[n] = rule->literal_len - 1;
+      reach = MAX(reach, offset[n]);
+      first[n][0] = _mm_set1_epi8(rule->caseless ? g_ascii_tolower(f) : f);
+      first[n][1] = _mm_set1_epi8(rule->caseless ? g_ascii_toupper(f) : f);
+      last[n][0] = _mm_set1_epi8(rule->caseless ? g_ascii_tolower(l) : l);
+      last[n][1] = _mm_set1_epi8(rule->caseless ? g_ascii_toupper(l) : l);
+      n++;
+    }
+
+    for (; pos + 16 + reach <= len; pos += 16) {
+      __m128i head = _mm_loadu_si128((const __m128i *)(buf + pos));
+      __m128i found = _mm_setzero_si128();
+      int mask;
+
+      for (i = 0; i < n; i++) {
+        __m128i tail = _mm_loadu_si128((const __m128i *)(buf + pos + offset[i]));
+        __m128i f = _mm_or_si128(_mm_cmpeq_epi8(head, first[i][0]), _mm_cmpeq_epi8(head, first[i][1]));
+        __m128i l = _mm_or_si128(_mm_cmpeq_epi8(tail, last[i][0]), _mm_cmpeq_epi8(tail, last[i][1]));
+        found = _mm_or_si128(found, _mm_and_si128(f, l));
+      }
+      if ((mask = _mm_movemask_epi8(found)) != 0)
+        return pos + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for (; pos < len; pos++) {
+    if (redactor->first[buf[pos]])
+      return pos;
+  }
+  return len;
+}
+
+int redact_literal_at(const struct redactor *redactor, const char *p, size_t avail) {
+  int i;
+
+  for (i = 0; i < redactor->nrules; i++) {
+    const struct redact_rule *rule = &redactor->rules[i];
+    if (rule->regex == NULL && rule->literal_len <= avail && (rule->caseless ? g_ascii_strncasecmp(p, rule->literal, rule->literal_len)
+                                                      : memcmp(p, rule->literal, rule->literal_len)) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Masks what a match covers: the first group of the pattern that matched if
+ * it has groups, else the whole match.
+ */
+void redact_mask(const struct redactor *redactor, char *buf, GMatchInfo *info) {
+  gint start = -1, end = -1, group_start = -1, group_end = -1;
+  int i;
+
+  g_match_info_fetch_pos(info, 0, &start, &end);
+  for (i = 0; i < redactor->nrules; i++) {
+    const struct redact_rule *rule = &redactor->rules[i];
+    if (rule->regex != NULL || !g_match_info_fetch_pos(info, rule->group, &group_start, &group_end) || group_start == -1)
+      continue;
+    if (rule->ngroups > 0 && g_match_info_fetch_pos(info, rule->group + 1, &group_start, &group_end) && group_start != -1) {
+      start = group_start;
+      end = group_end;
+    }
+    break;
+  }
+
+  memset(buf + start, REDACT_MASK, end - start);
+}
+
+/*
+ * Masks every match of a rule that has a regex of its own, in place: its
+ * first group if it has groups, else the whole match.  Returns how many
+ * there were.
+ */
+size_t redact_rule_buffer(const struct redact_rule *rule, char *buf, size_t len) {
+  GMatchInfo *info;
+  size_t pos = 0, count = 0;
+  gint start, end, group_start = -1, group_end = -1;
+
+  while (pos < len) {
+    if (!g_regex_match_full(rule->regex, buf, len, pos, 0, &info, NULL)) {
+      g_match_info_free(info);
+      break;
+    }
+    g_match_info_fetch_pos(info, 0, &start, &end);
+    if (rule->ngroups > 0 && g_match_info_fetch_pos(info, 1, &group_start, &group_end) && group_start != -1)
+      memset(buf + group_start, REDACT_MASK, group_end - group_start);
+    else
+      memset(buf + start, REDACT_MASK, end - start);
+    g_match_info_free(info);
+    count++;
+    pos = end > start ? end : start + 1;
+  }
+
+  return count;
+}
+
+/*
+ * Masks every secret in buf, in place.  Returns how many were found.
+ */
+size_t redact_buffer(const struct redactor *redactor, char *buf, size_t len) {
+  GMatchInfo *info;
+  size_t pos = 0, count = 0;
+  gint start, end;
+  gboolean matched;
+  int i;
+
+  for (i = 0; i < redactor->nrules; i++) {
+    if (redactor->rules[i].regex != NULL)
+      count += redact_rule_buffer(&redactor->rules[i], buf, len);
+  }
+  if (redactor->regex == NULL)
+    return count;
+
+  while (pos < len) {
+    if (redactor->prefilter) {
+      if ((pos = redact_next_candidate(redactor, (const unsigned char *) buf, pos, len)) == len)
+        break;
+      if (!redact_literal_at(redactor, buf + pos, len - pos)) {
+        pos++;
+        continue;
+      }
+    }
+
+    // from a candidate, only a match starting right there counts
+    matched = g_regex_match_full(redactor->regex, buf, len, pos, redactor->prefilter ? G_REGEX_MATCH_ANCHORED : 0, &info, NULL);
+    if (matched) {
+      g_match_info_fetch_pos(info, 0, &start, &end);
+      redact_mask(redactor, buf, info);
+      count++;
+      pos = end > start ? end : start + 1;
+    }
+    g_match_info_free(info);
+
+    if (!matched && !redactor->prefilter)
+      break;
+    if (!matched)
+      pos++;
+  }
+
+  return count;
+}
+
+/*
+ * Puts a redaction stage in front of a paste's input, if the config has any
+ * [redact] patterns.
+ */
+void start_redaction(struct pastebinc_config *config, struct paste_info *pi) {
+  if (config->redact == NULL)
+    return;
+
+  pi->redact = calloc(1, sizeof(struct redact_stream));
+  pi->redact->redactor = config->redact;
+  pi->redact->buf = malloc(REDACT_CHUNK);
+}
+
+void finish_redaction(struct pastebinc_config *config, struct paste_info *pi) {
+  struct redact_stream *rs = pi->redact;
+
+  if (rs == NULL)
+    return;
+
+  config->stats.redactions += rs->count;
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: redacted %zu secret%s\n", rs->count, rs->count == 1 ? "" : "s");
+
+  free(rs->buf);
+  free(rs);
+  pi->redact = NULL;
+}
+
+/*
+ * Reads input until there are whole lines to redact (or the buffer is
+ * full, or EOF).  Returns how much redacted data is waiting to be handed
+ * out, 0 at EOF or -1 on error.
+ */
+ssize_t redact_stream_fill(struct paste_info *pi) {
+  struct redact_stream *rs = pi->redact;
+  ssize_t readval;
+  char *nl;
+
+  while (rs->start == rs->ready) {
+    if (rs->eof)
+      return 0;
+
+    // keep the unfinished line and read more after it
+    memmove(rs->buf, rs->buf + rs->ready, rs->end - rs->ready);
+    rs->end -= rs->ready;
+    rs->start = rs->ready = 0;
+
+    if ((readval = paste_source_read(pi, rs->buf + rs->end, REDACT_CHUNK - rs->end)) == -1)
+      return -1;
+
+    nl = readval > 0 ? memrchr(rs->buf + rs->end, '\n', readval) : NULL;
+    rs->end += readval;
+    if (readval == 0 || rs->end == REDACT_CHUNK) {
+      rs->eof = readval == 0;
+      rs->ready = rs->end;
+    } else if (nl != NULL) {
+      rs->ready = nl - rs->buf + 1;
+    } else {
+      continue;
+    }
+
+    rs->count += redact_buffer(rs->redactor, rs->buf, rs->ready);
+  }
+
+  return rs->ready - rs->start;
+}
+
+/*
+ * Reads the next piece of a paste's input, through the normalization and
+ * redaction stages if it has them.
+ */
+ssize_t paste_input_read(struct paste_info *pi, char *buffer, size_t len) {
+  ssize_t avail;
+
+  if (pi->redact == NULL)
+    return paste_source_read(pi, buffer, len);
+
+  if ((avail = redact_stream_fill(pi)) <= 0)
+    return avail;
+
+  avail = MIN(avail, len);
+  memcpy(buffer, pi->redact->buf + pi->redact->start, avail);
+  pi->redact->start += avail;
+  return avail;
+}
+
+/*
+ * tee_input through the normalization and redaction stages: copies stdin to
+ * out, normalized and with secrets masked (the -t echo is of the original
+ * input).  Returns how many bytes were read, or -1.
+ */
+ssize_t redact_input(struct pastebinc_config *config, int out) {
+  struct paste_info in;
+  char *buf = config->redact == NULL ? malloc(TEE_CHUNK) : NULL;
+  ssize_t avail;
+
+  memset(&in, 0, sizeof(in));
+  in.fd = STDIN_FILENO;
+  in.tee = config->tee;
+  start_normalization(config, &in);
+  start_redaction(config, &in);
+
+  if (in.redact != NULL) {
+    while ((avail = redact_stream_fill(&in)) > 0) {
+      if (write_all(out, in.redact->buf + in.redact->start, avail)) {
+        avail = -1;
+        break;
+      }
+      in.redact->start += avail;
+    }
+  } else {
+    while ((avail = paste_source_read(&in, buf, TEE_CHUNK)) > 0) {
+      if (write_all(out, buf, avail)) {
+        avail = -1;
+        break;
+      }
+    }
+  }
+
+  finish_redaction(config, &in);
+  finish_normalization(config, &in);
+  free(buf);
+  if (config->tee)
+    fflush(stdout);
+  return avail == -1 ? -1 : in.bytes_read;
+}
+
+/*
+ * Adds data to the -k tail, pushing out what is older than the last
+ * ring->size bytes.  Returns how many bytes were pushed out.
+ */
+size_t keep_ring_write(struct keep_ring *ring, const char *data, size_t len) {
+  size_t dropped, first;
+
+  if (len >= ring->size) {
+    dropped = ring->used + len - ring->size;
+    memcpy(ring->buf, data + len - ring->size, ring->size);
+    ring->pos = 0;
+    ring->used = ring->size;
+    return dropped;
+  }
+
+  dropped = ring->used + len > ring->size ? ring->used + len - ring->size : 0;
+  first = MIN(len, ring->size - ring->pos);
+  memcpy(ring->buf + ring->pos, data, first);
+  memcpy(ring->buf, data + first, len - first);
+  ring->pos = (ring->pos + len) % ring->size;
+  ring->used = MIN(ring->used + len, ring->size);
+  return dropped;
+}
+
+char keep_ring_at(const struct keep_ring *ring, size_t i) {
+  size_t start = ring->used < ring->size ? 0 : ring->pos;
+  return ring->buf[(start + i) % ring->size];
+}
+
+/*
+ * Where the last `lines` lines start in the ring (a last line without a
+ * newline counts).  If the ring holds fewer, and lost the start of its
+ * first line, that partial line is left out too.
+ */
+size_t keep_ring_lines_start(const struct keep_ring *ring, size_t lines, int overflowed) {
+  size_t i, seen = 0;
+
+  if (lines == 0)
+    return ring->used;
+
+  for (i = ring->used; i > 0; i--) {
+    if (keep_ring_at(ring, i - 1) == '\n' && i < ring->used && ++seen == lines)
+      return i;
+  }
+
+  for (i = 0; overflowed && i < ring->used; i++) {
+    if (keep_ring_at(ring, i) == '\n')
+      return i + 1;
+  }
+  return 0;
+}
+
+/*
+ * How much of data still belongs to the -k head; head_left counts down the
+ * bytes or lines still to keep.
+ */
+size_t keep_head_length(struct pastebinc_config *config, const char *data, size_t len, size_t written, size_t *head_left) {
+  const char *nl;
+  size_t n = 0;
+
+  if (!config->keep_head_lines) {
+    n = MIN(len, *head_left);
+    *head_left -= n;
+    return n;
+  }
+
+  // an endless line can't make the head endless
+  len = MIN(len, KEEP_LINES_BYTES - written);
+  while (*head_left > 0 && n < len) {
+    if ((nl = memchr(data + n, '\n', len - n)) == NULL)
+      return len;
+    n = nl - data + 1;
+    (*head_left)--;
+  }
+  if (written + n >= KEEP_LINES_BYTES)
+    *head_left = 0;
+  return n;
+}
+
+/*
+ * Spools stdin to out keeping only its first and last few bytes or lines
+ * (-k), with a marker saying how much was left out in between.  The tail
+ * lives in a ring buffer, so neither memory nor the tmp file grow with the
+ * input.  Returns how many bytes were read, or -1.
+ */
+ssize_t keep_input(struct pastebinc_config *config, int out) {
+  struct paste_info in;
+  struct keep_ring ring;
+  char *buf = malloc(TEE_CHUNK);
+  char marker[128];
+  size_t head_left = config->keep_head;
+  size_t written = 0, dropped = 0, skip = 0, n;
+  ssize_t readval;
+  char last = '\n';
+  int failed = 0, read_failed, error;
+
+  memset(&in, 0, sizeof(in));
+  in.fd = STDIN_FILENO;
+  in.tee = config->tee;
+  start_normalization(config, &in);
+  start_redaction(config, &in);
+
+  memset(&ring, 0, sizeof(ring));
+  ring.size = config->keep_tail == 0 ? 0 : config->keep_tail_lines ? KEEP_LINES_BYTES : config->keep_tail;
+  ring.buf = malloc(MAX(ring.size, 1));
+
+  while (!failed && (readval = paste_input_read(&in, buf, TEE_CHUNK)) > 0) {
+    n = head_left > 0 ? keep_head_length(config, buf, readval, written, &head_left) : 0;
+    if (n > 0) {
+      failed = write_all(out, buf, n);
+      written += n;
+      last = buf[n - 1];
+    }
+    if (readval > n)
+      dropped += ring.size > 0 ? keep_ring_write(&ring, buf + n, readval - n) : readval - n;
+  }
+  read_failed = !failed && readval == -1;
+  failed = failed || read_failed;
+
+  if (!failed && config->keep_tail_lines)
+    skip = keep_ring_lines_start(&ring, config->keep_tail, dropped > 0);
+
+  if (!failed && dropped + skip > 0) {
+    n = snprintf(marker, sizeof(marker), "%s\xe2\x80\xa6 %zu byte%s elided \xe2\x80\xa6\n",
+                 last == '\n' ? "" : "\n", dropped + skip, dropped + skip == 1 ? "" : "s");
+    failed = write_all(out, marker, n);
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: kept %zu bytes of head and %zu of tail, %zu bytes elided\n", written, ring.used - skip, dropped + skip);
+  }
+
+  // the tail, in (at most) the two pieces the ring has it in
+  if (!failed && ring.used > skip) {
+    size_t start = ((ring.used < ring.size ? 0 : ring.pos) + skip) % ring.size;
+    size_t first = MIN(ring.used - skip, ring.size - start);
+    failed = write_all(out, ring.buf + start, first) || write_all(out, ring.buf, ring.used - skip - first);
+  }
+  error = errno;
+
+  finish_redaction(config, &in);
+  finish_normalization(config, &in);
+  if (config->tee)
+    fflush(stdout);
+  free(ring.buf);
+  free(buf);
+
+  if (failed) {
+    // a read error has been reported where it happened
+    if (!read_failed)
+      fprintf(stderr, "Error spooling input: %s\n", strerror(error));
+    return -1;
+  }
+  return in.bytes_read;
+}
+
+/*
+ * Worker thread body: compresses one chunk into a raw deflate stream.  All
+ * chunks but the last end with a sync flush so the pieces can simply be
+ * concatenated; each is primed with the 32K before it so the ratio is close
+ * to single-threaded gzip.
+ */
+void gzip_compress_chunk(gpointer data, gpointer user_data) {
+  struct gzip_chunk *chunk = (struct gzip_chunk *) data;
+  struct gzip_stream *gz = (struct gzip_stream *) user_data;
+  z_stream z;
+
+  memset(&z, 0, sizeof(z));
+  deflateInit2(&z, gz->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+  if (chunk->dict_len > 0)
+    deflateSetDictionary(&z, chunk->dict, chunk->dict_len);
+
+  chunk->out = malloc(deflateBound(&z, chunk->in_len) + 16);
+  z.next_in = chunk->in;
+  z.avail_in = chunk->in_len;
+  z.next_out = chunk->out;
+  z.avail_out = deflateBound(&z, chunk->in_len) + 16;
+  deflate(&z, chunk->last ? Z_FINISH : Z_SYNC_FLUSH);
+  chunk->out_len = z.next_out - chunk->out;
+  deflateEnd(&z);
+
+  chunk->crc = crc32(crc32(0L, Z_NULL, 0), chunk->in, chunk->in_len);
+
+  g_mutex_lock(&gz->lock);
+  chunk->done = 1;
+  g_cond_broadcast(&gz->cond);
+  g_mutex_unlock(&gz->lock);
+}
+
+/*
+ * Reads the next full chunk of input and hands it to the compression workers.
+ * The chunk that hits EOF (possibly empty) is the one that finishes the stream.
+ */
+int gzip_submit_chunk(struct paste_info *pi) {
+  struct gzip_stream *gz = pi->gz;
+  struct gzip_chunk *chunk = calloc(1, sizeof(struct gzip_chunk));
+  ssize_t readval = 1;
+
+  chunk->in = malloc(GZIP_CHUNK);
+  while (chunk->in_len < GZIP_CHUNK && (readval = paste_input_read(pi, (char *)chunk->in + chunk->in_len, GZIP_CHUNK - chunk->in_len)) > 0)
+    chunk->in_len += readval;
+
+  if (readval == -1) {
+    free(chunk->in);
+    free(chunk);
+    return -1;
+  }
+
+  if (readval == 0) {
+    gz->eof = 1;
+    chunk->last = 1;
+  }
+
+  if (gz->prev_len > 0) {
+    chunk->dict = malloc(gz->prev_len);
+    memcpy(chunk->dict, gz->prev, gz->prev_len);
+    chunk->dict_len = gz->prev_len;
+  }
+
+  if (chunk->in_len > 0) {
+    gz->prev_len = chunk->in_len < GZIP_WINDOW ? chunk->in_len : GZIP_WINDOW;
+    memcpy(gz->prev, chunk->in + chunk->in_len - gz->prev_len, gz->prev_len);
+  }
+
+  if (gz->tail == NULL)
+    gz->head = chunk;
+  else
+    gz->tail->next = chunk;
+  gz->tail = chunk;
+  gz->inflight++;
+  g_thread_pool_push(gz->pool, chunk, NULL);
+
+  return 0;
+}
+
+/*
+ * Produces the next piece of the gzip stream for the content part.  Input is
+ * read and handed to the worker pool up to a bounded number of chunks ahead,
+ * and finished chunks are emitted in order between the gzip header and
+ * trailer.
+ */
+ssize_t gzip_stream_read(struct paste_info *pi, char *buffer, size_t len) {
+  struct gzip_stream *gz = pi->gz;
+  struct gzip_chunk *chunk;
+  size_t n;
+  int done;
+
+  while (1) {
+    if (gz->outbuf_pos < gz->outbuf_len) {
+      n = gz->outbuf_len - gz->outbuf_pos < len ? gz->outbuf_len - gz->outbuf_pos : len;
+      memcpy(buffer, gz->outbuf + gz->outbuf_pos, n);
+      gz->outbuf_pos += n;
+      gz->bytes_out += n;
+      return n;
+    }
+
+    if (gz->finished)
+      return 0;
+
+    if (!gz->header_sent) {
+      static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+      memcpy(gz->outbuf, header, sizeof(header));
+      gz->outbuf_len = sizeof(header);
+      gz->outbuf_pos = 0;
+      gz->header_sent = 1;
+      gz->started = g_get_monotonic_time();
+      continue;
+    }
+
+    // the workers write out and out_len before they set done under the
+    // lock, so once done is seen under the lock they are safe to read
+    chunk = gz->head;
+    done = 0;
+    if (chunk != NULL) {
+      g_mutex_lock(&gz->lock);
+      done = chunk->done;
+      g_mutex_unlock(&gz->lock);
+    }
+
+    if (done && chunk->out_pos < chunk->out_len) {
+      n = chunk->out_len - chunk->out_pos < len ? chunk->out_len - chunk->out_pos : len;
+      memcpy(buffer, chunk->out + chunk->out_pos, n);
+      chunk->out_pos += n;
+      gz->bytes_out += n;
+      return n;
+    }
+
+    if (done) {
+      // fully sent: fold its crc into the running total and move on
+      gz->crc = crc32_combine(gz->crc, chunk->crc, chunk->in_len);
+      gz->bytes_in += chunk->in_len;
+      gz->head = chunk->next;
+      if (gz->head == NULL)
+        gz->tail = NULL;
+      gz->inflight--;
+      free(chunk->in);
+      free(chunk->dict);
+      free(chunk->out);
+      free(chunk);
+      continue;
+    }
+
+    if (!gz->eof && gz->inflight < gz->max_inflight) {
+      if (gzip_submit_chunk(pi) == -1)
+        return -1;
+      continue;
+    }
+
+    if (chunk != NULL) {
+      g_mutex_lock(&gz->lock);
+      while (!chunk->done)
+        g_cond_wait(&gz->cond, &gz->lock);
+      g_mutex_unlock(&gz->lock);
+      continue;
+    }
+
+    // all chunks sent: the trailer is the crc and length of the input
+    gz->outbuf[0] = gz->crc & 0xff;
+    gz->outbuf[1] = (gz->crc >> 8) & 0xff;
+    gz->outbuf[2] = (gz->crc >> 16) & 0xff;
+    gz->outbuf[3] = (gz->crc >> 24) & 0xff;
+    gz->outbuf[4] = gz->bytes_in & 0xff;
+    gz->outbuf[5] = (gz->bytes_in >> 8) & 0xff;
+    gz->outbuf[6] = (gz->bytes_in >> 16) & 0xff;
+    gz->outbuf[7] = (gz->bytes_in >> 24) & 0xff;
+    gz->outbuf_len = 8;
+    gz->outbuf_pos = 0;
+    gz->finished = 1;
+    gz->elapsed = g_get_monotonic_time() - gz->started;
+  }
+}
+
+/*
+ * Sets up paste_info so its content is gzip compressed on the way out by a
+ * pool of compression threads.
+ */
+void start_compression(struct pastebinc_config *config, struct paste_info *pi) {
+  struct gzip_stream *gz = calloc(1, sizeof(struct gzip_stream));
+
+  g_mutex_init(&gz->lock);
+  g_cond_init(&gz->cond);
+  gz->level = config->compression_level;
+  gz->max_inflight = config->compression_threads * 2;
+  gz->crc = crc32(0L, Z_NULL, 0);
+
+  // non-exclusive pools borrow from glib's shared threads, so this is cheap
+  gz->pool = g_thread_pool_new(&gzip_compress_chunk, gz, config->compression_threads, FALSE, NULL);
+  pi->gz = gz;
+}
+
+/*
+ * Tears down the compression state of a paste, reporting what it achieved
+ * when verbose.
+ */
+void finish_compression(struct pastebinc_config *config, struct paste_info *pi) {
+  struct gzip_stream *gz = pi->gz;
+  struct gzip_chunk *chunk, *next;
+
+  if (gz == NULL)
+    return;
+
+  g_thread_pool_free(gz->pool, FALSE, TRUE);
+
+  if (config->verbose && gz->finished)
+    fprintf(stderr, "DEBUG: gzip compressed %zu bytes to %zu (ratio %.2f) at %.1f MB/s with %d threads\n",
+      gz->bytes_in, gz->bytes_out,
+      gz->bytes_out > 0 ? (double) gz->bytes_in / gz->bytes_out : 0.0,
+      gz->elapsed > 0 ? (gz->bytes_in / 1048576.0) / (gz->elapsed / 1000000.0) : 0.0,
+      config->compression_threads);
+
+  for (chunk = gz->head; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    free(chunk->in);
+    free(chunk->dict);
+    free(chunk->out);
+    free(chunk);
+  }
+  g_mutex_clear(&gz->lock);
+  g_cond_clear(&gz->cond);
+  free(gz);
+  pi->gz = NULL;
+}
+
+/*
+ * Sets up paste_info so its content is encrypted on the way out (-E), with
+ * a new random key.  Returns 1 if there is no randomness to be had.
+ */
+int start_encryption(struct pastebinc_config *config, struct paste_info *pi) {
+  struct encrypt_stream *es;
+  size_t cap = (ENCRYPT_CHUNK + ENCRYPT_TAG + 2) / 3 * 4;
+
+  if (!config->encrypt || pi->crypt != NULL)
+    return 0;
+
+  es = calloc(1, sizeof(struct encrypt_stream));
+  if (RAND_bytes(es->key, ENCRYPT_KEY) != 1 || RAND_bytes(es->prefix, ENCRYPT_PREFIX) != 1) {
+    fprintf(stderr, "ERROR: could not get random bytes for the encryption key\n");
+    free(es);
+    return 1;
+  }
+
+  es->ctx = EVP_CIPHER_CTX_new();
+  EVP_EncryptInit_ex(es->ctx, EVP_aes_256_gcm(), NULL, es->key, NULL);
+  es->plain = malloc(ENCRYPT_CHUNK + 1);
+  es->sealed = malloc(ENCRYPT_CHUNK + ENCRYPT_TAG);
+  // base64 of a sealed chunk, its line breaks and the header line
+  es->out = malloc(cap + cap / 76 + sizeof(ENCRYPT_HEADER) + 16);
+  pi->crypt = es;
+  return 0;
+}
+
+void finish_encryption(struct pastebinc_config *config, struct paste_info *pi) {
+  struct encrypt_stream *es = pi->crypt;
+
+  if (es == NULL)
+    return;
+
+  if (config->verbose && es->finished)
+    fprintf(stderr, "DEBUG: encrypted %zu bytes into %zu at %.1f MB/s\n", es->bytes_in, es->bytes_out,
+      es->elapsed > 0 ? (es->bytes_in / 1048576.0) / (es->elapsed / 1000000.0) : 0.0);
+
+  EVP_CIPHER_CTX_free(es->ctx);
+  OPENSSL_cleanse(es->key, ENCRYPT_KEY);
+  free(es->plain);
+  free(es->sealed);
+  free(es->out);
+  free(es);
+  pi->crypt = NULL;
+}
+
+/*
+ * The nonce of chunk number counter: the stream's random prefix, the counter
+ * (big endian) and whether it is the last chunk.
+ */
+void encrypt_nonce(unsigned char *nonce, const unsigned char *prefix, uint32_t counter, int last) {
+  memcpy(nonce, prefix, ENCRYPT_PREFIX);
+  nonce[7] = counter >> 24;
+  nonce[8] = counter >> 16;
+  nonce[9] = counter >> 8;
+  nonce[10] = counter;
+  nonce[11] = last ? 1 : 0;
+}
+
+/*
+ * Reads the next chunk of input, seals it and appends it to the output as
+ * base64.  Returns -1 on a read or cipher error.
+ */
+int encrypt_next_chunk(struct paste_info *pi) {
+  struct encrypt_stream *es = pi->crypt;
+  unsigned char nonce[12];
+  ssize_t readval = 1;
+  size_t len;
+  int last, n;
+
+  // a full chunk plus one more byte means this one is not the last
+  while (es->plain_len <= ENCRYPT_CHUNK
+      && (readval = paste_input_read(pi, (char *) es->plain + es->plain_len, ENCRYPT_CHUNK + 1 - es->plain_len)) > 0)
+    es->plain_len += readval;
+  if (readval == -1)
+    return -1;
+
+  last = es->plain_len <= ENCRYPT_CHUNK;
+  len = last ? es->plain_len : ENCRYPT_CHUNK;
+  encrypt_nonce(nonce, es->prefix, es->counter++, last);
+  if (!EVP_EncryptInit_ex(es->ctx, NULL, NULL, NULL, nonce)
+      || !EVP_EncryptUpdate(es->ctx, es->sealed, &n, es->plain, len)
+      || !EVP_EncryptFinal_ex(es->ctx, es->sealed + n, &n)
+      || !EVP_CIPHER_CTX_ctrl(es->ctx, EVP_CTRL_GCM_GET_TAG, ENCRYPT_TAG, es->sealed + len)) {
+    fprintf(stderr, "ERROR: encrypting the paste failed\n");
+    return -1;
+  }
+
+  es->end += g_base64_encode_step(es->sealed, len + ENCRYPT_TAG, TRUE, es->out + es->end, &es->b64_state, &es->b64_save);
+  es->bytes_in += len;
+  if (last) {
+    es->end += g_base64_encode_close(TRUE, es->out + es->end, &es->b64_state, &es->b64_save);
+    es->finished = 1;
+    es->elapsed = g_get_monotonic_time() - es->started;
+  } else {
+    es->plain[0] = es->plain[ENCRYPT_CHUNK];
+    es->plain_len = 1;
+  }
+  return 0;
+}
+
+/*
+ * Produces the next piece of the encrypted paste: the header line, then the
+ * nonce prefix and the sealed chunks in base64.
+ */
+ssize_t encrypt_stream_read(struct paste_info *pi, char *buffer, size_t len) {
+  struct encrypt_stream *es = pi->crypt;
+  size_t n;
+
+  while (es->start == es->end) {
+    if (es->finished)
+      return 0;
+
+    es->start = es->end = 0;
+    if (!es->header_sent) {
+      es->started = g_get_monotonic_time();
+      memcpy(es->out, ENCRYPT_HEADER "\n", sizeof(ENCRYPT_HEADER));
+      es->end = sizeof(ENCRYPT_HEADER);
+      es->end += g_base64_encode_step(es->prefix, ENCRYPT_PREFIX, TRUE, es->out + es->end, &es->b64_state, &es->b64_save);
+      es->header_sent = 1;
+    } else if (encrypt_next_chunk(pi) == -1) {
+      return -1;
+    }
+  }
+
+  n = MIN(len, es->end - es->start);
+  memcpy(buffer, es->out + es->start, n);
+  es->start += n;
+  es->bytes_out += n;
+  return n;
+}
+
+/*
+ * The URL to print for an encrypted paste: the key goes in the fragment
+ * (base64url), which browsers and curl never send to the server.
+ */
+char *encryption_url(struct paste_info *pi, const char *url) {
+  gchar *key = g_base64_encode(pi->crypt->key, ENCRYPT_KEY);
+  char *p, *full;
+
+  for (p = key; *p; p++) {
+    if (*p == '+')
+      *p = '-';
+    else if (*p == '/')
+      *p = '_';
+    else if (*p == '=')
+      *p = 0;
+  }
+  full = g_strdup_printf("%s#%s", url, key);
+  g_free(key);
+  return full;
+}
+
+/*
+ * Callback for curl that supplies the content form part when streaming.  Reads
+ * the next piece of input straight from paste_info's fd into curl's upload
+ * buffer, so memory use stays the same no matter how big the input is.
+ */
+size_t paste_content_read(char *buffer, size_t size, size_t nitems, void *userp) {
+  struct paste_info *pi = (struct paste_info *) userp;
+  ssize_t readval;
+
+  if (pi->gz != NULL)
+    readval = gzip_stream_read(pi, buffer, size * nitems);
+  else if (pi->crypt != NULL)
+    readval = encrypt_stream_read(pi, buffer, size * nitems);
+  else
+    readval = paste_input_read(pi, buffer, size * nitems);
+
+  return readval == -1 ? CURL_READFUNC_ABORT : readval;
+}
+
+/*
+ * Starts capturing the JSON value that begins here if the pointer names it.
+ */
+void json_value_start(struct http_response *resp) {
+  struct json_scan *js = &resp->json;
+  const struct response_rule *rule = resp->rule;
+  int d = js->depth;
+  char *end;
+
+  // array elements are on the path when their index is the pointer's token
+  if (d > 0 && js->container[d - 1] == '[') {
+    js->on_path[d] = js->on_path[d - 1] && d - 1 < rule->pointer_len
+      && strtol(rule->pointer[d - 1], &end, 10) == js->index[d - 1]
+      && *end == 0 && *rule->pointer[d - 1] != 0;
+  }
+
+  js->capture = js->on_path[d] && d == rule->pointer_len;
+  g_string_truncate(js->text, 0);
+}
+
+/*
+ * A captured value is complete: it is the URL.
+ */
+void json_value_found(struct http_response *resp) {
+  struct json_scan *js = &resp->json;
+
+  g_strstrip(js->text->str);
+  resp->url = strdup(js->text->str);
+  js->state = JS_DONE;
+}
+
+/*
+ * Feeds the next piece of the body to the incremental JSON scanner, which
+ * looks for the value the provider's JSON pointer names without keeping the
+ * document: only the current key or the value being captured is held.
+ */
+void json_scan_feed(struct http_response *resp, const char *data, size_t len) {
+  struct json_scan *js = &resp->json;
+  const struct response_rule *rule = resp->rule;
+  size_t i = 0;
+  char c;
+  int v;
+
+  while (i < len && js->state != JS_DONE && js->state != JS_ERROR) {
+    c = data[i];
+
+    switch (js->state) {
+      case JS_VALUE_OR_END:
+        if (c == ']') {
+          js->depth--;
+          js->state = JS_AFTER_VALUE;
+          break;
+        }
+        // fall through
+      case JS_VALUE:
+        if (g_ascii_isspace(c))
+          break;
+        if (c == '{' || c == '[') {
+          json_value_start(resp);
+          if (js->capture || js->depth == JSON_MAX_DEPTH) {
+            js->state = JS_ERROR; // the pointer names a container, or too deep
+            break;
+          }
+          js->container[js->depth] = c;
+          js->index[js->depth] = 0;
+          js->depth++;
+          js->on_path[js->depth] = 0;
+          js->state = c == '{' ? JS_KEY_OR_END : JS_VALUE_OR_END;
+        } else if (c == '"') {
+          json_value_start(resp);
+          js->in_key = 0;
+          js->state = JS_STRING;
+        } else {
+          json_value_start(resp);
+          js->state = JS_LITERAL;
+          continue; // the character is part of the literal
+        }
+        break;
+
+      case JS_KEY_OR_END:
+        if (c == '}') {
+          js->depth--;
+          js->state = JS_AFTER_VALUE;
+          break;
+        }
+        // fall through
+      case JS_KEY:
+        if (g_ascii_isspace(c))
+          break;
+        if (c != '"') {
+          js->state = JS_ERROR;
+          break;
+        }
+        g_string_truncate(js->text, 0);
+        js->in_key = 1;
+        js->state = JS_STRING;
+        break;
+
+      case JS_COLON:
+        if (c == ':')
+          js->state = JS_VALUE;
+        else if (!g_ascii_isspace(c))
+          js->state = JS_ERROR;
+        break;
+
+      case JS_AFTER_VALUE:
+        if (g_ascii_isspace(c))
+          break;
+        if (js->depth == 0) {
+          js->state = JS_DONE; // the document is over
+        } else if (c == ',') {
+          if (js->container[js->depth - 1] == '[') {
+            js->index[js->depth - 1]++;
+            js->state = JS_VALUE;
+          } else {
+            js->state = JS_KEY;
+          }
+        } else if (c == (js->container[js->depth - 1] == '[' ? ']' : '}')) {
+          js->depth--;
+        } else {
+          js->state = JS_ERROR;
+        }
+        break;
+
+      case JS_STRING:
+        if (c == '\\') {
+          js->state = JS_ESCAPE;
+        } else if (c == '"') {
+          if (js->in_key) {
+            int d = js->depth;
+            js->on_path[d] = js->on_path[d - 1] && d - 1 < rule->pointer_len
+              && strcmp(js->text->str, rule->pointer[d - 1]) == 0;
+            js->state = JS_COLON;
+          } else if (js->capture) {
+            json_value_found(resp);
+          } else {
+            js->state = JS_AFTER_VALUE;
+          }
+        } else if ((js->in_key || js->capture) && js->text->len < rule->max_bytes) {
+          g_string_append_c(js->text, c);
+        }
+        break;
+
+      case JS_ESCAPE:
+        js->state = JS_STRING;
+        switch (c) {
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          case 'n': c = '\n'; break;
+          case 'r': c = '\r'; break;
+          case 't': c = '\t'; break;
+          case 'u':
+            js->unicode = 0;
+            js->unicode_digits = 0;
+            js->state = JS_UNICODE;
+            break;
+        }
+        if (js->state == JS_STRING && (js->in_key || js->capture) && js->text->len < rule->max_bytes)
+          g_string_append_c(js->text, c);
+        break;
+
+      case JS_UNICODE:
+        if ((v = g_ascii_xdigit_value(c)) == -1) {
+          js->state = JS_ERROR;
+          break;
+        }
+        js->unicode = js->unicode * 16 + v;
+        if (++js->unicode_digits == 4) {
+          if ((js->in_key || js->capture) && js->text->len < rule->max_bytes)
+            g_string_append_unichar(js->text, js->unicode);
+          js->state = JS_STRING;
+        }
+        break;
+
+      case JS_LITERAL:
+        if (g_ascii_isspace(c) || c == ',' || c == '}' || c == ']') {
+          if (js->capture) {
+            json_value_found(resp);
+            break;
+          }
+          js->state = JS_AFTER_VALUE;
+          continue; // the character belongs to what follows
+        }
+        if (js->capture && js->text->len < rule->max_bytes)
+          g_string_append_c(js->text, c);
+        break;
+    }
+    i++;
+  }
+}
+
+/*
+ * Feeds the next piece of the body to the pattern matcher.  Only the latest
+ * max_bytes are kept; a match may start up to RESPONSE_OVERLAP bytes back
+ * into the previous data.
+ */
+void pattern_scan_feed(struct http_response *resp, const char *data, size_t len) {
+  const struct response_rule *rule = resp->rule;
+  GMatchInfo *match = NULL;
+  size_t piece;
+  gint start, end;
+  int group;
+
+  while (len > 0 && resp->url == NULL) {
+    piece = MIN(len, rule->max_bytes - RESPONSE_OVERLAP);
+    if (resp->window->len + piece > rule->max_bytes)
+      g_string_erase(resp->window, 0, resp->window->len - MIN(resp->window->len, RESPONSE_OVERLAP));
+    g_string_append_len(resp->window, data, piece);
+    data += piece;
+    len -= piece;
+
+    if (g_regex_match_full(rule->pattern, resp->window->str, resp->window->len, 0, 0, &match, NULL)) {
+      group = g_regex_get_capture_count(rule->pattern) > 0 ? 1 : 0;
+      if (g_match_info_fetch_pos(match, group, &start, &end) && start >= 0)
+        resp->url = strndup(resp->window->str + start, end - start);
+    }
+    g_match_info_free(match);
+    match = NULL;
+  }
+}
+
+/*
+ * Reads the provider's [response] section: how to find the paste URL in the
+ * response and how much of the response to hold on to.
+ */
+int load_response_rule(struct pastebinc_config *config) {
+  struct response_rule *rule = &config->response;
+  const char *pointer = conf_get(config->conf, "response", "json_pointer");
+  const char *header = conf_get(config->conf, "response", "header");
+  const char *pattern = conf_get(config->conf, "response", "pattern");
+  GError *error = NULL;
+  int i;
+
+  rule->max_bytes = conf_get_int(config->conf, "response", "max_response_bytes", RESPONSE_MAX_BYTES);
+  if (rule->max_bytes <= RESPONSE_OVERLAP)
+    rule->max_bytes = RESPONSE_OVERLAP + 1;
+
+  if ((pointer != NULL) + (header != NULL) + (pattern != NULL) > 1) {
+    fprintf(stderr, "ERROR: [response] can only have one of json_pointer, header or pattern\n");
+    return 1;
+  }
+
+  if (pointer != NULL) {
+    if (*pointer != 0 && *pointer != '/') {
+      fprintf(stderr, "ERROR: [response] json_pointer must be empty or start with '/': %s\n", pointer);
+      return 1;
+    }
+    rule->kind = RESPONSE_JSON;
+    rule->pointer = *pointer == 0 ? g_new0(gchar *, 1) : g_strsplit(pointer + 1, "/", -1);
+    rule->pointer_len = g_strv_length(rule->pointer);
+    if (rule->pointer_len >= JSON_MAX_DEPTH) {
+      fprintf(stderr, "ERROR: [response] json_pointer is too deep: %s\n", pointer);
+      return 1;
+    }
+    // reference tokens escape '/' as ~1 and '~' as ~0
+    for (i = 0; i < rule->pointer_len; i++) {
+      char *from = rule->pointer[i], *to = rule->pointer[i];
+      for (; *from; from++, to++) {
+        if (from[0] == '~' && (from[1] == '0' || from[1] == '1'))
+          *to = *++from == '0' ? '~' : '/';
+        else
+          *to = *from;
+      }
+      *to = 0;
+    }
+  } else if (header != NULL) {
+    rule->kind = RESPONSE_HEADER;
+    rule->header = (char *) header;
+  } else if (pattern != NULL) {
+    rule->kind = RESPONSE_PATTERN;
+    if ((rule->pattern = g_regex_new(pattern, G_REGEX_OPTIMIZE, 0, &error)) == NULL) {
+      fprintf(stderr, "ERROR: bad [response] pattern: %s\n", error->message);
+      g_error_free(error);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Callback for curl that uses the http_response structure to build the response
+ * of the HTTP post into a char array, and feeds it to the [response] rule.
+ */
+size_t http_resp_body_data_received(void *buffer, size_t size, size_t nmemb, void *userp) {
+  size_t realsize = size * nmemb;
+  struct http_response *resp = (struct http_response *) userp;
+  const struct response_rule *rule = resp->rule;
+  size_t keep;
+
+  // keep the start of the body (it is the URL by default, and is shown on
+  // errors) but never more than max_bytes of it
+  keep = MIN(realsize, rule->max_bytes - resp->body_size);
+  if (keep > 0) {
+    if (resp->body_size + keep + 1 > resp->body_alloc) {
+      resp->body_alloc = MIN(MAX(resp->body_alloc * 2, resp->body_size + keep + 1), rule->max_bytes + 1);
+      resp->body = realloc(resp->body, resp->body_alloc);
+      if (resp->body == NULL) {
+        fprintf(stderr, "not enough memory to buffer pastebin response (realloc returned NULL)\n");
+        exit(1);
+      }
+    }
+    memcpy(&(resp->body[resp->body_size]), buffer, keep);
+    resp->body_size += keep;
+    resp->body[resp->body_size] = 0;
+  }
+  if (keep < realsize)
+    resp->truncated = 1;
+
+  if (resp->url == NULL && rule->kind == RESPONSE_JSON)
+    json_scan_feed(resp, buffer, realsize);
+  else if (resp->url == NULL && rule->kind == RESPONSE_PATTERN)
+    pattern_scan_feed(resp, buffer, realsize);
+
+  // the body is the URL: there is no point downloading a huge error page
+  if (rule->kind == RESPONSE_BODY && resp->truncated)
+    return 0;
+
+  return realsize;
+}
+
+/*
+ * Callback for curl that uses the http_response structure to save the location header
+ * if one is sent, and the header the provider's [response] rule names.
+ */
+size_t http_resp_header_received(void *buffer, size_t size, size_t nmemb, void *userp) {
+  struct http_response *resp = (struct http_response *) userp;
+  const char *line = buffer;
+  size_t len = size * nmemb;
+  const char *colon = memchr(line, ':', len);
+  const char *value, *end;
+  char **target = NULL;
+  char *retry_after = NULL;
+
+  if (colon == NULL)
+    return len;
+
+  if (colon - line == 8 && g_ascii_strncasecmp(line, "Location", 8) == 0)
+    target = &resp->location;
+  else if (colon - line == 11 && g_ascii_strncasecmp(line, "Retry-After", 11) == 0)
+    target = &retry_after;
+  else if (resp->rule->kind == RESPONSE_HEADER && resp->url == NULL && colon - line == strlen(resp->rule->header)
+      && g_ascii_strncasecmp(line, resp->rule->header, colon - line) == 0)
+    target = &resp->url;
+
+  if (target != NULL) {
+    // the value, without surrounding whitespace or the CRLF
+    for (value = colon + 1; value < line + len && (*value == ' ' || *value == '\t'); value++)
+      ;
+    for (end = line + len; end > value && g_ascii_isspace(end[-1]); end--)
+      ;
+    free(*target);
+    *target = strndup(value, end - value);
+  }
+
+  // either a number of seconds or the date to wait until
+  if (retry_after != NULL) {
+    char *rest;
+    long seconds = strtol(retry_after, &rest, 10);
+    time_t when;
+
+    if (rest != retry_after && *rest == 0 && seconds >= 0)
+      resp->retry_after = seconds;
+    else if ((when = curl_getdate(retry_after, NULL)) != -1)
+      resp->retry_after = MAX(0, when - time(NULL));
+    free(retry_after);
+  }
+
+  return len;
+}
+
+/*
+ * Builds the multipart form for one paste: the title, the content and all
+ * static and user fields.  The content is read from content_file if given,
+ * else taken from content_buf, otherwise it is streamed from paste_info
+ * through paste_content_read (with a Content-Length if content_len is set).
+ */
+struct curl_httppost *build_post_form(struct pastebinc_config *config, const char *title, const char *content_file,
+                                      const char *content_buf, size_t content_len, struct paste_info *pi) {
+  struct curl_httppost *post = NULL;
+  struct curl_httppost *last = NULL;
+
+  const char *content_fieldname = conf_get(config->conf, "fieldnames", "content");
+  const char *title_fieldname = conf_get(config->conf, "fieldnames", "title");
+  const struct conf_entry *static_fields;
+  uint32_t nstatic, i;
+
+  if (config->verbose)
+    fprintf(stderr,
+      "DEBUG: content fieldname: %s\n"
+      "DEBUG: title fieldname: %s\n",
+      content_fieldname, title_fieldname);
+
+  curl_formadd(&post, &last, CURLFORM_COPYNAME, title_fieldname, CURLFORM_COPYCONTENTS, title, CURLFORM_END);
+  if (content_file == NULL && content_buf != NULL) {
+    curl_formadd(&post, &last, CURLFORM_COPYNAME, content_fieldname, CURLFORM_PTRCONTENTS, content_buf,
+                 CURLFORM_CONTENTLEN, (curl_off_t) content_len, CURLFORM_END);
+  } else if (content_file == NULL && content_len > 0) {
+    curl_formadd(&post, &last, CURLFORM_COPYNAME, content_fieldname, CURLFORM_STREAM, (void *)pi,
+                 CURLFORM_CONTENTLEN, (curl_off_t) content_len, CURLFORM_END);
+  } else if (content_file == NULL) {
+    // no length given, so curl sends the part with chunked transfer encoding
+    if (config->content_headers != NULL)
+      curl_formadd(&post, &last, CURLFORM_COPYNAME, content_fieldname, CURLFORM_STREAM, (void *)pi,
+                   CURLFORM_CONTENTHEADER, config->content_headers, CURLFORM_END);
+    else
+      curl_formadd(&post, &last, CURLFORM_COPYNAME, content_fieldname, CURLFORM_STREAM, (void *)pi, CURLFORM_END);
+  } else {
+    curl_formadd(&post, &last, CURLFORM_COPYNAME, content_fieldname, CURLFORM_FILECONTENT, content_file, CURLFORM_END);
+  }
+
+  // add static fields to request:
+  static_fields = conf_group(config->conf, "static_fields", &nstatic);
+  for (i = 0; i < nstatic; i++) {
+    const char *field = conf_str(config->conf, static_fields[i].key);
+    const char *value = conf_str(config->conf, static_fields[i].value);
+    curl_formadd(&post, &last, CURLFORM_COPYNAME, field, CURLFORM_COPYCONTENTS, value, CURLFORM_END);
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: adding static form field: %s = %s\n", field, value);
+  }
+
+  if (config->user_fields != NULL) {
+    t_user_field *uf = config->user_fields;
+    while (uf) {
+      if (config->verbose)
+        fprintf(stderr, "DEBUG: adding user field to curl: %s = %s\n", uf->name, uf->value);
+      curl_formadd(&post, &last, CURLFORM_COPYNAME, uf->name, CURLFORM_COPYCONTENTS, uf->value, CURLFORM_END);
+      uf = uf->next;
+    }
+  }
+
+  return post;
+}
+
+/*
+ * Sets all of the options on a curl handle that are needed to post the given
+ * form to the configured provider and collect the response into resp.
+ */
+void setup_post_handle(struct pastebinc_config *config, CURL *curl, struct curl_httppost *post, struct curl_slist *headers, struct http_response *resp) {
+  const char *url = config->ntargets > 0 ? config->targets[0] : conf_get(config->conf, "server", "url");
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: Posting to: %s\n", url);
+
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(curl, CURLOPT_HTTPPOST, post);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)resp);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &http_resp_body_data_received);
+  curl_easy_setopt(curl, CURLOPT_WRITEHEADER, (void *)resp);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &http_resp_header_received);
+  curl_easy_setopt(curl, CURLOPT_READFUNCTION, &paste_content_read);
+
+  if (config->bypass_proxy)
+    curl_easy_setopt(curl, CURLOPT_NOPROXY, "*");
+
+  // addresses and TLS sessions from earlier runs
+  if (config->net != NULL) {
+    curl_easy_setopt(curl, CURLOPT_RESOLVE, config->net->resolve);
+    curl_easy_setopt(curl, CURLOPT_SHARE, config->net->share);
+  }
+
+  // the connection warmed up while the input was spooled, if it is ready
+  if (config->warmup != NULL)
+    curl_easy_setopt(curl, CURLOPT_SHARE, config->warmup->share);
+}
+
+void init_http_response(struct pastebinc_config *config, struct http_response *resp) {
+  memset(resp, 0, sizeof(struct http_response));
+  resp->retry_after = -1;
+  resp->rule = &config->response;
+  resp->body_alloc = MIN(1024, resp->rule->max_bytes + 1);
+  resp->body = malloc(resp->body_alloc);
+  resp->body[0] = 0;
+
+  if (resp->rule->kind == RESPONSE_JSON) {
+    resp->json.text = g_string_new(NULL);
+    resp->json.on_path[0] = 1; // the whole document
+  } else if (resp->rule->kind == RESPONSE_PATTERN) {
+    resp->window = g_string_new(NULL);
+  }
+}
+
+void free_http_response(struct http_response *resp) {
+  if (resp->body)
+    free(resp->body);
+
+  if (resp->location)
+    free(resp->location);
+
+  free(resp->url);
+  if (resp->json.text != NULL)
+    g_string_free(resp->json.text, TRUE);
+  if (resp->window != NULL)
+    g_string_free(resp->window, TRUE);
+
+  resp->body = NULL;
+  resp->location = NULL;
+  resp->url = NULL;
+  resp->json.text = NULL;
+  resp->window = NULL;
+}
+
+/*
+ * Allocates size bytes from an arena.  Blocks are never reused or shrunk;
+ * everything goes at once in arena_free.
+ */
+void *arena_alloc(struct arena *arena, size_t size) {
+  struct arena_block *block = arena->head;
+
+  size = (size + 7) & ~(size_t) 7;
+  if (block == NULL || block->size - block->used < size) {
+    size_t block_size = MAX(ARENA_BLOCK, size);
+    if ((block = malloc(sizeof(struct arena_block) + block_size)) == NULL) {
+      fprintf(stderr, "Error allocating memory: %s\n", strerror(errno));
+      abort();
+    }
+    block->used = 0;
+    block->size = block_size;
+    block->next = arena->head;
+    arena->head = block;
+  }
+
+  block->used += size;
+  return block->data + block->used - size;
+}
+
+char *arena_strdup(struct arena *arena, const char *str) {
+  size_t len = strlen(str) + 1;
+  return memcpy(arena_alloc(arena, len), str, len);
+}
+
+void arena_free(struct arena *arena) {
+  struct arena_block *block, *next;
+
+  for (block = arena->head; block != NULL; block = next) {
+    next = block->next;
+    free(block);
+  }
+  arena->head = NULL;
+}
+
+/*
+ * Looks at the result of a finished post and returns the paste URL from the
+ * response (pointing into resp), or NULL if the post failed.
+ */
+char *paste_url_from_response(struct pastebinc_config *config, CURL *curl, CURLcode res, struct http_response *resp) {
+  long http_resp_code = 0;
+
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_resp_code);
+  if (res == CURLE_WRITE_ERROR && resp->truncated && config->response.kind == RESPONSE_BODY) {
+    fprintf(stderr, "ERROR: the response is bigger than %zu bytes, so it can't be a paste URL\n", config->response.max_bytes);
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: Start of the response: \n%s\n[...]\n", resp->body);
+    return NULL;
+  } else if (res == CURLE_OK && http_resp_code == 302) { // this provider uses a redirect to the paste
+    return resp->location;
+  } else if (res != CURLE_OK || http_resp_code != 200) {
+    if (res != CURLE_OK)
+      fprintf(stderr, "ERROR: %s\n", curl_easy_strerror(res));
+    fprintf(stderr, "ERROR: server response was %ld\n", http_resp_code);
+    if ((http_resp_code == 429 || http_resp_code == 503) && resp->retry_after >= 0)
+      fprintf(stderr, "ERROR: the provider asked to wait %ld seconds before the next paste\n", resp->retry_after);
+    if (config->verbose) {
+      fprintf(stderr, "DEBUG: Contents of response were: \n%s%s\n", resp->body, resp->truncated ? "\n[...]" : "");
+    }
+    return NULL;
+  }
+
+  if (config->response.kind != RESPONSE_BODY) {
+    if (resp->url == NULL) {
+      fprintf(stderr, "ERROR: could not find the paste URL in the response\n");
+      if (config->verbose)
+        fprintf(stderr, "DEBUG: Contents of response were: \n%s%s\n", resp->body, resp->truncated ? "\n[...]" : "");
+    }
+    return resp->url;
+  }
+
+  return resp->body;
+}
+
+/*
+ * Adds a finished transfer to the -S stats: its byte counts, and its phase
+ * times, which replace those of any earlier transfer.
+ */
+void stats_add_transfer(struct pastebinc_config *config, CURL *curl) {
+  struct paste_stats *stats = &config->stats;
+  curl_off_t bytes = 0;
+
+  stats->requests++;
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &stats->connects);
+  if (curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &bytes) == CURLE_OK)
+    stats->bytes_up += bytes;
+  if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes) == CURLE_OK)
+    stats->bytes_down += bytes;
+
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &stats->namelookup);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &stats->connect);
+  curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &stats->appconnect);
+  curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &stats->pretransfer);
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &stats->starttransfer);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &stats->total);
+}
+
+/*
+ * Prints the -S stats to stderr, as aligned text or as one JSON line.  The
+ * curl phases are split so they add up: dns, tcp connect, tls handshake,
+ * sending the request (upload and server time until the first response
+ * byte) and receiving the response.
+ */
+void print_stats(struct pastebinc_config *config) {
+  struct paste_stats *st = &config->stats;
+  gint64 end = g_get_monotonic_time();
+  double input_ms = st->input_done > st->input_start ? (st->input_done - st->input_start) / 1000.0 : 0;
+  double post_ms = st->post_done > st->post_start ? (st->post_done - st->post_start) / 1000.0 : 0;
+  double connected = (st->appconnect > 0 ? st->appconnect : st->connect) / 1000.0;
+  double warmup_ms = st->warmup_done > st->warmup_start ? (st->warmup_done - st->warmup_start) / 1000.0 : 0;
+  double phases[8];
+  const char *names[8] = { "config", "input", "dns", "connect", "tls", "request", "response", "total" };
+  int i;
+
+  phases[0] = (st->config_done - st->start) / 1000.0;
+  phases[1] = input_ms;
+  phases[2] = st->namelookup / 1000.0;
+  phases[3] = st->connect > 0 ? (st->connect - st->namelookup) / 1000.0 : 0;
+  phases[4] = st->appconnect > 0 ? (st->appconnect - st->connect) / 1000.0 : 0;
+  phases[5] = st->starttransfer > 0 ? st->starttransfer / 1000.0 - connected : 0;
+  phases[6] = st->starttransfer > 0 ? (st->total - st->starttransfer) / 1000.0 : 0;
+  phases[7] = (end - st->start) / 1000.0;
+
+  if (strcmp(config->stats_format, "json") == 0) {
+    fprintf(stderr, "{\"provider\":\"%s\",\"requests\":%d", config->provider ? config->provider : "", st->requests);
+    for (i = 0; i < 8; i++)
+      fprintf(stderr, ",\"%s_ms\":%.3f", names[i], phases[i]);
+    fprintf(stderr, ",\"post_ms\":%.3f,\"warmup_ms\":%.3f,\"connects\":%ld,\"redactions\":%zu,\"throttled\":%d,\"bytes_in\":%zu,\"bytes_up\":%" CURL_FORMAT_CURL_OFF_T
+      ",\"bytes_down\":%" CURL_FORMAT_CURL_OFF_T ",\"input_mb_per_s\":%.3f,\"upload_mb_per_s\":%.3f}\n",
+      post_ms, warmup_ms, st->connects, st->redactions, st->throttled, st->bytes_in, st->bytes_up, st->bytes_down,
+      input_ms > 0 ? st->bytes_in / input_ms / 1000.0 : 0, post_ms > 0 ? st->bytes_up / post_ms / 1000.0 : 0);
+    return;
+  }
+
+  // the curl phases are indented under post: they are its (last) request
+  fprintf(stderr, "Stats (%d request%s):\n", st->requests, st->requests == 1 ? "" : "s");
+  for (i = 0; i < 8; i++) {
+    if (i == 2)
+      fprintf(stderr, "  %-10s %10.3f ms\n", "post", post_ms);
+    fprintf(stderr, (i >= 2 && i < 7 ? "    %-8s %10.3f ms\n" : "  %-10s %10.3f ms\n"), names[i], phases[i]);
+  }
+  fprintf(stderr, "  bytes in   %10zu     %.2f MB/s\n", st->bytes_in, input_ms > 0 ? st->bytes_in / input_ms / 1000.0 : 0);
+  fprintf(stderr, "  bytes up   %10" CURL_FORMAT_CURL_OFF_T "     %.2f MB/s\n", st->bytes_up, post_ms > 0 ? st->bytes_up / post_ms / 1000.0 : 0);
+  fprintf(stderr, "  bytes down %10" CURL_FORMAT_CURL_OFF_T "\n", st->bytes_down);
+  if (config->redact != NULL)
+    fprintf(stderr, "  redacted   %10zu\n", st->redactions);
+  if (st->throttled > 0)
+    fprintf(stderr, "  throttled  %10d\n", st->throttled);
+  // the dns, connect and tls phases are ~0 when the post got the warm connection
+  if (st->warmup_start > 0)
+    fprintf(stderr, "  warm-up    %10.3f ms  %s\n", warmup_ms,
+      st->connects == 0 ? "(its connection was reused)" : "(not ready, the post connected itself)");
+}
+
+/*
+ * Path of the dedupe cache entry for a paste's content (hash is of all of
+ * it): one small file per (provider, content, title, user fields such as
+ * format and expiration), named by a hash of all of them, under the user's
+ * cache dir.  Returns NULL if the paste can't be cached, e.g. when the
+ * provider doesn't say how long its pastes live.  The paste's lifetime in
+ * seconds (0 for never expires) goes in ttl.
+ */
+char *dedupe_path(struct pastebinc_config *config, const struct xxh64_state *hash, const char *title, long *ttl) {
+  const char *expiration_field = conf_get(config->conf, "standard_field_names", "expiration");
+  const char *expiration = "default"; // pastes without -x live for the provider's default
+  const char *seconds;
+  struct xxh64_state key;
+  t_user_field *uf;
+  char content[40], name[17];
+
+  if (!config->dedupe)
+    return NULL;
+
+  snprintf(content, sizeof(content), "%016" G_GINT64_MODIFIER "x:%" G_GUINT64_FORMAT,
+    xxh64_digest(hash), hash->total);
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: input xxh64:size is %s\n", content);
+
+  // each string goes in with its terminating NUL, so they can't run together
+  xxh64_init(&key);
+  xxh64_update(&key, config->provider, strlen(config->provider) + 1);
+  xxh64_update(&key, content, strlen(content) + 1);
+  if (title != NULL)
+    xxh64_update(&key, title, strlen(title) + 1);
+  else
+    xxh64_update(&key, "\xff", 1); // no title, which no title string can look like
+  for (uf = config->user_fields; uf != NULL; uf = uf->next) {
+    xxh64_update(&key, uf->name, strlen(uf->name) + 1);
+    xxh64_update(&key, uf->value, strlen(uf->value) + 1);
+    if (expiration_field != NULL && strcmp(uf->name, expiration_field) == 0)
+      expiration = uf->value;
+  }
+
+  if ((seconds = conf_get(config->conf, "expiration_seconds", expiration)) == NULL)
+    return NULL;
+  *ttl = atol(seconds);
+
+  snprintf(name, sizeof(name), "%016" G_GINT64_MODIFIER "x", xxh64_digest(&key));
+  return g_build_filename(g_get_user_cache_dir(), PROGNAME, "pastes", name, NULL);
+}
+
+/*
+ * If content with this hash was already pasted with the same title and
+ * settings, and that paste has not expired yet, returns its URL (which the
+ * caller g_free's).  Expired entries are removed.
+ */
+char *dedupe_find(struct pastebinc_config *config, const struct xxh64_state *hash, const char *title) {
+  char *path, *entry = NULL, *url, *found = NULL;
+  gint64 expires;
+  long ttl;
+
+  if ((path = dedupe_path(config, hash, title, &ttl)) == NULL)
+    return NULL;
+
+  if (g_file_get_contents(path, &entry, NULL, NULL)) {
+    expires = g_ascii_strtoll(entry, &url, 10);
+    g_strstrip(url);
+
+    if (*url == 0 || (expires != 0 && expires <= g_get_real_time() / G_USEC_PER_SEC)) {
+      unlink(path);
+    } else {
+      found = g_strdup(url);
+      if (config->verbose)
+        fprintf(stderr, "DEBUG: same paste found in dedupe cache (%s), not uploading\n", path);
+    }
+    g_free(entry);
+  }
+
+  g_free(path);
+  return found;
+}
+
+/*
+ * Remembers the URL of a paste of content with this hash, until a little
+ * before the paste expires.
+ */
+void dedupe_remember(struct pastebinc_config *config, const struct xxh64_state *hash, const char *title, const char *url) {
+  char *path, *dir, *entry;
+  gint64 expires = 0;
+  long ttl;
+
+  if ((path = dedupe_path(config, hash, title, &ttl)) == NULL)
+    return;
+
+  if (ttl > 0)
+    expires = g_get_real_time() / G_USEC_PER_SEC + ttl - MIN(DEDUPE_MARGIN, ttl / 2);
+
+  // failing to write the entry only costs us an upload next time
+  dir = g_path_get_dirname(path);
+  entry = g_strdup_printf("%" G_GINT64_FORMAT " %s\n", expires, url);
+  if (g_mkdir_with_parents(dir, 0700) == 0)
+    g_file_set_contents(path, entry, -1, NULL);
+
+  g_free(entry);
+  g_free(dir);
+  g_free(path);
+}
+
+/*
+ * If the spooled input was already pasted with the same settings and that
+ * paste has not expired yet, prints its URL and returns 1 so nothing gets
+ * uploaded.
+ */
+int dedupe_lookup(struct pastebinc_config *config, struct paste_info *pi) {
+  char *url = dedupe_find(config, &pi->hash, config->name);
+
+  if (url == NULL)
+    return 0;
+
+  fprintf(stderr, (config->verbose ? "Paste URL: %s\n" : "%s\n"), url);
+  g_free(url);
+  return 1;
+}
+
+/*
+ * Remembers the URL of the paste just made from the spooled input.
+ */
+void dedupe_store(struct pastebinc_config *config, struct paste_info *pi, const char *url) {
+  if (!config->stream)
+    dedupe_remember(config, &pi->hash, config->name, url);
+}
+
+/*
+ * curl share lock callbacks; userp is the share's array of mutexes, one per
+ * kind of data.
+ */
+void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userp) {
+  g_mutex_lock(&((GMutex *) userp)[data]);
+}
+
+void share_unlock(CURL *handle, curl_lock_data data, void *userp) {
+  g_mutex_unlock(&((GMutex *) userp)[data]);
+}
+
+/*
+ * A curl share for a connection pool, DNS cache and TLS session cache that
+ * handles in several threads use.  locks has CURL_LOCK_DATA_LAST mutexes,
+ * which are initialized here and cleared by the caller.
+ */
+CURLSH *share_new(GMutex *locks) {
+  CURLSH *share = curl_share_init();
+  int i;
+
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    g_mutex_init(&locks[i]);
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC, &share_lock);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, &share_unlock);
+  curl_share_setopt(share, CURLSHOPT_USERDATA, (void *)locks);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+  return share;
+}
+
+/*
+ * Whether transfers go through a proxy, in which case the address curl
+ * connected to is the proxy's and not worth keeping for the provider.
+ */
+int net_cache_proxied(struct pastebinc_config *config) {
+  static const char *vars[] = { "http_proxy", "https_proxy", "HTTPS_PROXY", "all_proxy", "ALL_PROXY", NULL };
+  const char *value;
+  int i;
+
+  if (config->bypass_proxy)
+    return 0;
+  for (i = 0; vars[i] != NULL; i++) {
+    if ((value = getenv(vars[i])) != NULL && *value)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * The "host:port" of the transfer's url, which is how hosts are looked up
+ * in the cache.  The caller g_free's it.
+ */
+char *net_cache_host_key(CURL *curl) {
+  CURLU *url = curl_url();
+  char *effective = NULL, *host = NULL, *port = NULL, *key = NULL;
+
+  if (curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &effective) == CURLE_OK && effective != NULL
+      && curl_url_set(url, CURLUPART_URL, effective, 0) == CURLUE_OK
+      && curl_url_get(url, CURLUPART_HOST, &host, 0) == CURLUE_OK
+      && curl_url_get(url, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK)
+    key = g_strdup_printf("%s:%s", host, port);
+
+  curl_free(host);
+  curl_free(port);
+  curl_url_cleanup(url);
+  return key;
+}
+
+void net_cache_host_free(gpointer data) {
+  struct net_cache_host *host = data;
+
+  g_free(host->resolve);
+  g_free(host);
+}
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+/*
+ * Collects one ticket from curl's session cache, for net_cache_save.  The
+ * peer's host:port (what session_key starts with) is kept only to count TLS
+ * cache hits; curl finds the ticket by its salted hash, shmac.
+ */
+CURLcode net_cache_export_ticket(CURL *handle, void *userptr, const char *session_key, const unsigned char *shmac,
+                                 size_t shmac_len, const unsigned char *sdata, size_t sdata_len, curl_off_t valid_until,
+                                 int ietf_tls_id, const char *alpn, size_t earlydata_max) {
+  GPtrArray *tickets = userptr;
+  const char *colon = session_key != NULL ? strchr(session_key, ':') : NULL;
+  size_t host_len = colon != NULL ? strcspn(colon + 1, ":") + (colon + 1 - session_key) : 0;
+  char *mac = g_base64_encode(shmac, shmac_len);
+  char *data = g_base64_encode(sdata, sdata_len);
+
+  g_ptr_array_add(tickets, g_strdup_printf("tls %" CURL_FORMAT_CURL_OFF_T " %.*s %s %s\n", valid_until,
+                                           host_len > 0 ? (int) host_len : 1, host_len > 0 ? session_key : "-", mac, data));
+  g_free(mac);
+  g_free(data);
+  return CURLE_OK;
+}
+#endif
+
+/*
+ * Reads the net cache (net_cache=1): addresses still within their TTL go
+ * into the list every transfer is given as CURLOPT_RESOLVE, so none of them
+ * has to wait for DNS, and TLS tickets that have not expired are imported
+ * into a share all transfers use, so the first handshake with a provider can
+ * resume a session instead of doing a full one.
+ */
+void net_cache_load(struct pastebinc_config *config) {
+  struct net_cache *nc;
+  struct net_cache_host *host;
+  char *dir, *text = NULL;
+  char **lines, **fields;
+  gint64 now = time(NULL);
+  CURL *curl = NULL;
+  int fd, i, tickets = 0;
+
+  if (!config->net_cache || config->net != NULL)
+    return;
+
+  dir = g_build_filename(g_get_user_cache_dir(), PROGNAME, NULL);
+  g_mkdir_with_parents(dir, 0700);
+  nc = calloc(1, sizeof(struct net_cache));
+  nc->path = g_build_filename(dir, "net", NULL);
+  nc->share = share_new(nc->share_locks);
+  nc->hosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, &net_cache_host_free);
+  nc->imported = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  config->net = nc;
+  g_free(dir);
+
+  // a run that is saving the cache right now has it locked
+  if ((fd = open(nc->path, O_RDONLY | O_CLOEXEC)) == -1)
+    return;
+  flock(fd, LOCK_SH);
+  g_file_get_contents(nc->path, &text, NULL, NULL);
+  flock(fd, LOCK_UN);
+  close(fd);
+  if (text == NULL)
+    return;
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+  // tickets go into the share through any handle that uses it
+  if ((curl = curl_easy_init()) != NULL)
+    curl_easy_setopt(curl, CURLOPT_SHARE, nc->share);
+#endif
+
+  lines = g_strsplit(text, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++) {
+    fields = g_strsplit(lines[i], " ", -1);
+
+    // dns <expires> <host:port:addr>
+    if (g_strv_length(fields) == 3 && strcmp(fields[0], "dns") == 0 && g_ascii_strtoll(fields[1], NULL, 10) > now) {
+      host = g_new0(struct net_cache_host, 1);
+      host->resolve = g_strdup(fields[2]);
+      host->expires = g_ascii_strtoll(fields[1], NULL, 10);
+      host->loaded = 1;
+      g_hash_table_replace(nc->hosts, g_strndup(host->resolve, strrchr(host->resolve, ':') - host->resolve), host);
+      nc->resolve = curl_slist_append(nc->resolve, host->resolve);
+    }
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+    // tls <valid until> <host:port> <shmac> <session>
+    if (g_strv_length(fields) == 5 && strcmp(fields[0], "tls") == 0 && g_ascii_strtoll(fields[1], NULL, 10) > now) {
+      gsize mac_len, data_len;
+      guchar *mac = g_base64_decode(fields[3], &mac_len);
+      guchar *data = g_base64_decode(fields[4], &data_len);
+
+      if (curl != NULL && curl_easy_ssls_import(curl, NULL, mac, mac_len, data, data_len) == CURLE_OK) {
+        g_hash_table_replace(nc->imported, g_strdup(fields[3]), g_strdup(fields[2]));
+        tickets++;
+      }
+      g_free(mac);
+      g_free(data);
+    }
+#endif
+
+    g_strfreev(fields);
+  }
+  g_strfreev(lines);
+  g_free(text);
+
+  curl_easy_cleanup(curl);
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: net cache: %u cached addresses, %d TLS sessions loaded from %s\n",
+            g_hash_table_size(nc->hosts), tickets, nc->path);
+}
+
+/*
+ * Notes what a finished transfer tells the cache: whether its new
+ * connection (if it made one) found the address and a TLS ticket in the
+ * cache, and the address it connected to.  A cached address keeps the
+ * expiry it was first stored with: using it does not make it any fresher.
+ *
+ * If the transfer could not connect to a cached address, the address is
+ * dropped (and taken out of curl's DNS cache by the next transfer), and 1
+ * is returned so the caller can try again with a fresh lookup.
+ */
+int net_cache_learn(struct pastebinc_config *config, CURL *curl, CURLcode res) {
+  struct net_cache *nc = config->net;
+  struct net_cache_host *host;
+  long connects = 0;
+  char *key, *ip = NULL, *scheme = NULL, *removal;
+  GHashTableIter iter;
+  gpointer ticket_host;
+
+  if (nc == NULL || (key = net_cache_host_key(curl)) == NULL)
+    return 0;
+
+  host = g_hash_table_lookup(nc->hosts, key);
+  if (host != NULL && host->loaded && host->expires > 0 && (res == CURLE_COULDNT_CONNECT || res == CURLE_OPERATION_TIMEDOUT)) {
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: net cache: can not connect to the cached address of %s, looking it up again\n", key);
+    host->expires = 0;
+    host->loaded = 0;
+    removal = g_strdup_printf("-%s", key);
+    curl_slist_free_all(nc->resolve);
+    nc->resolve = curl_slist_append(NULL, removal);
+    g_hash_table_iter_init(&iter, nc->hosts);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &host)) {
+      if (host->loaded && host->expires > 0)
+        nc->resolve = curl_slist_append(nc->resolve, host->resolve);
+    }
+    g_free(removal);
+    g_free(key);
+    return 1;
+  }
+
+  if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) != CURLE_OK || connects == 0) {
+    g_free(key);
+    return 0;
+  }
+
+  nc->lookups++;
+  if (host != NULL && host->loaded)
+    nc->dns_hits++;
+
+  curl_easy_getinfo(curl, CURLINFO_SCHEME, &scheme);
+  if (scheme != NULL && g_ascii_strcasecmp(scheme, "https") == 0) {
+    nc->handshakes++;
+    g_hash_table_iter_init(&iter, nc->imported);
+    while (g_hash_table_iter_next(&iter, NULL, &ticket_host)) {
+      if (strcmp(ticket_host, key) == 0) {
+        nc->tls_hits++;
+        break;
+      }
+    }
+  }
+
+  if ((host == NULL || !host->loaded) && !net_cache_proxied(config)
+      && curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip) == CURLE_OK && ip != NULL && *ip) {
+    host = g_new0(struct net_cache_host, 1);
+    host->resolve = g_strdup_printf(strchr(ip, ':') != NULL ? "%s:[%s]" : "%s:%s", key, ip);
+    host->expires = time(NULL) + config->net_cache_ttl;
+    g_hash_table_replace(nc->hosts, key, host);
+    return 0;
+  }
+
+  g_free(key);
+  return 0;
+}
+
+/*
+ * Writes the cache back, merged with what other runs saved since it was
+ * loaded: their entries are kept unless this run has a newer one for the
+ * same host, or used up the ticket (TLS 1.3 tickets are for one
+ * resumption).  The file is rewritten in place under an exclusive lock,
+ * which readers wait for.
+ */
+void net_cache_save(struct pastebinc_config *config) {
+  struct net_cache *nc = config->net;
+  struct net_cache_host *host;
+  GPtrArray *tickets = g_ptr_array_new_with_free_func(g_free);
+  GHashTable *exported = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  GString *old = g_string_new(NULL), *out = g_string_new(NULL);
+  GHashTableIter iter;
+  char **lines, **fields, *key;
+  char buf[4096];
+  gint64 now = time(NULL);
+  ssize_t readval;
+  int fd, i, hosts = 0;
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+  CURL *curl;
+  CURLcode res;
+
+  if ((curl = curl_easy_init()) != NULL) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, nc->share);
+    if ((res = curl_easy_ssls_export(curl, &net_cache_export_ticket, tickets)) != CURLE_OK && config->verbose)
+      fprintf(stderr, "DEBUG: net cache: can not save TLS sessions: %s\n", curl_easy_strerror(res));
+    curl_easy_cleanup(curl);
+  }
+#endif
+
+  // "tls <valid until> <host> <shmac> ...": the shmac is the ticket's identity
+  for (i = 0; i < tickets->len; i++) {
+    fields = g_strsplit(g_ptr_array_index(tickets, i), " ", 5);
+    g_hash_table_add(exported, g_strdup(fields[3]));
+    g_strfreev(fields);
+  }
+
+  if ((fd = open(nc->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: net cache: can not open %s: %s\n", nc->path, strerror(errno));
+    goto out;
+  }
+  flock(fd, LOCK_EX);
+  while ((readval = read(fd, buf, sizeof(buf))) > 0)
+    g_string_append_len(old, buf, readval);
+
+  lines = g_strsplit(old->str, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++) {
+    fields = g_strsplit(lines[i], " ", -1);
+    if (g_strv_length(fields) == 3 && strcmp(fields[0], "dns") == 0 && g_ascii_strtoll(fields[1], NULL, 10) > now) {
+      key = g_strndup(fields[2], strrchr(fields[2], ':') - fields[2]);
+      if (!g_hash_table_contains(nc->hosts, key))
+        g_string_append_printf(out, "%s\n", lines[i]);
+      g_free(key);
+    } else if (g_strv_length(fields) == 5 && strcmp(fields[0], "tls") == 0 && g_ascii_strtoll(fields[1], NULL, 10) > now
+               && !g_hash_table_contains(exported, fields[3]) && !g_hash_table_contains(nc->imported, fields[3])) {
+      g_string_append_printf(out, "%s\n", lines[i]);
+    }
+    g_strfreev(fields);
+  }
+  g_strfreev(lines);
+
+  g_hash_table_iter_init(&iter, nc->hosts);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &host)) {
+    if (host->expires > now) {
+      g_string_append_printf(out, "dns %" G_GINT64_FORMAT " %s\n", host->expires, host->resolve);
+      hosts++;
+    }
+  }
+  for (i = 0; i < tickets->len; i++)
+    g_string_append(out, g_ptr_array_index(tickets, i));
+
+  if (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1 || write_all(fd, out->str, out->len))
+    fprintf(stderr, "ERROR: Can not write the net cache %s: %s\n", nc->path, strerror(errno));
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: net cache: saved %d addresses and %u TLS sessions\n", hosts, tickets->len);
+
+out:
+  g_hash_table_destroy(exported);
+  g_ptr_array_free(tickets, TRUE);
+  g_string_free(old, TRUE);
+  g_string_free(out, TRUE);
+}
+
+/*
+ * Reports the hit rates, saves the cache and frees it.  Called once every
+ * transfer of the run is done.
+ */
+void net_cache_finish(struct pastebinc_config *config) {
+  struct net_cache *nc = config->net;
+  int i;
+
+  if (nc == NULL)
+    return;
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: net cache: %d of %d connections skipped DNS, %d of %d TLS handshakes had a saved session\n",
+            nc->dns_hits, nc->lookups, nc->tls_hits, nc->handshakes);
+
+  net_cache_save(config);
+
+  curl_share_cleanup(nc->share);
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    g_mutex_clear(&nc->share_locks[i]);
+  curl_slist_free_all(nc->resolve);
+  g_hash_table_destroy(nc->hosts);
+  g_hash_table_destroy(nc->imported);
+  g_free(nc->path);
+  free(nc);
+  config->net = NULL;
+}
+
+/*
+ * Runs the warm-up request until it is done or warmup_finish cancels it.
+ */
+gpointer warmup_run(gpointer data) {
+  struct warmup *w = (struct warmup *) data;
+  int running = 1;
+
+  while (running && !g_atomic_int_get(&w->cancel)) {
+    if (curl_multi_perform(w->multi, &running) != CURLM_OK)
+      break;
+    if (running)
+      curl_multi_poll(w->multi, NULL, 0, 1000, NULL);
+  }
+
+  return NULL;
+}
+
+/*
+ * Discards the body of the warm-up response, in case the server sends one.
+ */
+size_t warmup_discard(char *ptr, size_t size, size_t nmemb, void *userdata) {
+  return size * nmemb;
+}
+
+/*
+ * Starts resolving, connecting and doing the TLS handshake with the provider
+ * while the input is still being spooled, so the post can go out as soon as
+ * the input ends.  A thread sends a HEAD to the paste url (there is no way
+ * to have curl just connect and then reuse the connection for a post); the
+ * connection is then left in a share that setup_post_handle adds the post
+ * to.  If the warm-up is not done by the time the post starts, the post
+ * opens a connection of its own, like it would have anyway.
+ */
+void warmup_start(struct pastebinc_config *config) {
+  const char *url = config->ntargets > 0 ? config->targets[0] : conf_get(config->conf, "server", "url");
+  struct warmup *w;
+
+  if (!config->preconnect || url == NULL || config->warmup != NULL)
+    return;
+
+  w = calloc(1, sizeof(struct warmup));
+  w->share = config->net != NULL ? config->net->share : share_new(w->share_locks);
+  w->multi = curl_multi_init();
+  w->curl = curl_easy_init();
+  if (w->curl == NULL || w->multi == NULL) {
+    // no warm-up, the post will find out if curl is really broken
+    curl_easy_cleanup(w->curl);
+    curl_multi_cleanup(w->multi);
+    if (config->net == NULL)
+      curl_share_cleanup(w->share);
+    free(w);
+    return;
+  }
+
+  curl_easy_setopt(w->curl, CURLOPT_URL, url);
+  curl_easy_setopt(w->curl, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(w->curl, CURLOPT_WRITEFUNCTION, &warmup_discard);
+  curl_easy_setopt(w->curl, CURLOPT_SHARE, w->share);
+  if (config->net != NULL)
+    curl_easy_setopt(w->curl, CURLOPT_RESOLVE, config->net->resolve);
+  if (config->bypass_proxy)
+    curl_easy_setopt(w->curl, CURLOPT_NOPROXY, "*");
+  curl_multi_add_handle(w->multi, w->curl);
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: warming up a connection to %s\n", url);
+
+  config->stats.warmup_start = g_get_monotonic_time();
+  config->warmup = w;
+  w->thread = g_thread_new("warmup", &warmup_run, w);
+}
+
+/*
+ * Stops the warm-up (if it is still going) and releases it.  Called once
+ * the post is done; the warm-up counts in the stats if it was finished
+ * before then.
+ */
+void warmup_finish(struct pastebinc_config *config) {
+  struct warmup *w = config->warmup;
+  curl_off_t took = 0;
+  CURLMsg *msg;
+  int left, i;
+
+  if (w == NULL)
+    return;
+
+  g_atomic_int_set(&w->cancel, 1);
+  curl_multi_wakeup(w->multi);
+  g_thread_join(w->thread);
+
+  while ((msg = curl_multi_info_read(w->multi, &left)) != NULL) {
+    if (msg->msg == CURLMSG_DONE)
+      net_cache_learn(config, w->curl, msg->data.result);
+    if (msg->msg == CURLMSG_DONE && msg->data.result == CURLE_OK) {
+      curl_easy_getinfo(w->curl, CURLINFO_TOTAL_TIME_T, &took);
+      config->stats.warmup_done = config->stats.warmup_start + took;
+    } else if (msg->msg == CURLMSG_DONE && config->verbose) {
+      fprintf(stderr, "DEBUG: warm-up failed: %s\n", curl_easy_strerror(msg->data.result));
+    }
+  }
+
+  if (config->verbose && took > 0)
+    fprintf(stderr, "DEBUG: warm-up took %.3f ms\n", took / 1000.0);
+
+  curl_multi_remove_handle(w->multi, w->curl);
+  curl_easy_cleanup(w->curl);
+  curl_multi_cleanup(w->multi);
+  if (config->net == NULL || w->share != config->net->share) {
+    curl_share_cleanup(w->share);
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+      g_mutex_clear(&w->share_locks[i]);
+  }
+  free(w);
+  config->warmup = NULL;
+}
+
+/*
+ * Sets up the provider's rate limiter from its [server] section:
+ * rate_limit=N/S allows N pastes every S seconds (just N means a second),
+ * in bursts of up to rate_burst (N by default).  Every config gets one, even
+ * without a rate_limit, as a 429 or 503 holds back the pastes after it too.
+ */
+int rate_load(struct pastebinc_config *config) {
+  const char *spec = conf_get(config->conf, "server", "rate_limit");
+  struct rate_limiter *r = calloc(1, sizeof(struct rate_limiter));
+  double count, seconds = 1;
+  char *end, *dir, *name, *path;
+
+  r->fd = -1;
+  g_mutex_init(&r->lock);
+  config->rate = r;
+  config->rate_retries = conf_get_int(config->conf, "server", "rate_retries", 3);
+
+  if (spec != NULL) {
+    count = g_ascii_strtod(spec, &end);
+    if (*end == '/')
+      seconds = g_ascii_strtod(end + 1, &end);
+    if (*end != 0 || count <= 0 || seconds <= 0) {
+      fprintf(stderr, "ERROR: rate_limit should be pastes/seconds (like 10/60), not '%s'\n", spec);
+      return 1;
+    }
+    r->rate = count / seconds;
+    r->burst = conf_has_key(config->conf, "server", "rate_burst")
+      ? g_ascii_strtod(conf_get(config->conf, "server", "rate_burst"), NULL) : count;
+    r->burst = MAX(r->burst, 1);
+    r->tokens = r->burst;
+    r->updated = g_get_real_time();
+
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: rate limit: %.3f pastes a second, bursts of %.0f\n", r->rate, r->burst);
+  }
+
+  if (conf_get_int(config->conf, "server", "rate_shared", 0)) {
+    dir = g_build_filename(g_get_user_cache_dir(), PROGNAME, NULL);
+    name = g_strdup_printf("rate-%s", config->provider);
+    path = g_build_filename(dir, name, NULL);
+    g_mkdir_with_parents(dir, 0700);
+    if ((r->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+      fprintf(stderr, "ERROR: Can not open %s, the rate limit is not shared: %s\n", path, strerror(errno));
+    else if (config->verbose)
+      fprintf(stderr, "DEBUG: rate limit shared through %s\n", path);
+    g_free(path);
+    g_free(name);
+    g_free(dir);
+  }
+
+  return 0;
+}
+
+void rate_free(struct rate_limiter *r) {
+  if (r == NULL)
+    return;
+
+  if (r->fd != -1)
+    close(r->fd);
+  g_mutex_clear(&r->lock);
+  free(r);
+}
+
+/*
+ * Takes the limiter's locks and, when it is shared, reads its state from the
+ * file ("tokens updated blocked_until"), then tops the bucket up for the time
+ * that went by.  An empty or garbled file leaves our own state in place.
+ */
+void rate_lock(struct rate_limiter *r, gint64 now) {
+  char buf[128];
+  ssize_t len;
+  double tokens;
+  gint64 updated, blocked_until;
+
+  g_mutex_lock(&r->lock);
+  if (r->fd != -1) {
+    flock(r->fd, LOCK_EX);
+    if ((len = pread(r->fd, buf, sizeof(buf) - 1, 0)) > 0) {
+      buf[len] = 0;
+      if (sscanf(buf, "%lf %" G_GINT64_FORMAT " %" G_GINT64_FORMAT, &tokens, &updated, &blocked_until) == 3) {
+        r->tokens = MIN(tokens, r->burst);
+        r->updated = updated;
+        r->blocked_until = blocked_until;
+      }
+    }
+  }
+
+  if (r->rate > 0 && now > r->updated) {
+    r->tokens = MIN(r->burst, r->tokens + (now - r->updated) * r->rate / G_USEC_PER_SEC);
+    r->updated = now;
+  }
+}
+
+/*
+ * Writes the limiter's state back to its file, when it is shared, and lets
+ * go of the locks rate_lock took.  If it can't be written the other
+ * processes just don't see what this one took.
+ */
+void rate_unlock(struct rate_limiter *r) {
+  char buf[128];
+  int len;
+
+  if (r->fd != -1) {
+    len = snprintf(buf, sizeof(buf), "%.6f %" G_GINT64_FORMAT " %" G_GINT64_FORMAT "\n", r->tokens, r->updated, r->blocked_until);
+    if (pwrite(r->fd, buf, len, 0) != len || ftruncate(r->fd, len) == -1)
+      fprintf(stderr, "ERROR: Can not save the shared rate limit state: %s\n", strerror(errno));
+    flock(r->fd, LOCK_UN);
+  }
+  g_mutex_unlock(&r->lock);
+}
+
+/*
+ * Takes a token for one paste.  Returns 0 if there was one, otherwise how
+ * many microseconds to wait before asking again.
+ */
+gint64 rate_take(struct pastebinc_config *config) {
+  struct rate_limiter *r = config->rate;
+  gint64 now = g_get_real_time();
+  gint64 wait = 0;
+
+  if (r == NULL)
+    return 0;
+
+  rate_lock(r, now);
+  if (r->blocked_until > now)
+    wait = r->blocked_until - now;
+  else if (r->rate > 0 && r->tokens < 1)
+    wait = (gint64) ((1 - r->tokens) / r->rate * G_USEC_PER_SEC) + 1;
+  else if (r->rate > 0)
+    r->tokens -= 1;
+  rate_unlock(r);
+
+  return wait;
+}
+
+/*
+ * Blocks until the rate limiter lets one more paste go.
+ */
+void rate_wait(struct pastebinc_config *config) {
+  gint64 wait;
+
+  while ((wait = rate_take(config)) > 0) {
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: waiting %.3f s for the rate limit\n", wait / (double) G_USEC_PER_SEC);
+    g_usleep(wait);
+  }
+}
+
+/*
+ * Looks at a finished post for the provider telling us to slow down (a 429,
+ * or a 503).  If it did, the bucket is blocked for as long as its
+ * Retry-After says, or without one for a backoff that doubles with each
+ * attempt, and then starts over from a single paste.  Returns that time in
+ * microseconds if the paste can be tried again (after rate_wait), or -1 if
+ * it was not throttled or has been tried rate_retries times already.
+ */
+gint64 rate_throttled(struct pastebinc_config *config, CURL *curl, CURLcode res, struct http_response *resp, int attempt) {
+  struct rate_limiter *r = config->rate;
+  gint64 now = g_get_real_time();
+  gint64 delay;
+  long code = 0;
+
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+  if (res != CURLE_OK || (code != 429 && code != 503))
+    return -1;
+
+  config->stats.throttled++;
+  if (resp->retry_after >= 0)
+    delay = resp->retry_after * G_USEC_PER_SEC;
+  else
+    delay = (gint64) MIN(RATE_BACKOFF_MAX, 1 << MIN(attempt, 16)) * G_USEC_PER_SEC;
+
+  if (r != NULL) {
+    rate_lock(r, now);
+    // one paste may go when the time is up, then the bucket fills from there
+    r->blocked_until = MAX(r->blocked_until, now + delay);
+    r->tokens = MIN(r->tokens, 1);
+    r->updated = MAX(r->updated, r->blocked_until);
+    rate_unlock(r);
+  }
+
+  if (attempt >= config->rate_retries || delay > (gint64) RATE_WAIT_MAX * G_USEC_PER_SEC)
+    return -1;
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: server response was %ld, trying again in %.3f s\n", code, delay / (double) G_USEC_PER_SEC);
+  return delay;
+}
+
+/*
+ * Post the content contained within paste_info to the appropriate site (from config)
+ */
+int pastebin_post(struct pastebinc_config *config, struct paste_info *pi) {
+  struct http_response resp;
+  char *paste_url = NULL;
+  char *key_url = NULL;
+
+  CURL *curl;
+  CURLcode res;
+  struct curl_httppost *post = NULL;
+  struct curl_slist *headers = NULL;
+  int abort = 0;
+  int attempts = 0;
+  int resendable = !config->stream && config->compression == NULL && !config->encrypt;
+
+  // with mirrors, spooled input can be sent to more than one of them
+  if (!config->stream && !config->encrypt && config->ntargets > 1) {
+    paste_url = post_hedged(config, pi);
+    fprintf(stderr, (config->verbose || paste_url == NULL ? "Paste URL: %s\n" : "%s\n"), paste_url != NULL ? paste_url : "(null)");
+    if (paste_url == NULL)
+      return 1;
+    dedupe_store(config, pi, paste_url);
+    free(paste_url);
+    return 0;
+  }
+
+  // encrypted content always goes through the read callback, from the tmp
+  // file if the input was spooled
+  if (start_encryption(config, pi))
+    return 1;
+  if (config->encrypt && !config->stream)
+    lseek(pi->fd, 0, SEEK_SET);
+
+  // don't want to have the curl default "Expect: 100" header, so we override it:
+  headers = curl_slist_append(headers, "Expect:");
+
+  // spooled input was normalized and redacted on its way to the tmp file
+  if (config->stream) {
+    start_normalization(config, pi);
+    start_redaction(config, pi);
+  }
+
+  if (config->compression != NULL) {
+    // compressed content always goes through the read callback, from the tmp
+    // file if the input was spooled
+    if (!config->stream)
+      lseek(pi->fd, 0, SEEK_SET);
+    start_compression(config, pi);
+  }
+
+  post = build_post_form(config, config->name, (config->stream || config->compression || config->encrypt) ? NULL : pi->tmpname, NULL, 0, pi);
+  init_http_response(config, &resp);
+
+  curl = curl_easy_init();
+  if (curl) {
+    setup_post_handle(config, curl, post, headers, &resp);
+
+    rate_wait(config);
+    res = curl_easy_perform(curl);
+    stats_add_transfer(config, curl);
+
+    // a spooled paste not sent through the read callback can simply be
+    // sent again, once the stale address is out of the way
+    if (net_cache_learn(config, curl, res) && resendable) {
+      curl_easy_setopt(curl, CURLOPT_RESOLVE, config->net->resolve);
+      res = curl_easy_perform(curl);
+      stats_add_transfer(config, curl);
+      net_cache_learn(config, curl, res);
+    }
+
+    // ... or when the provider asks us to slow down (a stream only gets to
+    // hold back the pastes after it)
+    while (rate_throttled(config, curl, res, &resp, resendable ? attempts++ : config->rate_retries) >= 0) {
+      free_http_response(&resp);
+      init_http_response(config, &resp);
+      rate_wait(config);
+      res = curl_easy_perform(curl);
+      stats_add_transfer(config, curl);
+    }
+
+    if (config->stream && config->verbose)
+      fprintf(stderr, "DEBUG: streamed %zu bytes of input\n", pi->bytes_read);
+
+    finish_compression(config, pi);
+    finish_redaction(config, pi);
+    finish_normalization(config, pi);
+    paste_url = paste_url_from_response(config, curl, res, &resp);
+    if (paste_url != NULL && pi->crypt != NULL)
+      paste_url = key_url = encryption_url(pi, paste_url);
+
+    fprintf(stderr, (config->verbose || paste_url == NULL ? "Paste URL: %s\n" : "%s\n"), paste_url != NULL ? paste_url : "(null)");
+
+    if (paste_url == NULL)
+      abort = 1; // failed
+    else
+      dedupe_store(config, pi, paste_url);
+
+    curl_easy_cleanup(curl);
+  } else {
+    fprintf(stderr, "Error initializing curl: %s\n", strerror(errno));
+    abort = 1;
+  }
+
+  finish_redaction(config, pi);
+  finish_normalization(config, pi);
+  finish_encryption(config, pi);
+  curl_formfree(post);
+  curl_slist_free_all(headers);
+  free_http_response(&resp);
+  g_free(key_url);
+
+  return abort;
+}
+
+/*
+ * Title for a file in a batch: the file name, prefixed by the -n title if the
+ * user gave one.
+ */
+char *batch_job_title(struct pastebinc_config *config, const char *path) {
+  const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+  if (config->name_given)
+    return g_strdup_printf("%s (%s)", config->name, base);
+
+  return g_strdup(base);
+}
+
+/*
+ * Adds a file to the list of files to paste in batch mode.
+ */
+int add_batch_file(struct pastebinc_config *config, char *path) {
+  char **files = realloc(config->batch_files, (config->batch_count + 1) * sizeof(char *));
+  if (files == NULL) {
+    fprintf(stderr, "Error allocating memory for batch file list: %s\n", strerror(errno));
+    return 1;
+  }
+  config->batch_files = files;
+  config->batch_files[config->batch_count++] = path;
+  return 0;
+}
+
+/*
+ * Reads a manifest (one file path per line, "-" for stdin) into the batch
+ * file list.  Blank lines are ignored.
+ */
+int read_batch_manifest(struct pastebinc_config *config, const char *manifest) {
+  FILE *in = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  int abort = 0;
+
+  if (in == NULL) {
+    fprintf(stderr, "ERROR: Can not open manifest %s: %s\n", manifest, strerror(errno));
+    return 1;
+  }
+
+  while (!abort && (len = getline(&line, &linecap, in)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = 0;
+
+    if (len > 0)
+      abort = add_batch_file(config, arena_strdup(config->arena, line));
+  }
+
+  free(line);
+  if (in != stdin)
+    fclose(in);
+
+  return abort;
+}
+
+/*
+ * Releases everything a job held while it was being uploaded and marks it
+ * done.  The job's url (if any) is kept.
+ */
+void finish_job(struct pastebinc_config *config, struct batch_job *job) {
+  if (job->post != NULL)
+    curl_formfree(job->post);
+  job->post = NULL;
+
+  if (job->map != NULL) {
+    munmap(job->map, job->len);
+    job->map = NULL;
+    job->buf = NULL;
+    job->len = 0;
+  }
+
+  if (job->pi.gz != NULL)
+    finish_compression(config, &job->pi);
+  finish_redaction(config, &job->pi);
+  if (job->pi.fd != -1)
+    close(job->pi.fd);
+  job->pi.fd = -1;
+
+  free_http_response(&job->resp);
+  job->done = 1;
+}
+
+/*
+ * Sets up a post engine: one curl multi handle that runs up to
+ * config->parallel paste jobs at once.  Easy handles are recycled between
+ * jobs and the multi handle's connection cache keeps connections to the
+ * provider alive, so only the first few pastes pay for DNS, TCP and TLS
+ * setup.
+ */
+int engine_init(struct pastebinc_config *config, struct post_engine *engine) {
+  memset(engine, 0, sizeof(struct post_engine));
+  engine->size = MAX(config->parallel, config->ntargets);
+
+  if ((engine->idle = calloc(engine->size, sizeof(CURL *))) == NULL) {
+    fprintf(stderr, "Error allocating memory for %d curl handles: %s\n", config->parallel, strerror(errno));
+    return 1;
+  }
+
+  engine->headers = curl_slist_append(engine->headers, "Expect:");
+  engine->waiting = g_ptr_array_new();
+
+  engine->multi = curl_multi_init();
+  curl_multi_setopt(engine->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long) config->parallel);
+  curl_multi_setopt(engine->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) config->parallel);
+  curl_multi_setopt(engine->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  return 0;
+}
+
+void engine_cleanup(struct post_engine *engine) {
+  int i;
+
+  for (i = 0; i < engine->nidle; i++)
+    curl_easy_cleanup(engine->idle[i]);
+
+  curl_multi_cleanup(engine->multi);
+  curl_slist_free_all(engine->headers);
+  g_ptr_array_free(engine->waiting, TRUE);
+  free(engine->idle);
+}
+
+/*
+ * Maps a job's file, so it is posted straight from the page cache like a
+ * buffer instead of being read (and copied) by curl.  Files that can't be
+ * mapped, like pipes or empty files, are left to be read as before.
+ * Returns 1 if the file can't be opened.
+ */
+int batch_job_map(struct batch_job *job) {
+  struct stat st;
+  int fd;
+
+  if ((fd = open(job->path, O_RDONLY | O_CLOEXEC)) == -1) {
+    fprintf(stderr, "ERROR: Can not read %s: %s\n", job->path, strerror(errno));
+    return 1;
+  }
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+      && (job->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+    madvise(job->map, st.st_size, MADV_SEQUENTIAL);
+    job->buf = job->map;
+    job->len = st.st_size;
+  } else {
+    job->map = NULL;
+  }
+
+  close(fd);
+  return 0;
+}
+
+/*
+ * Sends a job off, now that the rate limiter has let it go.  If it can not
+ * be started it is marked done (without a url) and 1 is returned.
+ */
+int engine_launch_job(struct pastebinc_config *config, struct post_engine *engine, struct batch_job *job) {
+  memset(&job->pi, 0, sizeof(job->pi));
+  job->pi.fd = -1;
+  if (job->path != NULL && job->map == NULL && batch_job_map(job)) {
+    job->done = 1;
+    return 1;
+  }
+
+  if (config->compression != NULL || job->redact || job->map != NULL) {
+    // compressed or redacted content has to go through the read callback; a
+    // mapped file does too, as curl would copy it if it were given as a
+    // buffer
+    if (job->buf != NULL) {
+      job->pi.prefix = (char *) job->buf;
+      job->pi.prefix_len = job->len;
+    } else if ((job->pi.fd = open(job->path, O_RDONLY)) == -1) {
+      fprintf(stderr, "ERROR: Can not read %s: %s\n", job->path, strerror(errno));
+      job->done = 1;
+      return 1;
+    }
+    if (job->redact)
+      start_redaction(config, &job->pi);
+    if (config->compression != NULL)
+      start_compression(config, &job->pi);
+    // the length is only known if the content goes out as it is
+    job->post = build_post_form(config, job->title, NULL, NULL,
+                                config->compression == NULL && !job->redact ? job->len : 0, &job->pi);
+  } else {
+    job->post = build_post_form(config, job->title, job->path, job->buf, job->len, NULL);
+  }
+  init_http_response(config, &job->resp);
+
+  job->curl = engine->nidle > 0 ? engine->idle[--engine->nidle] : curl_easy_init();
+  if (job->curl == NULL) {
+    fprintf(stderr, "Error initializing curl: %s\n", strerror(errno));
+    finish_job(config, job);
+    return 1;
+  }
+
+  setup_post_handle(config, job->curl, job->post, engine->headers, &job->resp);
+  if (job->target != NULL)
+    curl_easy_setopt(job->curl, CURLOPT_URL, job->target);
+  curl_easy_setopt(job->curl, CURLOPT_PIPEWAIT, 1L);
+  curl_easy_setopt(job->curl, CURLOPT_PRIVATE, (void *)job);
+  curl_multi_add_handle(engine->multi, job->curl);
+  engine->running++;
+  job->started = g_get_monotonic_time();
+  return 0;
+}
+
+/*
+ * Launches the waiting jobs, in order, for as long as the rate limiter has
+ * tokens; when it runs out, engine->wake is when to try again.
+ */
+void engine_start_waiting(struct pastebinc_config *config, struct post_engine *engine) {
+  gint64 now = g_get_monotonic_time();
+  gint64 wait;
+
+  while (engine->waiting->len > 0 && now >= engine->wake) {
+    if ((wait = rate_take(config)) > 0) {
+      engine->wake = now + wait;
+      if (config->verbose)
+        fprintf(stderr, "DEBUG: %u pastes waiting %.3f s for the rate limit\n", engine->waiting->len, wait / (double) G_USEC_PER_SEC);
+      break;
+    }
+    engine_launch_job(config, engine, g_ptr_array_remove_index(engine->waiting, 0));
+  }
+}
+
+/*
+ * Starts uploading a job.  Its content is its file, or its buffer if it has
+ * no file.  It is sent right away if the rate limiter allows, otherwise it
+ * waits in line (engine_perform sends it later).  If the job can not even be
+ * started it is marked done (without a url) and 1 is returned.
+ */
+int engine_start_job(struct pastebinc_config *config, struct post_engine *engine, struct batch_job *job) {
+  if (job->path != NULL && access(job->path, R_OK) == -1) {
+    fprintf(stderr, "ERROR: Can not read %s: %s\n", job->path, strerror(errno));
+    job->done = 1;
+    return 1;
+  }
+
+  if (job->title == NULL && job->path != NULL)
+    job->title = batch_job_title(config, job->path);
+
+  g_ptr_array_add(engine->waiting, job);
+  engine_start_waiting(config, engine);
+  return job->done && job->url == NULL;
+}
+
+/*
+ * Takes a finished or abandoned job's handle off the multi handle and keeps
+ * it for the next job.
+ */
+void engine_release_handle(struct post_engine *engine, struct batch_job *job) {
+  curl_multi_remove_handle(engine->multi, job->curl);
+
+  curl_easy_reset(job->curl);
+  if (engine->nidle < engine->size)
+    engine->idle[engine->nidle++] = job->curl;
+  else
+    curl_easy_cleanup(job->curl);
+  job->curl = NULL;
+}
+
+/*
+ * Abandons a running job (e.g. the losers of a hedged paste).  It is marked
+ * done without a url.
+ */
+void engine_cancel_job(struct pastebinc_config *config, struct post_engine *engine, struct batch_job *job) {
+  g_ptr_array_remove(engine->waiting, job);
+  if (job->curl != NULL)
+    engine_release_handle(engine, job);
+  finish_job(config, job);
+  job->cancelled = 1;
+}
+
+/*
+ * Drives all running transfers and finishes the jobs that completed (they
+ * are marked done, with url set on success).  A job the provider throttled
+ * goes back to the front of the line instead.  Returns how many finished.
+ */
+int engine_perform(struct pastebinc_config *config, struct post_engine *engine) {
+  CURLMsg *msg;
+  int msgs_left;
+  int finished = 0;
+
+  engine_start_waiting(config, engine);
+  curl_multi_perform(engine->multi, &engine->running);
+  while ((msg = curl_multi_info_read(engine->multi, &msgs_left)) != NULL) {
+    struct batch_job *job;
+    char *url;
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&job);
+    stats_add_transfer(config, job->curl);
+    net_cache_learn(config, job->curl, msg->data.result);
+    if (rate_throttled(config, job->curl, msg->data.result, &job->resp, job->attempts++) >= 0) {
+      engine_release_handle(engine, job);
+      finish_job(config, job);
+      job->done = 0;
+      g_ptr_array_insert(engine->waiting, 0, job);
+      engine->wake = 0;
+      continue;
+    }
+    url = paste_url_from_response(config, job->curl, msg->data.result, &job->resp);
+    if (url != NULL)
+      job->url = strdup(url);
+
+    engine_release_handle(engine, job);
+    finish_job(config, job);
+    finished++;
+  }
+
+  return finished;
+}
+
+/*
+ * Waits (up to timeout_ms) for network activity, or for one of the extra fds.
+ */
+void engine_wait(struct post_engine *engine, struct curl_waitfd *extra_fds, unsigned int nfds, int timeout_ms) {
+  // don't sleep through the time the first waiting job may go
+  if (engine->waiting->len > 0)
+    timeout_ms = MIN(timeout_ms, MAX(0, (engine->wake - g_get_monotonic_time()) / 1000 + 1));
+  curl_multi_poll(engine->multi, extra_fds, nfds, timeout_ms, NULL);
+}
+
+/*
+ * Uploads a list of paste jobs through one post engine.  When print_urls is
+ * set the URLs are printed one per job, in job order.  Returns non-zero if
+ * any job failed; each job's url is set on success.
+ */
+int post_jobs(struct pastebinc_config *config, struct batch_job *jobs, int count, int print_urls) {
+  struct post_engine engine;
+  int next_job = 0;
+  int next_print = 0;
+  int failed = 0;
+
+  if (engine_init(config, &engine))
+    return 1;
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: posting %d pastes, %d at a time\n", count, config->parallel);
+
+  while (next_print < count) {
+    // start as many new jobs as we have room for
+    // (jobs that come in done, e.g. found in the dedupe cache, only get printed)
+    while (next_job < count && engine.running + (int) engine.waiting->len < config->parallel) {
+      if (!jobs[next_job].done)
+        engine_start_job(config, &engine, &jobs[next_job]);
+      next_job++;
+    }
+
+    // print, in order, every job at the head of the line that is finished
+    while (next_print < next_job && jobs[next_print].done) {
+      struct batch_job *job = &jobs[next_print++];
+      if (job->url == NULL) {
+        failed = 1;
+        fprintf(stderr, "ERROR: paste of %s failed\n", job->path ? job->path : job->title);
+      } else if (print_urls) {
+        fprintf(stderr, (config->verbose ? "Paste URL (%s): %s\n" : "%s%s\n"), (config->verbose ? job->path : ""), job->url);
+      }
+    }
+
+    if (engine.running == 0 && engine.waiting->len == 0)
+      continue;
+
+    engine_perform(config, &engine);
+    if (engine.running > 0 || engine.waiting->len > 0)
+      engine_wait(&engine, NULL, 0, 1000);
+  }
+
+  engine_cleanup(&engine);
+  return failed;
+}
+
+/*
+ * Mirror health lives in a small file in the user's cache dir, one
+ * "score url" line per endpoint, where the score is a moving average of how
+ * many milliseconds pastes to it took (failures count as HEALTH_FAILURE_MS).
+ * Returns a table of url -> gdouble* score.
+ */
+GHashTable *health_load() {
+  GHashTable *scores = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  char *path = g_build_filename(g_get_user_cache_dir(), PROGNAME, "health", NULL);
+  char *contents = NULL;
+  gchar **lines, **line;
+
+  if (g_file_get_contents(path, &contents, NULL, NULL)) {
+    lines = g_strsplit(contents, "\n", -1);
+    for (line = lines; *line != NULL; line++) {
+      char *url;
+      gdouble *score = g_new(gdouble, 1);
+
+      *score = g_ascii_strtod(*line, &url);
+      if (url == *line || *url != ' ') {
+        g_free(score);
+        continue;
+      }
+      g_hash_table_replace(scores, g_strdup(url + 1), score);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+  }
+
+  g_free(path);
+  return scores;
+}
+
+/*
+ * Folds the latency seen for each attempt of a hedged paste into the
+ * endpoints' scores and writes them back.
+ */
+void health_record(struct batch_job *attempts, int count, gint64 now) {
+  GHashTable *scores = health_load();
+  GHashTableIter iter;
+  gpointer url, score;
+  GString *out = g_string_new(NULL);
+  char *dir = g_build_filename(g_get_user_cache_dir(), PROGNAME, NULL);
+  char *path = g_build_filename(dir, "health", NULL);
+  char num[G_ASCII_DTOSTR_BUF_SIZE];
+  int i;
+
+  for (i = 0; i < count; i++) {
+    struct batch_job *job = &attempts[i];
+    gdouble ms = (now - job->started) / 1000.0;
+    gdouble *old;
+
+    if (job->started == 0)
+      continue; // never got going
+    if (job->url == NULL && !job->cancelled)
+      ms = MAX(ms, HEALTH_FAILURE_MS);
+
+    if ((old = g_hash_table_lookup(scores, job->target)) != NULL) {
+      *old = 0.7 * *old + 0.3 * ms;
+    } else {
+      gdouble *score = g_new(gdouble, 1);
+      *score = ms;
+      g_hash_table_replace(scores, g_strdup(job->target), score);
+    }
+  }
+
+  g_hash_table_iter_init(&iter, scores);
+  while (g_hash_table_iter_next(&iter, &url, &score))
+    g_string_append_printf(out, "%s %s\n", g_ascii_formatd(num, sizeof(num), "%.1f", *(gdouble *) score), (char *) url);
+
+  // failing to save only means the next run has slightly staler scores
+  if (g_mkdir_with_parents(dir, 0700) == 0)
+    g_file_set_contents(path, out->str, out->len, NULL);
+
+  g_string_free(out, TRUE);
+  g_hash_table_destroy(scores);
+  g_free(path);
+  g_free(dir);
+}
+
+/*
+ * Builds config->targets from the provider's [server] url and mirrors and
+ * orders them by their health scores, so known-slow mirrors come last.
+ * Endpoints we know nothing about keep their configured order.
+ */
+void load_targets(struct pastebinc_config *config) {
+  GHashTable *scores;
+  const char *mirrors = conf_get(config->conf, "server", "mirrors");
+  gchar **list = g_strsplit(mirrors != NULL ? mirrors : "", ";", -1);
+  gchar **mirror;
+  gdouble *score, *a, *b;
+  int i, j;
+
+  config->targets = arena_alloc(config->arena, (g_strv_length(list) + 2) * sizeof(char *));
+  config->ntargets = 0;
+  if (conf_get(config->conf, "server", "url") != NULL)
+    config->targets[config->ntargets++] = (char *) conf_get(config->conf, "server", "url");
+  for (mirror = list; *mirror != NULL; mirror++) {
+    g_strstrip(*mirror);
+    if (**mirror != 0)
+      config->targets[config->ntargets++] = arena_strdup(config->arena, *mirror);
+  }
+  g_strfreev(list);
+
+  if (config->ntargets < 2)
+    return;
+
+  // insertion sort: there are only a handful, and it is stable
+  scores = health_load();
+  for (i = 1; i < config->ntargets; i++) {
+    char *target = config->targets[i];
+    b = g_hash_table_lookup(scores, target);
+    for (j = i; j > 0; j--) {
+      a = g_hash_table_lookup(scores, config->targets[j - 1]);
+      if ((a != NULL ? *a : 0) <= (b != NULL ? *b : 0))
+        break;
+      config->targets[j] = config->targets[j - 1];
+    }
+    config->targets[j] = target;
+  }
+
+  if (config->verbose) {
+    for (i = 0; i < config->ntargets; i++) {
+      score = g_hash_table_lookup(scores, config->targets[i]);
+      fprintf(stderr, "DEBUG: mirror %d: %s (score %.1f ms)\n", i + 1, config->targets[i], score != NULL ? *score : 0.0);
+    }
+  }
+  g_hash_table_destroy(scores);
+}
+
+/*
+ * Posts spooled input to the provider's url and mirrors, healthiest first.
+ * Each time hedge_delay_ms pass without an answer (or as soon as an attempt
+ * fails) the same paste also goes to the next mirror; the first success
+ * wins and the other attempts are cancelled.  Returns the paste URL
+ * (malloc'd) or NULL.
+ */
+char *post_hedged(struct pastebinc_config *config, struct paste_info *pi) {
+  struct post_engine engine;
+  struct batch_job *attempts;
+  char *paste_url = NULL;
+  gint64 now, last_start = 0;
+  int next = 0, live = 0, timeout, i;
+
+  if ((attempts = calloc(config->ntargets, sizeof(struct batch_job))) == NULL || engine_init(config, &engine)) {
+    free(attempts);
+    return NULL;
+  }
+
+  while (paste_url == NULL && (live > 0 || next < config->ntargets)) {
+    now = g_get_monotonic_time();
+
+    if (next < config->ntargets && (live == 0
+        || (config->hedge_delay_ms > 0 && now - last_start >= (gint64) config->hedge_delay_ms * 1000))) {
+      struct batch_job *job = &attempts[next++];
+
+      job->path = pi->tmpname;
+      job->title = g_strdup(config->name);
+      job->target = config->targets[next - 1];
+      if (config->verbose)
+        fprintf(stderr, "DEBUG: %s paste to %s\n", next == 1 ? "sending" : "hedging", job->target);
+      if (engine_start_job(config, &engine, job) == 0) {
+        live++;
+      } else {
+        g_free(job->title);
+        job->title = NULL;
+      }
+      last_start = now;
+      continue;
+    }
+
+    engine_perform(config, &engine);
+    for (i = 0; i < next; i++) {
+      struct batch_job *job = &attempts[i];
+      if (!job->done || job->curl != NULL || job->title == NULL)
+        continue;
+
+      // each attempt is looked at once, when it finishes (then its title goes)
+      if (job->url != NULL && paste_url == NULL) {
+        paste_url = strdup(job->url);
+        if (config->verbose)
+          fprintf(stderr, "DEBUG: %s answered first\n", job->target);
+      }
+      g_free(job->title);
+      job->title = NULL;
+      live--;
+    }
+
+    if (paste_url == NULL && live > 0) {
+      timeout = 1000;
+      if (next < config->ntargets && config->hedge_delay_ms > 0)
+        timeout = MAX(0, (last_start + (gint64) config->hedge_delay_ms * 1000 - g_get_monotonic_time()) / 1000 + 1);
+      engine_wait(&engine, NULL, 0, timeout);
+    }
+  }
+
+  // cancel the stragglers; they were at least this slow
+  now = g_get_monotonic_time();
+  for (i = 0; i < next; i++) {
+    if (attempts[i].title == NULL)
+      continue;
+    engine_cancel_job(config, &engine, &attempts[i]);
+    g_free(attempts[i].title);
+  }
+
+  health_record(attempts, next, now);
+
+  for (i = 0; i < next; i++)
+    free(attempts[i].url);
+  free(attempts);
+  engine_cleanup(&engine);
+  return paste_url;
+}
+
+/*
+ * Finds where the next part of a split paste should end: after the last
+ * newline that still fits in max bytes, or at max bytes if a single line is
+ * longer than that.
+ */
+size_t split_part_length(const char *data, size_t len, size_t max) {
+  const char *nl;
+
+  if (len <= max)
+    return len;
+
+  nl = memrchr(data, '\n', max);
+  return nl != NULL ? (nl - data) + 1 : max;
+}
+
+/*
+ * Posts content that is larger than the provider's max_paste_bytes: it is
+ * split on line boundaries into parts that upload concurrently straight
+ * from data (a mapping of the tmp file or of a file argument), then one
+ * index paste linking the parts in order is posted.  Parts that are not
+ * redacted yet go through the redaction stage when redact is set.  Input
+ * without a title is called stdin in the part titles and the index.
+ * Returns the index paste's URL, which the caller frees, or NULL.
+ */
+char *post_split(struct pastebinc_config *config, const char *data, size_t size, const char *title, int redact) {
+  const char *name = title != NULL ? title : "stdin";
+  struct batch_job *jobs = NULL;
+  struct batch_job index;
+  GString *index_content;
+  char *url = NULL;
+  size_t pos, len;
+  int count = 0;
+  int abort;
+  int i;
+
+  for (pos = 0; pos < size; pos += len) {
+    len = split_part_length(data + pos, size - pos, config->max_paste_bytes);
+    jobs = realloc(jobs, (count + 1) * sizeof(struct batch_job));
+    memset(&jobs[count], 0, sizeof(struct batch_job));
+    jobs[count].buf = data + pos;
+    jobs[count].len = len;
+    jobs[count].redact = redact;
+    count++;
+  }
+
+  for (i = 0; i < count; i++)
+    jobs[i].title = g_strdup_printf("%s (part %d of %d)", name, i + 1, count);
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: %s is %zu bytes, splitting into %d parts of at most %zu bytes\n", name, size, count, config->max_paste_bytes);
+
+  abort = post_jobs(config, jobs, count, 0);
+
+  if (!abort) {
+    index_content = g_string_new(NULL);
+    g_string_append_printf(index_content, "%s was split into %d parts:\n\n", name, count);
+    for (i = 0; i < count; i++) {
+      g_string_append_printf(index_content, "Part %d of %d: %s\n", i + 1, count, jobs[i].url);
+      if (config->verbose)
+        fprintf(stderr, "DEBUG: part %d of %d: %s\n", i + 1, count, jobs[i].url);
+    }
+
+    memset(&index, 0, sizeof(index));
+    index.title = g_strdup(title);
+    index.buf = index_content->str;
+    index.len = index_content->len;
+
+    abort = post_jobs(config, &index, 1, 0);
+    url = index.url;
+
+    g_free(index.title);
+    g_string_free(index_content, TRUE);
+    if (abort)
+      fprintf(stderr, "ERROR: the index paste of %s failed, its %d parts are:\n", name, count);
+  } else {
+    fprintf(stderr, "ERROR: only some of the %d parts of %s could be pasted, no index was posted:\n", count, name);
+  }
+
+  // parts that did go up are public now, so say where they are
+  for (i = 0; abort && i < count; i++)
+    fprintf(stderr, "Part %d of %d: %s\n", i + 1, count, jobs[i].url != NULL ? jobs[i].url : "failed");
+
+  for (i = 0; i < count; i++) {
+    g_free(jobs[i].title);
+    free(jobs[i].url);
+  }
+  free(jobs);
+
+  return url;
+}
+
+/*
+ * Posts spooled input that is larger than the provider's max_paste_bytes
+ * (see post_split), from a mapping of the tmp file, and prints the index
+ * paste's URL.
+ */
+int pastebin_post_split(struct pastebinc_config *config, struct paste_info *pi, size_t size) {
+  char *data, *url;
+  int abort = 1;
+
+  if ((data = mmap(NULL, size, PROT_READ, MAP_SHARED, pi->fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "Error mapping tmp file (%s): %s\n", pi->tmpname, strerror(errno));
+    return 1;
+  }
+
+  if ((url = post_split(config, data, size, config->name, 0)) != NULL) {
+    fprintf(stderr, (config->verbose ? "Paste URL: %s\n" : "%s\n"), url);
+    dedupe_store(config, pi, url);
+    abort = 0;
+  }
+
+  free(url);
+  munmap(data, size);
+  return abort;
+}
+
+/*
+ * Gets a file argument ready the way spooled input would be: a file that is
+ * in the dedupe cache gets its earlier URL, and one bigger than
+ * max_paste_bytes is split and posted here, its index URL becoming the
+ * job's.  Either way the job comes out done.  Returns 1 if the file can't
+ * be read.
+ */
+int batch_job_prepare(struct pastebinc_config *config, struct batch_job *job) {
+  struct stat st;
+  char *url = NULL;
+
+  job->title = batch_job_title(config, job->path);
+  if (stat(job->path, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return 0; // posted as is, read as a stream if it can be read at all
+  if (!config->dedupe && (config->max_paste_bytes == 0 || st.st_size <= config->max_paste_bytes))
+    return 0;
+
+  if (batch_job_map(job))
+    return 1;
+  if (job->map == NULL)
+    return 0;
+
+  if (config->dedupe) {
+    xxh64_init(&job->hash);
+    xxh64_update(&job->hash, job->map, job->len);
+    if ((url = dedupe_find(config, &job->hash, job->title)) != NULL) {
+      job->url = strdup(url);
+      g_free(url);
+      job->done = 1;
+    } else {
+      job->dedupe = 1;
+    }
+  }
+
+  if (!job->done && config->max_paste_bytes > 0 && job->len > config->max_paste_bytes) {
+    job->url = post_split(config, job->map, job->len, job->title, config->redact != NULL);
+    job->done = 1;
+  }
+
+  if (job->done) {
+    munmap(job->map, job->len);
+    job->map = NULL;
+    job->buf = NULL;
+  }
+  return 0;
+}
+
+/*
+ * Pastes every file in config->batch_files, printing one URL per file.
+ * Files go through the dedupe cache and get split like spooled input does.
+ */
+int pastebin_post_batch(struct pastebinc_config *config) {
+  struct batch_job *jobs;
+  int abort;
+  int i;
+
+  if ((jobs = calloc(config->batch_count, sizeof(struct batch_job))) == NULL) {
+    fprintf(stderr, "Error allocating memory for %d batch jobs: %s\n", config->batch_count, strerror(errno));
+    return 1;
+  }
+
+  for (i = 0; i < config->batch_count; i++) {
+    jobs[i].path = config->batch_files[i];
+    jobs[i].redact = config->redact != NULL;
+    if (batch_job_prepare(config, &jobs[i]))
+      jobs[i].done = 1;
+  }
+
+  abort = post_jobs(config, jobs, config->batch_count, 1);
+
+  for (i = 0; i < config->batch_count; i++) {
+    if (jobs[i].dedupe && jobs[i].url != NULL)
+      dedupe_remember(config, &jobs[i].hash, jobs[i].title, jobs[i].url);
+    g_free(jobs[i].title);
+    free(jobs[i].url);
+  }
+  free(jobs);
+
+  return abort;
+}
+
+/*
+ * Follow mode: keeps reading stdin (e.g. from tail -F) and posts it as a
+ * series of pastes, one per window.  A window closes when it reaches
+ * config->window_bytes (on a line boundary if possible), config->window_lines
+ * lines, or when config->window_ms have passed since its first byte.  Each
+ * window uploads in the background while the next one fills, and URLs are
+ * printed as they come back.  At most config->parallel windows are in flight;
+ * when they are all busy we stop reading, so memory stays bounded.
+ */
+int pastebin_follow(struct pastebinc_config *config) {
+  struct post_engine engine;
+  struct batch_job **jobs;
+  struct curl_waitfd wfd;
+  char *window;
+  size_t len = 0, scanned = 0, lines = 0, line_cut = 0, cut;
+  gint64 now, opened = 0;
+  ssize_t readval;
+  int inflight = 0, nwindow = 0, failed = 0, eof = 0;
+  int want_input, timeout, i;
+
+  window = malloc(config->window_bytes);
+  jobs = calloc(config->parallel, sizeof(struct batch_job *));
+  if (window == NULL || jobs == NULL) {
+    fprintf(stderr, "Error allocating %zu memory for the follow window: %s\n", config->window_bytes, strerror(errno));
+    free(window);
+    free(jobs);
+    return 1;
+  }
+
+  if (engine_init(config, &engine)) {
+    free(window);
+    free(jobs);
+    return 1;
+  }
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: following stdin, windows of at most %zu bytes, %zu lines, %d ms\n",
+      config->window_bytes, config->window_lines, config->window_ms);
+
+  while (!eof || len > 0 || inflight > 0) {
+    now = g_get_monotonic_time();
+
+    // find the first newline that completes the line limit, if there is one
+    if (config->window_lines > 0) {
+      while (line_cut == 0 && scanned < len) {
+        char *nl = memchr(window + scanned, '\n', len - scanned);
+        if (nl == NULL) {
+          scanned = len;
+          break;
+        }
+        scanned = nl - window + 1;
+        if (++lines >= config->window_lines)
+          line_cut = scanned;
+      }
+    }
+
+    cut = 0;
+    if (line_cut > 0)
+      cut = line_cut;
+    else if (len >= config->window_bytes)
+      cut = split_part_length(window, len, config->window_bytes);
+    else if (len > 0 && (eof || (config->window_ms > 0 && now - opened >= (gint64) config->window_ms * 1000)))
+      cut = len;
+
+    if (cut > 0 && inflight < config->parallel) {
+      struct batch_job *job = calloc(1, sizeof(struct batch_job));
+      char *buf = malloc(cut);
+
+      if (job == NULL || buf == NULL) {
+        // the window is dropped, like one whose paste failed
+        fprintf(stderr, "Error allocating %zu memory for window %d: %s\n", cut, ++nwindow, strerror(errno));
+        failed = 1;
+        free(job);
+        free(buf);
+      } else {
+        memcpy(buf, window, cut);
+        if (config->redact != NULL)
+          config->stats.redactions += redact_buffer(config->redact, buf, cut);
+        job->buf = buf;
+        config->stats.bytes_in += cut;
+        job->len = cut;
+        job->title = g_strdup_printf("%s (window %d)", config->name, ++nwindow);
+
+        for (i = 0; jobs[i] != NULL; i++)
+          ;
+        jobs[i] = job;
+        inflight++;
+        engine_start_job(config, &engine, job);
+      }
+
+      // whatever is left over starts the next window
+      memmove(window, window + cut, len - cut);
+      len -= cut;
+      scanned = 0;
+      lines = 0;
+      line_cut = 0;
+      opened = now;
+      continue;
+    }
+
+    // read more only while the window has room and isn't waiting to close
+    want_input = !eof && cut == 0;
+    timeout = 1000;
+    if (want_input && len > 0 && config->window_ms > 0) {
+      timeout = (opened + (gint64) config->window_ms * 1000 - now) / 1000 + 1;
+      if (timeout < 0)
+        timeout = 0;
+    }
+
+    wfd.fd = STDIN_FILENO;
+    wfd.events = CURL_WAIT_POLLIN;
+    wfd.revents = 0;
+    engine_wait(&engine, want_input ? &wfd : NULL, want_input ? 1 : 0, timeout);
+
+    if (want_input && wfd.revents != 0) {
+      readval = read(STDIN_FILENO, window + len, config->window_bytes - len);
+      if (readval == -1 && errno != EINTR && errno != EAGAIN) {
+        fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+        eof = 1;
+      } else if (readval == 0) {
+        eof = 1;
+      } else if (readval > 0) {
+        if (config->tee) {
+          fwrite(window + len, 1, readval, stdout);
+          fflush(stdout);
+        }
+        if (len == 0)
+          opened = g_get_monotonic_time();
+        len += readval;
+      }
+    }
+
+    engine_perform(config, &engine);
+
+    // report and release the windows that are done
+    for (i = 0; i < config->parallel; i++) {
+      struct batch_job *job = jobs[i];
+      if (job == NULL || !job->done)
+        continue;
+
+      if (job->url == NULL) {
+        failed = 1;
+        fprintf(stderr, "ERROR: paste of %s failed\n", job->title);
+      } else {
+        fprintf(stderr, (config->verbose ? "Paste URL (%s): %s\n" : "%s%s\n"), (config->verbose ? job->title : ""), job->url);
+      }
+
+      free((void *) job->buf);
+      g_free(job->title);
+      free(job->url);
+      free(job);
+      jobs[i] = NULL;
+      inflight--;
+    }
+  }
+
+  engine_cleanup(&engine);
+  free(window);
+  free(jobs);
+  return failed;
+}
+
+/*
+ * SIGUSR1 asks the flight recorder for a snapshot.  The handler only notes
+ * that, and wakes the main loop through a pipe.
+ */
+volatile sig_atomic_t record_signalled;
+int record_wake_fd = -1;
+
+void record_signal(int sig) {
+  int saved = errno;
+
+  record_signalled = 1;
+  if (write(record_wake_fd, "", 1) == -1) {
+    // the pipe is full: the loop is awake already
+  }
+  errno = saved;
+}
+
+/*
+ * Reads the next piece of stdin for the flight recorder, echoing it to
+ * stdout when teeing.  When both are pipes the echo is a tee(2), so the
+ * pass-through is never slowed down by copying; only what the ring needs
+ * is read.  Returns 0 at EOF and -1 on error.
+ */
+ssize_t record_read(struct pastebinc_config *config, int zero_copy, char *buf, size_t len) {
+  ssize_t n, got, total = 0;
+
+  if (zero_copy) {
+    do {
+      n = tee(STDIN_FILENO, STDOUT_FILENO, len, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0)
+      return n;
+
+    // exactly what went to stdout, or it would be echoed twice
+    while (total < n) {
+      if ((got = read(STDIN_FILENO, buf + total, n - total)) == -1 && errno == EINTR)
+        continue;
+      if (got <= 0)
+        return -1;
+      total += got;
+    }
+    return total;
+  }
+
+  do {
+    n = read(STDIN_FILENO, buf, len);
+  } while (n == -1 && errno == EINTR);
+
+  if (n > 0 && config->tee && write_all(STDOUT_FILENO, buf, n))
+    return -1;
+  return n;
+}
+
+/*
+ * Whether one of the -T patterns matches somewhere in buf.  As when
+ * redacting, the literals the patterns start with are searched for first,
+ * so the regex only runs where a match can start.
+ */
+int record_triggered(const struct redactor *trigger, const char *buf, size_t len) {
+  size_t pos = 0;
+  int i;
+
+  for (i = 0; i < trigger->nrules; i++) {
+    if (trigger->rules[i].regex != NULL && g_regex_match_full(trigger->rules[i].regex, buf, len, 0, 0, NULL, NULL))
+      return 1;
+  }
+  if (trigger->regex == NULL)
+    return 0;
+
+  if (!trigger->prefilter)
+    return g_regex_match_full(trigger->regex, buf, len, 0, 0, NULL, NULL);
+
+  while ((pos = redact_next_candidate(trigger, (const unsigned char *) buf, pos, len)) < len) {
+    if (redact_literal_at(trigger, buf + pos, len - pos)
+        && g_regex_match_full(trigger->regex, buf, len, pos, G_REGEX_MATCH_ANCHORED, NULL, NULL))
+      return 1;
+    pos++;
+  }
+  return 0;
+}
+
+/*
+ * Copies what the ring holds into a new buffer, oldest first.  Once the ring
+ * has lost the start of its first line, the rest of that line is left out.
+ */
+char *record_snapshot(const struct keep_ring *ring, int overflowed, size_t *len) {
+  size_t skip = 0, start, first, i;
+  char *snap;
+
+  for (i = 0; overflowed && i < MIN(ring->used, RECORD_LINE_MAX); i++) {
+    if (keep_ring_at(ring, i) == '\n') {
+      skip = i + 1 < ring->used ? i + 1 : 0;
+      break;
+    }
+  }
+
+  *len = ring->used - skip;
+  if ((snap = malloc(*len)) == NULL)
+    return NULL;
+
+  start = ((ring->used < ring->size ? 0 : ring->pos) + skip) % ring->size;
+  first = MIN(*len, ring->size - start);
+  memcpy(snap, ring->buf + start, first);
+  memcpy(snap + first, ring->buf, *len - first);
+  return snap;
+}
+
+/*
+ * Flight recorder mode (-R): keeps reading stdin (passing it through with
+ * -t) but only keeps its last config->record bytes, in a ring buffer.  On
+ * SIGUSR1, or when a line matches one of the -T patterns, what the ring
+ * holds is pasted in the background while recording goes on.  One snapshot
+ * uploads at a time; asking for more while it does takes one more snapshot
+ * once it is done, so memory stays at most twice the ring.
+ */
+int pastebin_record(struct pastebinc_config *config) {
+  struct post_engine engine;
+  struct batch_job *job = NULL;
+  struct keep_ring ring;
+  struct curl_waitfd wfd[2];
+  struct sigaction sa;
+  struct stat st;
+  char drain[64];
+  char *buf, *nl;
+  size_t carry = 0, len, scan;
+  ssize_t readval;
+  int wake[2];
+  int pending = 0, overflowed = 0, nsnapshot = 0, failed = 0, eof = 0;
+  int zero_copy = 0;
+
+  memset(&ring, 0, sizeof(ring));
+  ring.size = config->record;
+  ring.buf = malloc(ring.size);
+  buf = malloc(RECORD_LINE_MAX + TEE_CHUNK);
+  if (ring.buf == NULL || buf == NULL) {
+    fprintf(stderr, "Error allocating %zu memory for the flight recorder: %s\n", config->record, strerror(errno));
+    free(ring.buf);
+    free(buf);
+    return 1;
+  }
+
+  if ((config->trigger != NULL && redactor_compile(config->trigger, "-T", config->verbose))
+      || engine_init(config, &engine)) {
+    free(ring.buf);
+    free(buf);
+    return 1;
+  }
+
+  if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+    fprintf(stderr, "Error creating the flight recorder's wakeup pipe: %s\n", strerror(errno));
+    engine_cleanup(&engine);
+    free(ring.buf);
+    free(buf);
+    return 1;
+  }
+  record_wake_fd = wake[1];
+  record_signalled = 0;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = record_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  if (config->tee) {
+    zero_copy = fstat(STDIN_FILENO, &st) == 0 && S_ISFIFO(st.st_mode)
+             && fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+    fflush(stdout);
+  }
+  if (zero_copy) {
+    fcntl(STDIN_FILENO, F_SETPIPE_SZ, TEE_CHUNK);
+    fcntl(STDOUT_FILENO, F_SETPIPE_SZ, TEE_CHUNK);
+  }
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: recording the last %zu bytes of stdin (pid %d), pasting them on SIGUSR1%s\n",
+      ring.size, (int) getpid(), config->trigger != NULL ? " or when a -T pattern matches" : "");
+
+  for (;;) {
+    if (record_signalled) {
+      record_signalled = 0;
+      while (read(wake[0], drain, sizeof(drain)) > 0)
+        ;
+      pending = 1;
+      if (config->verbose)
+        fprintf(stderr, "DEBUG: got SIGUSR1, taking a snapshot\n");
+    }
+
+    if (pending && ring.used == 0)
+      pending = 0; // nothing recorded yet
+
+    if (pending && job == NULL) {
+      if ((job = calloc(1, sizeof(struct batch_job))) == NULL) {
+        fprintf(stderr, "Error allocating memory for a snapshot: %s\n", strerror(errno));
+        failed = 1;
+      } else if ((job->buf = record_snapshot(&ring, overflowed, &job->len)) == NULL) {
+        fprintf(stderr, "Error allocating %zu memory for a snapshot: %s\n", ring.used, strerror(errno));
+        failed = 1;
+        free(job);
+        job = NULL;
+      } else {
+        if (config->redact != NULL)
+          config->stats.redactions += redact_buffer(config->redact, (char *) job->buf, job->len);
+        job->title = g_strdup_printf("%s (snapshot %d)", config->name, ++nsnapshot);
+        if (config->verbose)
+          fprintf(stderr, "DEBUG: %s is the last %zu bytes\n", job->title, job->len);
+        engine_start_job(config, &engine, job);
+      }
+      pending = 0;
+    }
+
+    if (eof && job == NULL)
+      break;
+
+    wfd[0].fd = wake[0];
+    wfd[0].events = CURL_WAIT_POLLIN;
+    wfd[0].revents = 0;
+    wfd[1].fd = STDIN_FILENO;
+    wfd[1].events = CURL_WAIT_POLLIN;
+    wfd[1].revents = 0;
+    engine_wait(&engine, wfd, eof ? 1 : 2, 1000);
+
+    if (!eof && wfd[1].revents != 0) {
+      readval = record_read(config, zero_copy, buf + carry, TEE_CHUNK);
+      if (readval == -1) {
+        fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+        failed = 1;
+        eof = 1;
+      } else if (readval == 0) {
+        eof = 1;
+        // a last line without a newline
+        if (config->trigger != NULL && carry > 0 && !pending && record_triggered(config->trigger, buf, carry))
+          pending = 1;
+      } else {
+        overflowed |= keep_ring_write(&ring, buf + carry, readval) > 0;
+        config->stats.bytes_in += readval;
+
+        // only whole lines are searched; the unfinished one waits for the
+        // rest of it, unless it is endless
+        if (config->trigger != NULL) {
+          len = carry + readval;
+          nl = memrchr(buf + carry, '\n', readval);
+          scan = nl != NULL ? (size_t) (nl - buf) + 1 : 0;
+          if (len - scan > RECORD_LINE_MAX)
+            scan = len;
+          if (!pending && scan > 0 && record_triggered(config->trigger, buf, scan)) {
+            pending = 1;
+            if (config->verbose)
+              fprintf(stderr, "DEBUG: a -T pattern matched, taking a snapshot\n");
+          }
+          memmove(buf, buf + scan, len - scan);
+          carry = len - scan;
+        }
+      }
+    }
+
+    engine_perform(config, &engine);
+
+    if (job != NULL && job->done) {
+      if (job->url == NULL) {
+        failed = 1;
+        fprintf(stderr, "ERROR: paste of %s failed\n", job->title);
+      } else {
+        fprintf(stderr, (config->verbose ? "Paste URL (%s): %s\n" : "%s%s\n"), (config->verbose ? job->title : ""), job->url);
+      }
+
+      free((void *) job->buf);
+      g_free(job->title);
+      free(job->url);
+      free(job);
+      job = NULL;
+    }
+  }
+
+  signal(SIGUSR1, SIG_DFL);
+  record_wake_fd = -1;
+  close(wake[0]);
+  close(wake[1]);
+  engine_cleanup(&engine);
+  free(ring.buf);
+  free(buf);
+  return failed;
+}
+
+/*
+ * Opens the sealed chunk at the start of ds->sealed (len bytes with its tag)
+ * and writes it out.  Returns -1 if it doesn't check out.
+ */
+int decrypt_chunk(struct decrypt_stream *ds, size_t len, int last) {
+  unsigned char nonce[12];
+  int n;
+
+  encrypt_nonce(nonce, ds->prefix, ds->counter++, last);
+  if (len < ENCRYPT_TAG
+      || !EVP_DecryptInit_ex(ds->ctx, NULL, NULL, NULL, nonce)
+      || !EVP_DecryptUpdate(ds->ctx, ds->plain, &n, ds->sealed, len - ENCRYPT_TAG)
+      || !EVP_CIPHER_CTX_ctrl(ds->ctx, EVP_CTRL_GCM_SET_TAG, ENCRYPT_TAG, ds->sealed + len - ENCRYPT_TAG)
+      || EVP_DecryptFinal_ex(ds->ctx, ds->plain + n, &n) <= 0) {
+    fprintf(stderr, "ERROR: the paste could not be decrypted (wrong key, or it was cut short or changed)\n");
+    ds->failed = 1;
+    return -1;
+  }
+
+  if (fwrite(ds->plain, 1, len - ENCRYPT_TAG, stdout) != len - ENCRYPT_TAG) {
+    fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+    ds->failed = 1;
+    return -1;
+  }
+  ds->bytes_out += len - ENCRYPT_TAG;
+  return 0;
+}
+
+/*
+ * Takes decoded bytes: the nonce prefix, then sealed chunks.  A chunk is only
+ * opened once a byte after it has arrived, as only the last one may be
+ * shorter than a full chunk (or be the last).
+ */
+int decrypt_bytes(struct decrypt_stream *ds, const unsigned char *data, size_t len) {
+  size_t n;
+
+  while (len > 0) {
+    if (ds->prefix_len < ENCRYPT_PREFIX) {
+      n = MIN(len, ENCRYPT_PREFIX - ds->prefix_len);
+      memcpy(ds->prefix + ds->prefix_len, data, n);
+      ds->prefix_len += n;
+    } else {
+      n = MIN(len, ENCRYPT_CHUNK + ENCRYPT_TAG + 1 - ds->sealed_len);
+      memcpy(ds->sealed + ds->sealed_len, data, n);
+      ds->sealed_len += n;
+      if (ds->sealed_len == ENCRYPT_CHUNK + ENCRYPT_TAG + 1) {
+        if (decrypt_chunk(ds, ENCRYPT_CHUNK + ENCRYPT_TAG, 0) == -1)
+          return -1;
+        ds->sealed[0] = ds->sealed[ENCRYPT_CHUNK + ENCRYPT_TAG];
+        ds->sealed_len = 1;
+      }
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Curl write callback for -g: finds the header line, then decodes and opens
+ * the base64 that follows it as it arrives.
+ */
+size_t decrypt_received(void *buffer, size_t size, size_t nmemb, void *userp) {
+  struct decrypt_stream *ds = (struct decrypt_stream *) userp;
+  const char *p = buffer;
+  const char *end = p + size * nmemb;
+  const char *run;
+  unsigned char decoded[3 * 1024 + 3];
+  size_t n;
+
+  while (p < end && ds->state != DECRYPT_END) {
+    if (ds->state == DECRYPT_SEARCH) {
+      // the header has no repeated start, so a mismatch can simply start over
+      if (*p == ENCRYPT_HEADER[ds->matched])
+        ds->matched++;
+      else
+        ds->matched = *p == ENCRYPT_HEADER[0] ? 1 : 0;
+      if (ds->matched == strlen(ENCRYPT_HEADER))
+        ds->state = DECRYPT_LINE;
+      p++;
+    } else if (ds->state == DECRYPT_LINE) {
+      if (*p++ == '\n')
+        ds->state = DECRYPT_BODY;
+    } else {
+      // base64 and line breaks, at most what fits in decoded at a time
+      for (run = p; p < end && p - run < 4 * 1024; p++) {
+        if (!g_ascii_isalnum(*p) && *p != '+' && *p != '/' && *p != '=' && *p != '\r' && *p != '\n') {
+          ds->state = DECRYPT_END;
+          break;
+        }
+      }
+      n = g_base64_decode_step(run, p - run, decoded, &ds->b64_state, &ds->b64_save);
+      if (decrypt_bytes(ds, decoded, n) == -1)
+        return 0;
+    }
+  }
+
+  return size * nmemb;
+}
+
+/*
+ * Fetches an encrypted paste (-g url#key) and prints it decrypted to stdout.
+ * Every chunk is checked before it is printed; a paste that was cut short
+ * fails at its end.
+ */
+int pastebin_fetch(struct pastebinc_config *config) {
+  struct decrypt_stream ds;
+  const char *fragment = strrchr(config->fetch, '#');
+  char *url, *text;
+  guchar *key = NULL;
+  gsize key_len = 0;
+  long http_resp_code = 0;
+  CURL *curl;
+  CURLcode res;
+  int abort = 1;
+  size_t i;
+
+  // the key is base64url, without padding
+  if (fragment != NULL) {
+    text = g_strnfill((strlen(fragment + 1) + 3) / 4 * 4, '=');
+    memcpy(text, fragment + 1, strlen(fragment + 1));
+    for (i = 0; text[i]; i++) {
+      if (text[i] == '-')
+        text[i] = '+';
+      else if (text[i] == '_')
+        text[i] = '/';
+    }
+    key = g_base64_decode(text, &key_len);
+    g_free(text);
+  }
+  if (key_len != ENCRYPT_KEY) {
+    fprintf(stderr, "ERROR: %s has no decryption key (the #fragment pastebinc -E printed)\n", config->fetch);
+    g_free(key);
+    return 1;
+  }
+
+  memset(&ds, 0, sizeof(ds));
+  memcpy(ds.key, key, ENCRYPT_KEY);
+  OPENSSL_cleanse(key, key_len);
+  g_free(key);
+  ds.ctx = EVP_CIPHER_CTX_new();
+  EVP_DecryptInit_ex(ds.ctx, EVP_aes_256_gcm(), NULL, ds.key, NULL);
+  ds.sealed = malloc(ENCRYPT_CHUNK + ENCRYPT_TAG + 1);
+  ds.plain = malloc(ENCRYPT_CHUNK + ENCRYPT_TAG);
+  url = strndup(config->fetch, fragment - config->fetch);
+
+  if ((curl = curl_easy_init()) != NULL) {
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: fetching %s\n", url);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &decrypt_received);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&ds);
+    if (config->bypass_proxy)
+      curl_easy_setopt(curl, CURLOPT_NOPROXY, "*");
+
+    res = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_resp_code);
+    if (ds.failed) {
+      // already reported
+    } else if (res != CURLE_OK || http_resp_code != 200) {
+      if (res != CURLE_OK)
+        fprintf(stderr, "ERROR: %s\n", curl_easy_strerror(res));
+      fprintf(stderr, "ERROR: server response was %ld\n", http_resp_code);
+    } else if (ds.state == DECRYPT_SEARCH || ds.state == DECRYPT_LINE || ds.prefix_len < ENCRYPT_PREFIX) {
+      fprintf(stderr, "ERROR: there is no paste made with -E at %s\n", url);
+    } else if (decrypt_chunk(&ds, ds.sealed_len, 1) == 0) {
+      abort = 0;
+      if (config->verbose)
+        fprintf(stderr, "DEBUG: decrypted %zu bytes\n", ds.bytes_out);
+    }
+    curl_easy_cleanup(curl);
+  } else {
+    fprintf(stderr, "Error initializing curl: %s\n", strerror(errno));
+  }
+
+  fflush(stdout);
+  EVP_CIPHER_CTX_free(ds.ctx);
+  OPENSSL_cleanse(ds.key, ENCRYPT_KEY);
+  free(ds.sealed);
+  free(ds.plain);
+  free(url);
+  return abort;
+}
+
+/*
+ * Parses a size like "512", "64k", "10m" or "1g" (powers of 1024).
+ */
+int parse_size(const char *str, size_t *size) {
+  char *end;
+  unsigned long long value = strtoull(str, &end, 10);
+
+  if (end == str)
+    return 1;
+
+  switch (*end) {
+    case 'g': case 'G': value *= 1024;
+    case 'm': case 'M': value *= 1024;
+    case 'k': case 'K': value *= 1024;
+      end++;
+      break;
+    case 'b': case 'B':
+      end++;
+      break;
+  }
+
+  if (*end != 0)
+    return 1;
+
+  *size = value;
+  return 0;
+}
+
+/*
+ * Makes a client out of a config that read_config_files has loaded.  The
+ * client takes over everything the config owns, and *config is cleared.
+ */
+struct pastebinc_client *client_new(struct pastebinc_config *config) {
+  struct pastebinc_client *client = calloc(1, sizeof(struct pastebinc_client));
+
+  client->config = *config;
+  memset(config, 0, sizeof(struct pastebinc_config));
+
+  g_mutex_init(&client->lock);
+  client->size = CLIENT_IDLE_HANDLES;
+  client->idle = calloc(client->size, sizeof(CURL *));
+
+  // every paste through the client shares one connection pool, DNS cache
+  // and TLS session cache
+  client->share = share_new(client->share_locks);
+
+  return client;
+}
+
+/*
+ * Takes an easy handle from the client's idle list, or makes a new one.
+ */
+CURL *client_get_handle(struct pastebinc_client *client) {
+  CURL *curl = NULL;
+
+  g_mutex_lock(&client->lock);
+  if (client->nidle > 0)
+    curl = client->idle[--client->nidle];
+  g_mutex_unlock(&client->lock);
+
+  return curl != NULL ? curl : curl_easy_init();
+}
+
+void client_release_handle(struct pastebinc_client *client, CURL *curl) {
+  curl_easy_reset(curl);
+
+  g_mutex_lock(&client->lock);
+  if (client->nidle < client->size) {
+    client->idle[client->nidle++] = curl;
+    curl = NULL;
+  }
+  g_mutex_unlock(&client->lock);
+
+  if (curl != NULL)
+    curl_easy_cleanup(curl);
+}
+
+/*
+ * Posts one paste through a client.  The content is what pi holds: its
+ * prefix, then (unless its fd is -1) everything read from its fd, which is
+ * streamed.  The per-paste options are applied to a copy of the client's
+ * config, so any number of threads can post at once.  Returns the paste URL
+ * (malloc'd) or NULL.
+ */
+char *client_post(struct pastebinc_client *client, const struct pastebinc_options *options, struct paste_info *pi) {
+  struct pastebinc_config job = client->config;
+  struct arena arena = { NULL };
+  struct http_response resp;
+  struct curl_httppost *post;
+  struct curl_slist *headers;
+  const char *const *field;
+  t_user_field *uf;
+  CURL *curl;
+  CURLcode res;
+  char *content = pi->prefix;
+  size_t content_len = pi->prefix_len;
+  char *paste_url = NULL;
+  int abort = 0;
+  int attempts = 0;
+  int resendable;
+
+  // the client's own fields, then this paste's, all in an arena of its own
+  job.arena = &arena;
+  job.user_fields = NULL;
+  for (uf = client->config.user_fields; uf != NULL; uf = uf->next)
+    add_user_field(&job, uf->name, uf->value);
+
+  if (options != NULL) {
+    if (options->title != NULL)
+      job.name = (char *) options->title;
+    for (field = options->fields; !abort && field != NULL && *field != NULL; field++)
+      abort = add_user_field_spec(&job, *field);
+    if (!abort)
+      abort = add_config_user_field(&job, "expiration", options->expiration)
+           || add_config_user_field(&job, "format", options->format);
+  }
+
+  if (abort) {
+    arena_free(&arena);
+    return NULL;
+  }
+
+  // everything goes through the read callback, as curl would copy a buffer
+  // (a mapped file, an outbox payload) given to it as the part's contents;
+  // only a buffer that is posted as it is has a known length
+  start_redaction(&job, pi);
+  if (job.compression != NULL) {
+    start_compression(&job, pi);
+    post = build_post_form(&job, job.name, NULL, NULL, 0, pi);
+  } else if (pi->fd == -1 && pi->redact == NULL) {
+    post = build_post_form(&job, job.name, NULL, NULL, content_len, pi);
+  } else {
+    post = build_post_form(&job, job.name, NULL, NULL, 0, pi);
+  }
+  headers = curl_slist_append(NULL, "Expect:");
+  init_http_response(&job, &resp);
+  resendable = job.compression == NULL && pi->fd == -1 && pi->redact == NULL;
+
+  if ((curl = client_get_handle(client)) != NULL) {
+    setup_post_handle(&job, curl, post, headers, &resp);
+    curl_easy_setopt(curl, CURLOPT_SHARE, client->share);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+    // the rate limiter is the client's, so all its threads share it
+    rate_wait(&job);
+    res = curl_easy_perform(curl);
+    while (rate_throttled(&job, curl, res, &resp, resendable ? attempts++ : job.rate_retries) >= 0) {
+      free_http_response(&resp);
+      init_http_response(&job, &resp);
+      // the buffer is read from its start again
+      pi->prefix = content;
+      pi->prefix_len = content_len;
+      pi->bytes_read = 0;
+      rate_wait(&job);
+      res = curl_easy_perform(curl);
+    }
+    finish_compression(&job, pi);
+    if ((paste_url = paste_url_from_response(&job, curl, res, &resp)) != NULL)
+      paste_url = strdup(paste_url);
+
+    client_release_handle(client, curl);
+  } else {
+    fprintf(stderr, "Error initializing curl: %s\n", strerror(errno));
+  }
+
+  finish_compression(&job, pi);
+  finish_redaction(&job, pi);
+  curl_formfree(post);
+  curl_slist_free_all(headers);
+  free_http_response(&resp);
+  arena_free(&arena);
+  return paste_url;
+}
+
+int pastebinc_global_init(void) {
+  return curl_global_init(CURL_GLOBAL_ALL) == CURLE_OK ? 0 : 1;
+}
+
+void pastebinc_global_cleanup(void) {
+  curl_global_cleanup();
+}
+
+pastebinc_client *pastebinc_client_new(const char *provider, int verbose) {
+  struct pastebinc_config config;
+
+  config_init(&config);
+  config.verbose = verbose;
+  if (provider != NULL)
+    config.provider = arena_strdup(config.arena, provider);
+
+  if (read_config_files(&config)) {
+    config_free(&config);
+    return NULL;
+  }
+  config.name = (char *) conf_get(config.conf, "defaults", "title");
+
+  return client_new(&config);
+}
+
+void pastebinc_client_free(pastebinc_client *client) {
+  int i;
+
+  if (client == NULL)
+    return;
+
+  for (i = 0; i < client->nidle; i++)
+    curl_easy_cleanup(client->idle[i]);
+  free(client->idle);
+  g_mutex_clear(&client->lock);
+
+  curl_share_cleanup(client->share);
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    g_mutex_clear(&client->share_locks[i]);
+
+  config_free(&client->config);
+  free(client);
+}
+
+char *pastebinc_post_buffer(pastebinc_client *client, const struct pastebinc_options *options,
+                            const void *buf, size_t len) {
+  struct paste_info pi;
+
+  memset(&pi, 0, sizeof(pi));
+  pi.fd = -1;
+  pi.prefix = (char *) (buf != NULL ? buf : "");
+  pi.prefix_len = buf != NULL ? len : 0;
+  return client_post(client, options, &pi);
+}
+
+/*
+ * A regular file read from its start is mapped and posted like a buffer (so
+ * with a Content-Length); anything else is streamed as it is read.
+ */
+char *pastebinc_post_fd(pastebinc_client *client, const struct pastebinc_options *options, int fd) {
+  struct paste_info pi;
+  struct stat st;
+  char *map;
+  char *paste_url;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0
+      && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    paste_url = pastebinc_post_buffer(client, options, map, st.st_size);
+    munmap(map, st.st_size);
+    return paste_url;
+  }
+
+  memset(&pi, 0, sizeof(pi));
+  pi.fd = fd;
+  return client_post(client, options, &pi);
+}
+
+/*
+ * Path of the unix domain socket the daemon listens on and the client (-c)
+ * connects to: in the user's own runtime dir ($XDG_RUNTIME_DIR), so no other
+ * user can get at it or take its place.  Can be overridden with the
+ * PASTEBINCD_SOCKET env variable.  The caller g_free's it.
+ */
+char *daemon_socket_path() {
+  const char *path = getenv("PASTEBINCD_SOCKET");
+  return path != NULL && *path ? g_strdup(path) : g_build_filename(g_get_user_runtime_dir(), DAEMON_SOCKET, NULL);
+}
+
+/*
+ * Whether the other end of a unix socket is running as us.
+ */
+int daemon_peer_is_us(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+/*
+ * Returns the client for a provider, reading its config file the first time
+ * the provider is asked for.  Clients are shared by all jobs.
+ */
+struct pastebinc_client *daemon_get_provider(struct daemon_state *state, const char *provider) {
+  struct pastebinc_client *client;
+
+  if (provider == NULL || *provider == 0)
+    provider = state->default_provider;
+
+  g_mutex_lock(&state->lock);
+  client = g_hash_table_lookup(state->providers, provider);
+  if (client == NULL && (client = pastebinc_client_new(provider, state->verbose)) != NULL) {
+    g_hash_table_insert(state->providers, client->config.provider, client);
+    if (state->verbose)
+      fprintf(stderr, "DEBUG: loaded provider %s\n", client->config.provider);
+  }
+  g_mutex_unlock(&state->lock);
+
+  return client;
+}
+
+/*
+ * Reads the job header sent by a client: "key=value" lines ended by an empty
+ * line.  Anything read past the header is the start of the paste content and
+ * is left in buf after the header.  Returns the header length, or -1.
+ */
+ssize_t daemon_read_header(int fd, char *buf, size_t cap, size_t *total) {
+  char *end;
+  ssize_t readval;
+
+  *total = 0;
+  while (*total < cap - 1) {
+    readval = read(fd, buf + *total, cap - 1 - *total);
+    if (readval == -1 && errno == EINTR)
+      continue;
+    if (readval <= 0)
+      return -1;
+
+    *total += readval;
+    buf[*total] = 0;
+    if (buf[0] == '\n') // no header lines at all
+      return 1;
+    if ((end = strstr(buf, "\n\n")) != NULL)
+      return end - buf + 2;
+  }
+
+  return -1;
+}
+
+void daemon_reply(int fd, const char *status, const char *message) {
+  char line[DAEMON_HEADER_MAX];
+  int len = snprintf(line, sizeof(line), "%s %s\n", status, message);
+  if (write(fd, line, len) == -1 && errno != EPIPE)
+    fprintf(stderr, "Error replying to client: %s\n", strerror(errno));
+}
+
+/*
+ * Runs one paste job for a connected client, on a worker thread.  The paste
+ * content is streamed from the socket straight into the upload.
+ */
+void daemon_handle_client(gpointer data, gpointer user_data) {
+  struct daemon_state *state = (struct daemon_state *) user_data;
+  int fd = GPOINTER_TO_INT(data);
+  char header[DAEMON_HEADER_MAX];
+  size_t total;
+  ssize_t header_len;
+  char *line, *next;
+  char *provider = NULL;
+  GPtrArray *fields = g_ptr_array_new();
+  struct pastebinc_options options;
+  struct pastebinc_client *client;
+  struct paste_info pi;
+  char *paste_url;
+
+  if ((header_len = daemon_read_header(fd, header, sizeof(header), &total)) == -1) {
+    daemon_reply(fd, "ERR", "bad job header");
+    g_ptr_array_free(fields, TRUE);
+    close(fd);
+    return;
+  }
+  header[header_len - 1] = 0;
+
+  memset(&options, 0, sizeof(options));
+  for (line = header; line != NULL && *line; line = next) {
+    char *value;
+    if ((next = strchr(line, '\n')) != NULL)
+      *next++ = 0;
+    if ((value = strchr(line, '=')) == NULL)
+      continue;
+    *value++ = 0;
+
+    if (strcmp(line, "provider") == 0)
+      provider = value;
+    else if (strcmp(line, "name") == 0)
+      options.title = value;
+    else if (strcmp(line, "expiration") == 0)
+      options.expiration = value;
+    else if (strcmp(line, "format") == 0)
+      options.format = value;
+    else if (strcmp(line, "field") == 0)
+      g_ptr_array_add(fields, value);
+  }
+  g_ptr_array_add(fields, NULL);
+  options.fields = (const char *const *) fields->pdata;
+
+  if ((client = daemon_get_provider(state, provider)) == NULL) {
+    daemon_reply(fd, "ERR", "unknown provider");
+    g_ptr_array_free(fields, TRUE);
+    close(fd);
+    return;
+  }
+
+  memset(&pi, 0, sizeof(pi));
+  pi.fd = fd;
+  pi.prefix = header + header_len;
+  pi.prefix_len = total - header_len;
+
+  paste_url = client_post(client, &options, &pi);
+  if (paste_url != NULL)
+    daemon_reply(fd, "OK", paste_url);
+  else
+    daemon_reply(fd, "ERR", "paste failed");
+
+  if (state->verbose)
+    fprintf(stderr, "DEBUG: job for %s (%zu bytes): %s\n", client->config.provider, pi.bytes_read, paste_url ? paste_url : "failed");
+
+  free(paste_url);
+  g_ptr_array_free(fields, TRUE);
+  close(fd);
+}
+
+/*
+ * Runs as a long-lived daemon (pastebincd, or -D) that accepts paste jobs
+ * from thin clients (-c) over a unix domain socket.  Provider configs are
+ * parsed once and the curl connection pool stays warm between jobs, so a
+ * paste costs little more than the socket write.
+ */
+int run_daemon(struct pastebinc_config *config) {
+  struct daemon_state state;
+  struct sockaddr_un addr;
+  GThreadPool *pool;
+  struct pastebinc_client *client;
+  struct conf_image *defaults;
+  char *path = daemon_socket_path();
+  char *dir;
+  mode_t mask;
+  int workers = 8;
+  int lfd, fd, bound = -1;
+
+  memset(&state, 0, sizeof(state));
+  g_mutex_init(&state.lock);
+  state.providers = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) &pastebinc_client_free);
+  state.verbose = config->verbose;
+
+  // get_configuration already loaded the default provider (with the command
+  // line's settings), so it becomes that provider's client
+  client = client_new(config);
+  state.default_provider = client->config.provider;
+  g_hash_table_insert(state.providers, client->config.provider, client);
+
+  // the number of workers is a global setting, so look it up in the defaults file
+  defaults = conf_load(CONFDIR "/" CONFFILE, 0);
+  workers = conf_get_int(defaults, "daemon", "workers", workers);
+  conf_free(defaults);
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "ERROR: socket path is too long: %s\n", path);
+    g_free(path);
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  dir = g_path_get_dirname(path);
+  g_mkdir_with_parents(dir, 0700);
+  g_free(dir);
+  unlink(path);
+
+  // the socket is only ever ours: created 0600, not chmod'ed after the fact
+  if ((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) != -1) {
+    mask = umask(077);
+    bound = bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+  }
+  if (lfd == -1 || bound == -1 || listen(lfd, 128) == -1) {
+    fprintf(stderr, "ERROR: can not listen on %s: %s\n", path, strerror(errno));
+    g_free(path);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  pool = g_thread_pool_new(&daemon_handle_client, &state, workers, FALSE, NULL);
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: listening on %s with %d workers\n", path, workers);
+
+  while (1) {
+    if ((fd = accept(lfd, NULL, NULL)) == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "ERROR: accept failed: %s\n", strerror(errno));
+      break;
+    }
+    if (!daemon_peer_is_us(fd)) {
+      daemon_reply(fd, "ERR", "not your daemon");
+      close(fd);
+      if (config->verbose)
+        fprintf(stderr, "DEBUG: refused a client running as another user\n");
+      continue;
+    }
+    g_thread_pool_push(pool, GINT_TO_POINTER(fd), NULL);
+  }
+
+  g_thread_pool_free(pool, FALSE, TRUE);
+  g_hash_table_destroy(state.providers);
+  close(lfd);
+  unlink(path);
+  g_free(path);
+  return 1;
+}
+
+/*
+ * Adds a key=value line to a daemon job header.  Values can't have line
+ * breaks (or other control characters) in them, as those would end the line
+ * or the whole header early; returns 1 for those.
+ */
+int daemon_header_add(GString *header, const char *key, const char *value) {
+  const char *c;
+
+  for (c = value; *c; c++) {
+    if ((unsigned char) *c < 0x20 || *c == 0x7f) {
+      fprintf(stderr, "ERROR: the %s sent to " PROGNAME "d can not have control characters (like line breaks) in it\n", key);
+      return 1;
+    }
+  }
+
+  g_string_append_printf(header, "%s=%s\n", key, value);
+  return 0;
+}
+
+/*
+ * Thin client side of the daemon: sends the job header, forwards stdin to the
+ * daemon and prints the URL it answers with.  No config files are read.
+ */
+int daemon_client_post(struct pastebinc_config *config) {
+  struct sockaddr_un addr;
+  char *path = daemon_socket_path();
+  GString *header = g_string_new(NULL);
+  t_user_field *uf;
+  char reply[DAEMON_HEADER_MAX];
+  ssize_t readval, len = 0;
+  int abort = 0;
+  int fd = -1;
+
+  if ((config->provider && daemon_header_add(header, "provider", config->provider))
+      || (config->name && daemon_header_add(header, "name", config->name))
+      || (config->expiration && daemon_header_add(header, "expiration", config->expiration))
+      || (config->format && daemon_header_add(header, "format", config->format)))
+    abort = 1;
+  for (uf = config->user_fields; !abort && uf != NULL; uf = uf->next) {
+    char *field = g_strdup_printf("%s=%s", uf->name, uf->value);
+    abort = daemon_header_add(header, "field", field);
+    g_free(field);
+  }
+  g_string_append_c(header, '\n');
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  if (!abort && ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+                 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)) {
+    fprintf(stderr, "ERROR: can not connect to " PROGNAME "d at %s: %s\n", path, strerror(errno));
+    abort = 1;
+  }
+
+  // the paste must not go to a daemon some other user started there
+  if (!abort && !daemon_peer_is_us(fd)) {
+    fprintf(stderr, "ERROR: " PROGNAME "d at %s is not running as you\n", path);
+    abort = 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  if (!abort && write(fd, header->str, header->len) != header->len) {
+    fprintf(stderr, "ERROR: can not send job to " PROGNAME "d: %s\n", strerror(errno));
+    abort = 1;
+  }
+
+  if (!abort && tee_input(fd, config->tee) == -1) {
+    fprintf(stderr, "ERROR: can not send input to " PROGNAME "d\n");
+    abort = 1;
+  }
+
+  if (!abort) {
+    shutdown(fd, SHUT_WR);
+    while (len < sizeof(reply) - 1 && (readval = read(fd, reply + len, sizeof(reply) - 1 - len)) > 0)
+      len += readval;
+    reply[len] = 0;
+
+    if (len > 0 && reply[len - 1] == '\n')
+      reply[--len] = 0;
+
+    if (strncmp(reply, "OK ", 3) != 0) {
+      fprintf(stderr, "ERROR: " PROGNAME "d: %s\n", len > 0 ? reply : "no reply");
+      abort = 1;
+    } else {
+      fprintf(stderr, (config->verbose ? "Paste URL: %s\n" : "%s\n"), reply + 3);
+    }
+  }
+
+  if (fd != -1)
+    close(fd);
+  g_string_free(header, TRUE);
+  g_free(path);
+  return abort;
+}
+
+/*
+ * Directory of the outbox that -a queues pastes in: PASTEBINC_OUTBOX, or
+ * pastebinc/outbox in the user's data dir.  The caller g_free's it.
+ */
+char *outbox_dir(void) {
+  const char *dir = getenv("PASTEBINC_OUTBOX");
+
+  if (dir != NULL && *dir)
+    return g_strdup(dir);
+  return g_build_filename(g_get_user_data_dir(), PROGNAME, "outbox", NULL);
+}
+
+int outbox_open_file(struct outbox *ob, const char *name, int flags) {
+  char *path = g_build_filename(ob->dir, name, NULL);
+  int fd;
+
+  if ((fd = open(path, flags | O_CREAT | O_CLOEXEC, 0600)) == -1)
+    fprintf(stderr, "ERROR: Can not open %s: %s\n", path, strerror(errno));
+  g_free(path);
+  return fd;
+}
+
+/*
+ * Like write_all, but at an offset, so appenders don't share a file position.
+ */
+int outbox_write_at(int fd, const char *buf, size_t len, off_t off) {
+  ssize_t written;
+
+  while (len > 0) {
+    if ((written = pwrite(fd, buf, len, off)) == -1) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    buf += written;
+    len -= written;
+    off += written;
+  }
+  return 0;
+}
+
+/*
+ * Checks the record at off in a journal mapped up to len.  Returns the
+ * offset just past it, or 0 if there is no whole, intact record there.
+ */
+uint64_t outbox_record_end(const char *map, uint64_t len, uint64_t off, struct outbox_record *rec) {
+  uint64_t body;
+
+  if (off > len || len - off < sizeof(struct outbox_record))
+    return 0;
+
+  memcpy(rec, map + off, sizeof(struct outbox_record));
+  body = (uint64_t) rec->meta_len + rec->payload_len;
+  if (rec->magic != OUTBOX_MAGIC || rec->payload_len > len || body > len - off - sizeof(struct outbox_record))
+    return 0;
+
+  off += sizeof(struct outbox_record);
+  if (crc32_z(0, (const Bytef *) map + off, body) != rec->crc)
+    return 0;
+
+  return off + body;
+}
+
+/*
+ * Finds where the last whole record of the journal ends and cuts off
+ * whatever follows (a record a crash left half written).  Called with both
+ * outbox locks held.
+ */
+int outbox_recover(struct outbox *ob, const char *boot_id) {
+  struct outbox_record rec;
+  struct stat st;
+  char *map;
+  uint64_t off = 0, end;
+
+  if (fstat(ob->journal, &st) == -1) {
+    fprintf(stderr, "ERROR: Can not read the outbox journal: %s\n", strerror(errno));
+    return 1;
+  }
+
+  if (st.st_size > 0) {
+    if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, ob->journal, 0)) == MAP_FAILED) {
+      fprintf(stderr, "ERROR: Can not map the outbox journal: %s\n", strerror(errno));
+      return 1;
+    }
+    while ((end = outbox_record_end(map, st.st_size, off, &rec)) != 0)
+      off = end;
+    munmap(map, st.st_size);
+  }
+
+  if (off < st.st_size) {
+    fprintf(stderr, "ERROR: dropping %" G_GUINT64_FORMAT " bytes of unfinished outbox records\n", st.st_size - off);
+    if (ftruncate(ob->journal, off) == -1 || fdatasync(ob->journal) == -1) {
+      fprintf(stderr, "ERROR: Can not truncate the outbox journal: %s\n", strerror(errno));
+      return 1;
+    }
+  }
+
+  ob->state->appended = off;
+  ob->state->synced = off;
+  memcpy(ob->state->boot_id, boot_id, sizeof(ob->state->boot_id));
+  ob->state->magic = OUTBOX_MAGIC;
+  return 0;
+}
+
+/*
+ * Opens (creating it if needed) the outbox.  Its state is only trusted if it
+ * was written since the machine last booted: a process that died can only
+ * have left whole records below state->appended, but after a power loss the
+ * journal is scanned again.
+ */
+int outbox_open(struct outbox *ob) {
+  char boot_id[sizeof(ob->state->boot_id)];
+  char *text = NULL;
+  struct stat st;
+  int abort = 0;
+
+  memset(ob, 0, sizeof(struct outbox));
+  ob->journal = ob->state_fd = -1;
+  ob->dir = outbox_dir();
+
+  if (g_mkdir_with_parents(ob->dir, 0700) == -1) {
+    fprintf(stderr, "ERROR: Can not create the outbox %s: %s\n", ob->dir, strerror(errno));
+    return 1;
+  }
+
+  if ((ob->journal = outbox_open_file(ob, "journal", O_RDWR)) == -1
+      || (ob->state_fd = outbox_open_file(ob, "state", O_RDWR)) == -1)
+    return 1;
+
+  if (fstat(ob->state_fd, &st) == -1
+      || (st.st_size < sizeof(struct outbox_state) && ftruncate(ob->state_fd, sizeof(struct outbox_state)) == -1)
+      || (ob->state = mmap(NULL, sizeof(struct outbox_state), PROT_READ | PROT_WRITE, MAP_SHARED, ob->state_fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Can not map the outbox state: %s\n", strerror(errno));
+    ob->state = NULL;
+    return 1;
+  }
+
+  memset(boot_id, 0, sizeof(boot_id));
+  if (g_file_get_contents("/proc/sys/kernel/random/boot_id", &text, NULL, NULL))
+    strncpy(boot_id, g_strstrip(text), sizeof(boot_id) - 1);
+  g_free(text);
+
+  // journal first, then state, like everyone else who takes both
+  flock(ob->journal, LOCK_EX);
+  flock(ob->state_fd, LOCK_EX);
+  if (ob->state->magic != OUTBOX_MAGIC || memcmp(ob->state->boot_id, boot_id, sizeof(boot_id)) != 0)
+    abort = outbox_recover(ob, boot_id);
+  flock(ob->state_fd, LOCK_UN);
+  flock(ob->journal, LOCK_UN);
+
+  return abort;
+}
+
+void outbox_close(struct outbox *ob) {
+  if (ob->state != NULL)
+    munmap(ob->state, sizeof(struct outbox_state));
+  if (ob->journal != -1)
+    close(ob->journal);
+  if (ob->state_fd != -1)
+    close(ob->state_fd);
+  g_free(ob->dir);
+  memset(ob, 0, sizeof(struct outbox));
+}
+
+/*
+ * Appends a record to the journal.  Appenders take turns under the journal
+ * lock, and only move state->appended past a record once all of it is
+ * written, so a failed write just leaves bytes for the next one to cover.
+ * Sets *end to the offset just past the record.
+ */
+int outbox_append(struct outbox *ob, uint32_t type, uint64_t id, const char *meta, uint32_t meta_len,
+                  const char *payload, uint64_t payload_len, uint64_t *end) {
+  struct outbox_record rec;
+  uint64_t off;
+  int abort;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = OUTBOX_MAGIC;
+  rec.id = id;
+  rec.type = type;
+  rec.meta_len = meta_len;
+  rec.payload_len = payload_len;
+  rec.crc = crc32(0, (const Bytef *) meta, meta_len);
+  if (payload_len > 0) // given a NULL buffer, crc32 returns its initial value
+    rec.crc = crc32_z(rec.crc, (const Bytef *) payload, payload_len);
+
+  flock(ob->journal, LOCK_EX);
+  off = ob->state->appended;
+  abort = outbox_write_at(ob->journal, (const char *) &rec, sizeof(rec), off)
+       || outbox_write_at(ob->journal, meta, meta_len, off + sizeof(rec))
+       || outbox_write_at(ob->journal, payload, payload_len, off + sizeof(rec) + meta_len);
+  if (!abort)
+    ob->state->appended = *end = off + sizeof(rec) + meta_len + payload_len;
+  flock(ob->journal, LOCK_UN);
+
+  if (abort)
+    fprintf(stderr, "ERROR: Can not write to the outbox journal: %s\n", strerror(errno));
+  return abort;
+}
+
+/*
+ * Makes sure the journal is on disk up to end.  This is a group commit: one
+ * fdatasync covers every record appended before it started, so processes
+ * queueing pastes at the same time mostly find their record already synced
+ * by the time they get the lock.
+ */
+int outbox_sync(struct outbox *ob, uint64_t end) {
+  uint64_t appended;
+  int abort = 0;
+
+  flock(ob->state_fd, LOCK_EX);
+  if (ob->state->synced < end) {
+    appended = ob->state->appended;
+    if (fdatasync(ob->journal) == -1) {
+      fprintf(stderr, "ERROR: Can not sync the outbox journal: %s\n", strerror(errno));
+      abort = 1;
+    } else if (appended > ob->state->synced) {
+      ob->state->synced = appended;
+    }
+  }
+  flock(ob->state_fd, LOCK_UN);
+
+  return abort;
+}
+
+/*
+ * Starts a flusher in the background unless one is already running (one
+ * that is will pick the new job up).  It is detached from us, our terminal
+ * and our pipes, and logs to flusher.log in the outbox.
+ */
+void outbox_start_flusher(struct pastebinc_config *config, struct outbox *ob, struct paste_info *pi) {
+  char *log;
+  pid_t pid;
+  int lock, fd;
+
+  if ((lock = outbox_open_file(ob, "flusher.lock", O_RDWR)) == -1)
+    return;
+
+  if (flock(lock, LOCK_EX | LOCK_NB) == -1) {
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: the outbox flusher is already running\n");
+    close(lock);
+    return;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  if ((pid = fork()) == -1) {
+    fprintf(stderr, "ERROR: Can not start the outbox flusher: %s\n", strerror(errno));
+    close(lock);
+    return;
+  }
+
+  if (pid == 0) {
+    // the lock is held through our copy of its fd for as long as we run
+    setsid();
+    if (fork() != 0)
+      _exit(0);
+
+    log = g_build_filename(ob->dir, "flusher.log", NULL);
+    if ((fd = open("/dev/null", O_RDWR)) != -1) {
+      dup2(fd, STDIN_FILENO);
+      dup2(fd, STDOUT_FILENO);
+      close(fd);
+    }
+    if ((fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0600)) != -1) {
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    g_free(log);
+
+    outbox_close(ob);
+    if (pi->fd != -1)
+      close(pi->fd);
+    _exit(outbox_flush(config, lock) ? 1 : 0);
+  }
+
+  waitpid(pid, NULL, 0);
+  close(lock);
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: started the outbox flusher\n");
+}
+
+/*
+ * Queues the spooled paste in pi in the outbox (-a) instead of posting it.
+ * The paste is on disk when this returns; a background flusher posts it.
+ * Prints the job id, which its URL is recorded under in the outbox's done
+ * file.
+ */
+int outbox_commit(struct pastebinc_config *config, struct paste_info *pi) {
+  struct outbox ob;
+  GString *meta = g_string_new(NULL);
+  t_user_field *uf;
+  struct stat st;
+  char *data = NULL;
+  uint64_t id, end;
+  int abort;
+
+  // the provider, title and fields, as the flusher will hand them to client_post
+  g_string_append_len(meta, config->provider, strlen(config->provider) + 1);
+  g_string_append(meta, config->name != NULL ? config->name : "");
+  g_string_append_c(meta, 0);
+  for (uf = config->user_fields; uf != NULL; uf = uf->next) {
+    g_string_append_printf(meta, "%s=%s", uf->name, uf->value);
+    g_string_append_c(meta, 0);
+  }
+
+  if (fstat(pi->fd, &st) == -1
+      || (st.st_size > 0 && (data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, pi->fd, 0)) == MAP_FAILED)) {
+    fprintf(stderr, "Error mapping tmp file (%s): %s\n", pi->tmpname, strerror(errno));
+    g_string_free(meta, TRUE);
+    return 1;
+  }
+
+  id = (uint64_t) g_random_int() << 32 | g_random_int();
+  abort = outbox_open(&ob)
+       || outbox_append(&ob, OUTBOX_JOB, id, meta->str, meta->len, data, st.st_size, &end)
+       || outbox_sync(&ob, end);
+
+  if (data != NULL)
+    munmap(data, st.st_size);
+  g_string_free(meta, TRUE);
+
+  if (!abort) {
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: queued %lld bytes for %s in %s\n", (long long) st.st_size, config->provider, ob.dir);
+    fprintf(stderr, (config->verbose ? "Job id: %016" G_GINT64_MODIFIER "x\n" : "%016" G_GINT64_MODIFIER "x\n"), id);
+    outbox_start_flusher(config, &ob, pi);
+  }
+
+  outbox_close(&ob);
+  return abort;
+}
+
+void outbox_job_free(gpointer data) {
+  struct outbox_job *job = data;
+
+  g_free(job->provider);
+  g_free(job->title);
+  g_ptr_array_free(job->fields, TRUE);
+  free(job->url);
+  g_free(job);
+}
+
+/*
+ * Applies a journal record to the table of jobs still to post: a queued
+ * paste adds one, a posted one removes it.
+ */
+void outbox_apply_record(GHashTable *jobs, const char *map, uint64_t off, const struct outbox_record *rec) {
+  const char *meta = map + off + sizeof(struct outbox_record);
+  const char *meta_end = meta + rec->meta_len;
+  struct outbox_job *job;
+  const char *p, *nul;
+  int i;
+
+  if (rec->type == OUTBOX_DONE) {
+    g_hash_table_remove(jobs, &rec->id);
+    return;
+  }
+
+  job = g_new0(struct outbox_job, 1);
+  job->id = rec->id;
+  job->fields = g_ptr_array_new_with_free_func(g_free);
+  job->payload = off + sizeof(struct outbox_record) + rec->meta_len;
+  job->len = rec->payload_len;
+
+  for (p = meta, i = 0; p < meta_end && (nul = memchr(p, 0, meta_end - p)) != NULL; p = nul + 1, i++) {
+    if (i == 0)
+      job->provider = g_strdup(p);
+    else if (i == 1)
+      job->title = g_strdup(p);
+    else
+      g_ptr_array_add(job->fields, g_strdup(p));
+  }
+  g_ptr_array_add(job->fields, NULL);
+
+  if (job->provider == NULL || job->title == NULL) {
+    fprintf(stderr, "ERROR: outbox job %016" G_GINT64_MODIFIER "x is damaged, skipping it\n", job->id);
+    outbox_job_free(job);
+    return;
+  }
+  g_hash_table_replace(jobs, &job->id, job);
+}
+
+/*
+ * Posts one queued paste, on a worker thread.
+ */
+void outbox_post_job(gpointer data, gpointer user_data) {
+  struct outbox_job *job = data;
+  struct pastebinc_options options;
+  struct paste_info pi;
+
+  if (job->client == NULL)
+    return;
+
+  memset(&options, 0, sizeof(options));
+  options.title = *job->title ? job->title : NULL;
+  options.fields = (const char *const *) job->fields->pdata;
+
+  memset(&pi, 0, sizeof(pi));
+  pi.fd = -1;
+  pi.prefix = (char *) job->data;
+  pi.prefix_len = job->len;
+
+  job->url = client_post(job->client, &options, &pi);
+}
+
+/*
+ * Returns the client for a provider, reading its config the first time.  A
+ * provider whose config can't be read gets tried again next round.
+ */
+struct pastebinc_client *outbox_client(GHashTable *clients, const char *provider, int verbose) {
+  struct pastebinc_client *client = g_hash_table_lookup(clients, provider);
+
+  if (client == NULL && (client = pastebinc_client_new(provider, verbose)) != NULL)
+    g_hash_table_insert(clients, client->config.provider, client);
+  return client;
+}
+
+/*
+ * Posts every paste queued in the outbox, in rounds: each round posts the
+ * jobs that are due (config->parallel at a time, one connection pool per
+ * provider), records the URLs in the journal and the done file, and syncs
+ * both once.  A failed job is tried again later, backing off up to
+ * OUTBOX_BACKOFF_MAX seconds; with -A a failure ends the flush instead.
+ * Once nothing is left the journal is emptied and the flusher exits.
+ *
+ * A job whose URL was not on disk yet when the flusher died is posted again
+ * by the next one.  lock is the flusher lock, already held, or -1.
+ */
+int outbox_flush(struct pastebinc_config *config, int lock) {
+  struct outbox ob;
+  struct outbox_record rec;
+  struct outbox_job *job;
+  GHashTable *jobs = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, &outbox_job_free);
+  GHashTable *clients = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) &pastebinc_client_free);
+  GPtrArray *due = g_ptr_array_new();
+  GHashTableIter iter;
+  GThreadPool *pool;
+  GString *line = g_string_new(NULL);
+  char *map = NULL;
+  uint64_t mapped = 0, scanned = 0, synced, end;
+  gint64 now, wake;
+  int done_fd = -1;
+  int failed, delay, i;
+  int abort = 0;
+
+  if (outbox_open(&ob) || (done_fd = outbox_open_file(&ob, "done", O_WRONLY | O_APPEND)) == -1
+      || (lock == -1 && (lock = outbox_open_file(&ob, "flusher.lock", O_RDWR)) == -1)) {
+    abort = 1;
+    goto out;
+  }
+
+  if (flock(lock, LOCK_EX | LOCK_NB) == -1) {
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: waiting for the running outbox flusher\n");
+    flock(lock, LOCK_EX);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  while (1) {
+    // pick up what was queued since the last round
+    synced = ob.state->synced;
+    if (synced > mapped) {
+      if (map != NULL)
+        munmap(map, mapped);
+      if ((map = mmap(NULL, synced, PROT_READ, MAP_SHARED, ob.journal, 0)) == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Can not map the outbox journal: %s\n", strerror(errno));
+        map = NULL;
+        abort = 1;
+        break;
+      }
+      mapped = synced;
+    }
+    while (scanned < synced && (end = outbox_record_end(map, synced, scanned, &rec)) != 0) {
+      outbox_apply_record(jobs, map, scanned, &rec);
+      scanned = end;
+    }
+    if (scanned < synced) {
+      fprintf(stderr, "ERROR: the outbox journal is damaged at offset %" G_GUINT64_FORMAT "\n", scanned);
+      abort = 1;
+      break;
+    }
+
+    now = g_get_monotonic_time();
+    wake = now + G_USEC_PER_SEC;
+    g_ptr_array_set_size(due, 0);
+    g_hash_table_iter_init(&iter, jobs);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &job)) {
+      if (job->next_try <= now)
+        g_ptr_array_add(due, job);
+      else if (job->next_try < wake)
+        wake = job->next_try;
+    }
+
+    if (due->len > 0) {
+      for (i = 0; i < due->len; i++) {
+        job = g_ptr_array_index(due, i);
+        job->client = outbox_client(clients, job->provider, config->verbose);
+        job->data = map + job->payload;
+      }
+
+      pool = g_thread_pool_new(&outbox_post_job, NULL, config->parallel, FALSE, NULL);
+      for (i = 0; i < due->len; i++)
+        g_thread_pool_push(pool, g_ptr_array_index(due, i), NULL);
+      g_thread_pool_free(pool, FALSE, TRUE);
+
+      // one sync of the done file and of the journal for the whole round
+      failed = 0;
+      end = 0;
+      g_string_truncate(line, 0);
+      for (i = 0; i < due->len; i++) {
+        job = g_ptr_array_index(due, i);
+        if (job->url == NULL) {
+          failed = 1;
+          job->attempts++;
+          delay = job->attempts > 9 ? OUTBOX_BACKOFF_MAX : MIN(1 << (job->attempts - 1), OUTBOX_BACKOFF_MAX);
+          job->next_try = g_get_monotonic_time() + (gint64) delay * G_USEC_PER_SEC;
+          fprintf(stderr, "ERROR: posting job %016" G_GINT64_MODIFIER "x to %s failed (try %d)%s\n", job->id, job->provider,
+                  job->attempts, config->flush ? "" : ", will try again");
+          continue;
+        }
+        g_string_append_printf(line, "%016" G_GINT64_MODIFIER "x %s\n", job->id, job->url);
+        if (outbox_append(&ob, OUTBOX_DONE, job->id, job->url, strlen(job->url), NULL, 0, &end))
+          abort = 1;
+        g_hash_table_remove(jobs, &job->id);
+      }
+
+      if (line->len > 0) {
+        fputs(line->str, stderr);
+        if (write_all(done_fd, line->str, line->len) || fdatasync(done_fd) == -1) {
+          fprintf(stderr, "ERROR: Can not write to the outbox done file: %s\n", strerror(errno));
+          abort = 1;
+        }
+      }
+      if (abort || (end > 0 && outbox_sync(&ob, end))) {
+        abort = 1;
+        break;
+      }
+      if (failed && config->flush) {
+        abort = 1;
+        break;
+      }
+      continue;
+    }
+
+    if (g_hash_table_size(jobs) > 0) {
+      g_usleep(wake - now);
+      continue;
+    }
+
+    // all posted: empty the journal, unless a paste is being queued right now
+    flock(ob.journal, LOCK_EX);
+    flock(ob.state_fd, LOCK_EX);
+    if (ob.state->appended == scanned && ob.state->synced == scanned) {
+      if (map != NULL)
+        munmap(map, mapped);
+      map = NULL;
+      mapped = scanned = 0;
+      if (ftruncate(ob.journal, 0) == 0)
+        ob.state->appended = ob.state->synced = 0;
+      else
+        fprintf(stderr, "ERROR: Can not empty the outbox journal: %s\n", strerror(errno));
+    }
+    flock(ob.state_fd, LOCK_UN);
+    flock(ob.journal, LOCK_UN);
+
+    if (ob.state->appended != scanned) {
+      g_usleep(1000);
+      continue;
+    }
+
+    // whoever queues a paste after this sees no flusher and starts one
+    flock(lock, LOCK_UN);
+    if (ob.state->appended == scanned || flock(lock, LOCK_EX | LOCK_NB) == -1)
+      break;
+  }
+
+out:
+  if (map != NULL)
+    munmap(map, mapped);
+  if (lock != -1)
+    close(lock);
+  if (done_fd != -1)
+    close(done_fd);
+  outbox_close(&ob);
+  g_string_free(line, TRUE);
+  g_ptr_array_free(due, TRUE);
+  g_hash_table_destroy(jobs);
+  g_hash_table_destroy(clients);
+  return abort;
+}
+
+/*
+ * Sets every option to its default, before the command line and config files
+ * are read.
+ */
+void config_init(struct pastebinc_config *config) {
+  memset(config, 0, sizeof(struct pastebinc_config));
+  config->compression_level = Z_DEFAULT_COMPRESSION;
+  config->parallel = 4;
+  config->dedupe = -1;
+  config->window_bytes = 1024 * 1024;
+  config->window_ms = 10000;
+  config->hedge_delay_ms = 1000;
+  config->response.max_bytes = RESPONSE_MAX_BYTES;
+  config->arena = calloc(1, sizeof(struct arena));
+}
+
+/*
+ * Frees everything a config owns: its user fields and batch file names (in
+ * its arena), the compiled provider config and what was parsed out of it.
+ */
+void config_free(struct pastebinc_config *config) {
+  warmup_finish(config);
+  net_cache_finish(config);
+  rate_free(config->rate);
+  g_strfreev(config->response.pointer);
+  if (config->response.pattern != NULL)
+    g_regex_unref(config->response.pattern);
+  redactor_free(config->redact);
+  redactor_free(config->trigger);
+  curl_slist_free_all(config->content_headers);
+  conf_free(config->conf);
+  free(config->batch_files);
+
+  if (config->arena != NULL)
+    arena_free(config->arena);
+  free(config->arena);
+  memset(config, 0, sizeof(struct pastebinc_config));
+}
+
+/*
+ * Appends a custom form field to the config.  The name and value are copied
+ * into the config's arena, so they don't need to outlive the call.
+ */
+void add_user_field(struct pastebinc_config *config, const char *name, const char *value) {
+  t_user_field *uf = arena_alloc(config->arena, sizeof(t_user_field));
+  t_user_field **last = &config->user_fields;
+
+  uf->name = arena_strdup(config->arena, name);
+  uf->value = arena_strdup(config->arena, value);
+  uf->next = NULL;
+
+  if (config->verbose)
+    fprintf(stderr, "DEBUG: adding user field to config: '%s'='%s'\n", name, value);
+
+  while (*last != NULL)
+    last = &(*last)->next;
+  *last = uf;
+}
+
+/*
+ * Adds a custom form field given as "name=value" (-d on the command line).
+ * The value is everything after the first '='.
+ */
+int add_user_field_spec(struct pastebinc_config *config, const char *spec) {
+  const char *eq = strchr(spec, '=');
+  char *name;
+
+  if (eq == NULL || eq == spec) {
+    fprintf(stderr, "ERROR: custom field '%s' is not of the form name=value\n", spec);
+    return 1;
+  }
+
+  name = g_strndup(spec, eq - spec);
+  add_user_field(config, name, eq + 1);
+  g_free(name);
+  return 0;
+}
+
+int add_config_user_field(struct pastebinc_config *config, const char *fieldname, const char *value) {
+  if (value == NULL)
+    return 0;
+
+  const char *post_field_name = conf_get(config->conf, "standard_field_names", fieldname);
+  const struct conf_value *option;
+
+  if (post_field_name == NULL) {
+    fprintf(stderr, "ERROR: this provider [%s] does not have a field configured for '%s'\n", config->provider, fieldname);
+    return 1;
+  }
+
+  if ((option = conf_find_option(config->conf, post_field_name, value)) == NULL) {
+    fprintf(stderr, "ERROR: invalid value for %s field.  Use -H for possible values\n", post_field_name);
+    return 1;
+  }
+
+  add_user_field(config, conf_str(config->conf, option->field), conf_str(config->conf, option->post_value));
+  return 0;
+}
+
+int read_config_files(struct pastebinc_config *config) {
+  char conffile[256];
+  static const char *default_conf = CONFDIR "/" CONFFILE;
+  struct conf_image *defaults;
+  int bypass_proxy = 0; // temporary variable for global, then provider values
+
+  // read global config file and pull defaults from it before provider-specific settings override
+  if (access(default_conf, R_OK) == -1) {
+    fprintf(stderr, "ERROR: Can not access defaults config file: %s\n", default_conf);
+    return 1;
+  }
+  if ((defaults = conf_load(default_conf, config->verbose)) == NULL) {
+    fprintf(stderr, "Error loading default config file [%s]\n", default_conf);
+    return 1;
+  }
+
+  // start reading global defaults
+  if (config->provider == NULL && conf_get(defaults, "defaults", "provider") != NULL) { // use system default provider
+    config->provider = arena_strdup(config->arena, conf_get(defaults, "defaults", "provider"));
+  }
+  bypass_proxy = conf_get_int(defaults, "defaults", "bypass_proxy", 0);
+  if (config->dedupe == -1) // -u wins over the config file
+    config->dedupe = conf_get_int(defaults, "defaults", "dedupe", 1);
+  config->preconnect = conf_get_int(defaults, "defaults", "preconnect", 0);
+  config->net_cache = conf_get_int(defaults, "defaults", "net_cache", 0);
+  config->net_cache_ttl = conf_get_int(defaults, "defaults", "net_cache_ttl", 60);
+
+  // secrets to mask before anything is sent, to any provider
+  if (load_redact_rules(config, defaults)) {
+    conf_free(defaults);
+    return 1;
+  }
+
+  // clean up the resources from the global config file
+  conf_free(defaults);
+
+  // now start on the provider-specific configuration
+  snprintf(conffile, sizeof(conffile), "%s/%s.conf", CONFDIR, config->provider);
+
+  if (config->verbose) {
+    fprintf(stderr, "DEBUG: Provider: %s\n", config->provider);
+    fprintf(stderr, "DEBUG: Config file: %s\n", conffile);
+  }
+
+  if (access(conffile, R_OK) == -1) {
+    fprintf(stderr, "ERROR: Can not access config file: %s\n", conffile);
+    fprintf(stderr, "Perhaps the provider you specified (%s) does not exist?\n", config->provider);
+    return 1;
+  }
+
+  if ((config->conf = conf_load(conffile, config->verbose)) == NULL)
+    return 1;
+
+  if (load_response_rule(config) || load_redact_rules(config, config->conf))
+    return 1;
+
+  // the url plus any mirrors, healthiest first
+  load_targets(config);
+  config->hedge_delay_ms = conf_get_int(config->conf, "server", "hedge_delay_ms", config->hedge_delay_ms);
+  config->preconnect = conf_get_int(config->conf, "server", "preconnect", config->preconnect);
+  config->net_cache = conf_get_int(config->conf, "server", "net_cache", config->net_cache);
+  config->net_cache_ttl = conf_get_int(config->conf, "server", "net_cache_ttl", config->net_cache_ttl);
+  if (rate_load(config))
+    return 1;
+
+  // load the bypass_proxy value from the provider file:
+  // (keep global value if we don't have one in this file)
+  bypass_proxy = conf_get_int(config->conf, "server", "bypass_proxy", bypass_proxy);
+
+  // if the user specified an option, it will be:
+  // -1 (force proxy use), or 1 (force bypass proxy)
+  // we don't override the user-specified value with one from config
+  if (config->bypass_proxy == -1) {
+    config->bypass_proxy = 0;
+  } else if (config->bypass_proxy == 0) {
+    // the user did not specify a flag, so we use defaults
+    config->bypass_proxy = bypass_proxy;
+  }
+
+  // inputs bigger than this get split into several pastes plus an index paste
+  if (conf_has_key(config->conf, "server", "max_paste_bytes"))
+    config->max_paste_bytes = g_ascii_strtoull(conf_get(config->conf, "server", "max_paste_bytes"), NULL, 10);
+
+  if (config->max_paste_bytes > 0 && config->stream && config->verbose)
+    fprintf(stderr, "DEBUG: max_paste_bytes is not enforced when streaming (the input size is not known)\n");
+
+  // content compression: the -z flag wins over the provider's setting (and
+  // there is no point compressing what -E encrypts)
+  if (config->compression == NULL && !config->encrypt)
+    config->compression = (char *) conf_get(config->conf, "server", "compression");
+
+  if (config->compression != NULL && strcmp(config->compression, "none") == 0) {
+    config->compression = NULL;
+  } else if (config->compression != NULL && strcmp(config->compression, "gzip") != 0) {
+    fprintf(stderr, "ERROR: unsupported compression '%s' (only gzip is supported)\n", config->compression);
+    return 1;
+  }
+
+  if (config->compression != NULL) {
+    config->compression_level = conf_get_int(config->conf, "server", "compression_level", config->compression_level);
+    config->compression_threads = conf_get_int(config->conf, "server", "compression_threads", config->compression_threads);
+    if (config->compression_threads < 1)
+      config->compression_threads = g_get_num_processors();
+
+    config->content_headers = curl_slist_append(NULL, "Content-Encoding: gzip");
+
+    if (config->verbose)
+      fprintf(stderr, "DEBUG: compressing content with gzip using %d threads\n", config->compression_threads);
+  }
+
+  return 0;
+}
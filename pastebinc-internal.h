@@ -0,0 +1,723 @@
+/* pastebinc-internal.h:
+ *
+ * Copyright (C) 2011 Jeremy Thomerson - http://www.jeremythomerson.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PASTEBINC_INTERNAL_H
+#define PASTEBINC_INTERNAL_H
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <glib.h>
+#include <curl/curl.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "pastebinc.h"
+
+#ifndef PROGNAME
+#define PROGNAME "pastebinc"
+#endif
+
+#ifndef CONFDIR
+#define CONFDIR "./etc"
+#endif
+
+#ifndef CONFFILE
+#define CONFFILE "pastebinc.conf"
+#endif
+
+#ifndef VERSION
+#define VERSION "0.9"
+#endif
+
+#ifndef DAEMON_SOCKET
+#define DAEMON_SOCKET "pastebincd.sock" // in the user's runtime dir
+#endif
+
+#define TEE_CHUNK (1024 * 1024) // most the tee engine moves per syscall
+#define KEEP_LINES_BYTES (4 * 1024 * 1024) // most kept of a -k head or tail given in lines
+#define RECORD_LINE_MAX (64 * 1024) // longest unfinished line held back for the -T patterns
+#define DAEMON_HEADER_MAX 4096
+#define GZIP_CHUNK (128 * 1024)
+#define GZIP_WINDOW (32 * 1024)
+#define TMPNAME "/tmp/pastebinc.XXXXXX"
+#define TMPNAMELEN 22
+#define ARENA_BLOCK 4096
+#define CLIENT_IDLE_HANDLES 16 // easy handles a client keeps for reuse
+#define REDACT_CHUNK (256 * 1024) // input redacted at a time; longer lines get cut
+#define REDACT_SIMD_RULES 8 // up to this many patterns are prefiltered with SSE2
+#define REDACT_MASK '*'
+#define NORMALIZE_CHUNK (256 * 1024) // input normalized at a time
+#define OUTBOX_MAGIC 0x3142584f // "OXB1"
+#define OUTBOX_BACKOFF_MAX 300 // most seconds between two tries of a queued paste
+#define RATE_BACKOFF_MAX 60 // most seconds to wait after a 429 or 503 that has no Retry-After
+#define RATE_WAIT_MAX 300 // a longer Retry-After is not waited for
+#define ENCRYPT_CHUNK (64 * 1024) // plaintext sealed at a time
+#define ENCRYPT_TAG 16
+#define ENCRYPT_KEY 32
+#define ENCRYPT_PREFIX 7 // random part of every chunk's nonce
+#define ENCRYPT_HEADER "pastebinc-aes-256-gcm-1" // first line of an encrypted paste
+
+typedef struct user_field {
+  char *name;
+  char *value;
+  struct user_field *next;
+} t_user_field;
+
+/*
+ * Bump allocator for what lives exactly as long as a config or a single
+ * paste (user fields and their strings), so it can all be freed at once.
+ */
+struct arena_block {
+  struct arena_block *next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+struct arena {
+  struct arena_block *head;
+};
+
+#define CONF_CACHE_MAGIC 0x43434250 // "PBCC"
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define RESPONSE_MAX_BYTES (64 * 1024) // default cap on what we keep of a response
+#define RESPONSE_OVERLAP 1024 // pattern matches can span this much of the previous data
+#define JSON_MAX_DEPTH 64
+#define HEALTH_FAILURE_MS 30000 // latency charged to a mirror for a failed paste
+#define DEDUPE_MARGIN 60 // forget cached pastes this many seconds before they expire
+#define CONF_CACHE_VERSION 1
+
+/*
+ * Layout of a compiled config image (see conf_compile).  Every reference
+ * inside it is an offset, either from the start of the image or, for
+ * strings, from the start of the string pool.
+ */
+struct conf_cache_header {
+  uint32_t magic;
+  uint32_t version;
+  int64_t src_mtime_sec; // the config file this was compiled from
+  int64_t src_mtime_nsec;
+  int64_t src_size;
+  uint32_t size;
+  uint32_t ngroups, groups;
+  uint32_t nentries, entries;
+  uint32_t nvalues, values;
+  uint32_t key_slots, key_buckets, key_slot_tab, key_disp_tab;
+  uint32_t opt_slots, opt_buckets, opt_slot_tab, opt_disp_tab;
+  uint32_t strings;
+};
+
+struct conf_group {
+  uint32_t name;
+  uint32_t first_entry;
+  uint32_t nentries;
+};
+
+struct conf_entry {
+  uint32_t group;
+  uint32_t key;
+  uint32_t value;
+  uint32_t first_value; // allowed values, for [user_fields] entries
+  uint32_t nvalues;
+};
+
+struct conf_value {
+  uint32_t field;
+  uint32_t post_value;
+  uint32_t user_value;
+};
+
+struct conf_image {
+  const char *base;
+  size_t size;
+  int mapped;
+  const struct conf_cache_header *hdr;
+};
+
+struct conf_phash_build {
+  uint32_t m; // slots
+  uint32_t r; // buckets
+  uint32_t *slots;
+  uint32_t *disp;
+};
+
+/*
+ * How to find the paste URL in a provider's response ([response] section):
+ * the whole body (the default), a JSON pointer into the body, a header, or
+ * the first match of a pattern (its first group, if it has one).
+ */
+enum { RESPONSE_BODY, RESPONSE_JSON, RESPONSE_HEADER, RESPONSE_PATTERN };
+
+struct response_rule {
+  int kind;
+  gchar **pointer; // RESPONSE_JSON: the unescaped reference tokens
+  int pointer_len;
+  char *header; // RESPONSE_HEADER
+  GRegex *pattern; // RESPONSE_PATTERN
+  size_t max_bytes;
+};
+
+/*
+ * Input normalization (-N): which stages are on, and the state of one input
+ * stream going through them.  A chunk is normalized as a whole; an unfinished
+ * UTF-8 sequence or a CR at its end (that may be half a CRLF) waits in front
+ * of the next one.  Escape sequences can span chunks, so the parser state
+ * carries over instead.
+ */
+enum { NORMALIZE_UTF8 = 1, NORMALIZE_UTF8_FIX = 2, NORMALIZE_ANSI = 4, NORMALIZE_CRLF = 8 };
+enum { ESC_NONE, ESC_START, ESC_INTERMEDIATE, ESC_CSI, ESC_STRING, ESC_STRING_END };
+
+struct normalize_stream {
+  int stages;
+  int escape; // where in an escape sequence the input is
+  char *in;
+  size_t carried; // bytes at the start of in left over from the last chunk
+  char *out;
+  size_t start; // next byte of out to hand out
+  size_t end;
+  size_t offset; // input bytes before in, for error messages
+  int eof;
+  size_t escapes; // sequences stripped
+  size_t endings; // CRs folded
+  size_t repairs; // bad UTF-8 sequences replaced
+};
+
+/*
+ * Client-side encryption (-E).  The input is sealed with AES-256-GCM a chunk
+ * at a time, so neither end has to hold all of it.  Each chunk's nonce is
+ * the random prefix, the chunk number and a flag set only on the last
+ * chunk, so chunks can't be reordered, dropped or cut off at the end
+ * without the tag check failing.  What gets pasted is the ENCRYPT_HEADER
+ * line, then the prefix and the sealed chunks as base64 text.
+ */
+struct encrypt_stream {
+  EVP_CIPHER_CTX *ctx;
+  unsigned char key[ENCRYPT_KEY];
+  unsigned char prefix[ENCRYPT_PREFIX];
+  uint32_t counter;
+  unsigned char *plain; // a chunk, plus a byte to tell if another follows
+  size_t plain_len;
+  unsigned char *sealed; // the chunk and its tag
+  char *out; // base64 text ready to hand out
+  size_t start;
+  size_t end;
+  gint b64_state, b64_save;
+  int header_sent;
+  int finished;
+  size_t bytes_in;
+  size_t bytes_out;
+  gint64 started;
+  gint64 elapsed;
+};
+
+/*
+ * Fetching an encrypted paste (-g): the response is searched for the header
+ * line (so a page with the paste in it works too), then the base64 after it
+ * is decoded and opened a chunk at a time, up to the first character that
+ * can't be part of it.
+ */
+enum { DECRYPT_SEARCH, DECRYPT_LINE, DECRYPT_BODY, DECRYPT_END };
+
+struct decrypt_stream {
+  EVP_CIPHER_CTX *ctx;
+  unsigned char key[ENCRYPT_KEY];
+  unsigned char prefix[ENCRYPT_PREFIX];
+  size_t prefix_len;
+  uint32_t counter;
+  int state;
+  size_t matched; // DECRYPT_SEARCH: header bytes seen so far
+  gint b64_state;
+  guint b64_save;
+  unsigned char *sealed; // a chunk and its tag, plus a byte to tell if another follows
+  size_t sealed_len;
+  unsigned char *plain;
+  int failed;
+  size_t bytes_out;
+};
+
+/*
+ * Secret redaction ([redact] sections).  Patterns are alternatives of one
+ * regex, except those with backreferences, named groups or recursion: the
+ * one regex would renumber their groups, so each gets a regex of its own.
+ * When every pattern in the one regex starts with some fixed text, a SIMD
+ * scan for the first and last bytes of those literals (at the right
+ * distance) finds the few places worth trying it at; otherwise the regex
+ * searches everything.
+ */
+struct redact_rule {
+  char *name;
+  char *pattern;
+  char *literal; // what the pattern always starts with, NULL if unknown
+  size_t literal_len;
+  int caseless;
+  int group; // the regex group holding this alternative
+  int ngroups; // the pattern's own groups; the first one is what gets masked
+  GRegex *regex; // the pattern on its own, if it can't go in the one regex
+};
+
+struct redactor {
+  GRegex *regex; // NULL if every rule has a regex of its own
+  struct redact_rule *rules;
+  int nrules;
+  int prefilter; // every rule in the one regex has a literal
+  unsigned char first[256]; // which bytes can start a literal
+};
+
+/*
+ * Redaction state of one input stream: data is only redacted a whole line
+ * at a time, so what is left of the last line waits for the next read.
+ */
+struct redact_stream {
+  const struct redactor *redactor;
+  char *buf;
+  size_t start; // next byte to hand out
+  size_t ready; // end of what has been redacted
+  size_t end; // end of what has been read
+  int eof;
+  size_t count; // matches masked
+};
+
+/*
+ * Where the time went, for -S.  Timestamps are g_get_monotonic_time()
+ * microseconds; the curl phase times (also microseconds, relative to the
+ * start of the request) are those of the last transfer that finished.
+ */
+struct paste_stats {
+  gint64 start;
+  gint64 config_done;
+  gint64 input_start;
+  gint64 input_done;
+  gint64 post_start;
+  gint64 post_done;
+  size_t bytes_in;
+  curl_off_t bytes_up;
+  curl_off_t bytes_down;
+  int requests;
+  long connects; // new connections the last request opened
+  size_t redactions;
+  int throttled; // 429 and 503 responses
+  gint64 warmup_start;
+  gint64 warmup_done;
+  curl_off_t namelookup;
+  curl_off_t connect;
+  curl_off_t appconnect;
+  curl_off_t pretransfer;
+  curl_off_t starttransfer;
+  curl_off_t total;
+};
+
+struct pastebinc_config {
+  char *name;
+  int verbose;
+  int tee;
+  int stream;
+  int bypass_proxy;
+  char *compression;
+  int compression_level;
+  int compression_threads;
+  struct curl_slist *content_headers; // extra headers for the content part
+  int daemon;
+  int use_daemon;
+  char *expiration;
+  char *format;
+  int name_given;
+  int parallel;
+  int dedupe;
+  int follow;
+  size_t window_bytes;
+  size_t window_lines;
+  int window_ms;
+  size_t max_paste_bytes;
+  int keep; // -k: only spool the head and tail of the input
+  size_t keep_head; // bytes, or lines when keep_head_lines
+  size_t keep_tail;
+  int keep_head_lines;
+  int keep_tail_lines;
+  int normalize; // -N: NORMALIZE_* stages for stdin
+  int async; // -a: queue the paste in the outbox and return
+  int flush; // -A: post everything in the outbox, then exit
+  int encrypt; // -E: seal the paste, the key goes in the URL fragment
+  char *fetch; // -g: the URL (with its #key) of an encrypted paste to print
+  size_t record; // -R: bytes of the latest input the flight recorder keeps
+  struct redactor *trigger; // -T: patterns that make it paste them
+  int preconnect; // warm up a connection while the input is spooled
+  int net_cache; // keep addresses and TLS sessions between runs
+  long net_cache_ttl; // seconds a cached address is used for
+  struct net_cache *net; // loaded by net_cache_load
+  struct rate_limiter *rate;
+  int rate_retries; // times a throttled paste is tried again
+  struct warmup *warmup; // the one in progress, if any
+  char **targets; // [server] url and mirrors, healthiest first
+  int ntargets;
+  int hedge_delay_ms;
+  struct response_rule response;
+  struct redactor *redact; // NULL when there are no [redact] patterns
+  char *stats_format; // -S: "text" or "json", NULL for none
+  struct paste_stats stats;
+  char **batch_files;
+  int batch_count;
+  char *provider;
+  t_user_field *user_fields;
+  struct arena *arena; // user_fields are allocated from here
+  struct conf_image *conf;
+};
+
+/*
+ * Incremental JSON scanner state: where in the document we are and whether
+ * that is on the way to what the pointer names.
+ */
+enum { JS_VALUE, JS_VALUE_OR_END, JS_KEY, JS_KEY_OR_END, JS_COLON, JS_AFTER_VALUE,
+       JS_STRING, JS_ESCAPE, JS_UNICODE, JS_LITERAL, JS_DONE, JS_ERROR };
+
+struct json_scan {
+  int state;
+  int depth;
+  char container[JSON_MAX_DEPTH]; // '{' or '[' for each open level
+  long index[JSON_MAX_DEPTH]; // position in each open array
+  char on_path[JSON_MAX_DEPTH + 1]; // the element at this depth lies on the pointer
+  int in_key; // the string being read is an object key
+  int capture; // the value being read is the one the pointer names
+  gunichar unicode;
+  int unicode_digits;
+  GString *text; // the key, or the captured value, being read
+};
+
+struct http_response {
+  char *body; // the start of the body, at most rule->max_bytes of it
+  size_t body_size;
+  size_t body_alloc;
+  int truncated; // the body was bigger than that
+  char *location;
+  long retry_after; // seconds, -1 if there was no Retry-After
+  const struct response_rule *rule;
+  char *url; // found by the rule
+  struct json_scan json;
+  GString *window; // RESPONSE_PATTERN: the latest data, searched as it arrives
+};
+
+struct gzip_chunk {
+  unsigned char *in;
+  size_t in_len;
+  unsigned char *dict; // the input just before this chunk, to prime deflate
+  size_t dict_len;
+  unsigned char *out;
+  size_t out_len;
+  size_t out_pos;
+  uLong crc;
+  int last;
+  int done;
+  struct gzip_chunk *next;
+};
+
+struct gzip_stream {
+  GThreadPool *pool;
+  GMutex lock;
+  GCond cond;
+  int level;
+  int max_inflight;
+  int inflight;
+  struct gzip_chunk *head; // chunks in output order
+  struct gzip_chunk *tail;
+  unsigned char prev[GZIP_WINDOW];
+  size_t prev_len;
+  unsigned char outbuf[16]; // gzip header or trailer
+  size_t outbuf_len;
+  size_t outbuf_pos;
+  uLong crc;
+  size_t bytes_in;
+  size_t bytes_out;
+  int eof;
+  int header_sent;
+  int finished;
+  gint64 started;
+  gint64 elapsed;
+};
+
+/*
+ * The tail of the input for -k: the last size bytes that were written.
+ */
+struct keep_ring {
+  char *buf;
+  size_t size;
+  size_t pos; // where the next byte goes
+  size_t used;
+};
+
+struct xxh64_state {
+  uint64_t total;
+  uint64_t v[4];
+  unsigned char buf[32];
+  size_t buflen;
+};
+
+struct paste_info {
+  char tmpname[TMPNAMELEN];
+  FILE *content;
+  int fd;
+  int tee;
+  size_t bytes_read;
+  char *prefix; // data already read from fd that must be sent first
+  size_t prefix_len;
+  struct gzip_stream *gz;
+  struct redact_stream *redact;
+  struct normalize_stream *normalize;
+  struct encrypt_stream *crypt;
+  struct xxh64_state hash; // of the spooled input, for the dedupe cache
+};
+
+struct batch_job {
+  const char *path;
+  const char *buf; // content to post when there is no path
+  size_t len;
+  char *map; // the file at path, while it is posted (buf and len point at it)
+  const char *target; // URL to post to, when not the provider's first
+  gint64 started;
+  int cancelled;
+  char *title;
+  CURL *curl;
+  struct curl_httppost *post;
+  struct http_response resp;
+  struct paste_info pi; // only used when compressing or redacting
+  int redact; // the file has not been through the redaction stage yet
+  char *url;
+  int attempts; // posts of it the provider throttled
+  struct xxh64_state hash; // of the file, when dedupe is set
+  int dedupe; // remember the URL in the dedupe cache
+  int done;
+};
+
+struct post_engine {
+  CURLM *multi;
+  CURL **idle; // easy handles ready for reuse
+  int nidle;
+  int size; // of idle
+  int running;
+  GPtrArray *waiting; // jobs waiting for the rate limiter, in the order they go
+  gint64 wake; // when the first of them may go
+  struct curl_slist *headers;
+};
+
+/*
+ * A record in the outbox journal, followed by meta_len bytes of meta and
+ * payload_len bytes of paste.  For a queued paste (OUTBOX_JOB) the meta is
+ * the provider, the title and the "name=value" fields, each NUL terminated;
+ * for a posted one (OUTBOX_DONE) it is the URL.  crc covers meta and
+ * payload.
+ */
+enum outbox_type { OUTBOX_JOB = 1, OUTBOX_DONE = 2 };
+
+struct outbox_record {
+  uint32_t magic;
+  uint32_t crc;
+  uint64_t id;
+  uint32_t type;
+  uint32_t meta_len;
+  uint64_t payload_len;
+};
+
+/*
+ * Shared by every process using the outbox (it is mmap'd).  Only valid
+ * for the boot it was written in: after a crash of the machine the journal
+ * is scanned again to find where its last whole record ends.
+ */
+struct outbox_state {
+  uint32_t magic;
+  char boot_id[40];
+  uint64_t appended; // journal bytes that hold whole records
+  uint64_t synced; // journal bytes known to be on disk
+};
+
+struct outbox {
+  char *dir;
+  int journal; // flock'd while appending
+  int state_fd; // flock'd while syncing
+  struct outbox_state *state;
+};
+
+/*
+ * A queued paste, as the flusher sees it.
+ */
+struct outbox_job {
+  uint64_t id;
+  char *provider;
+  char *title;
+  GPtrArray *fields;
+  off_t payload; // in the journal
+  uint64_t len;
+  int attempts;
+  gint64 next_try;
+  const char *data; // payload, while a round of posts runs
+  char *url; // set when the post worked
+  struct pastebinc_client *client;
+};
+
+/*
+ * Kept between runs with net_cache=1, in one file under the cache dir:
+ * provider addresses (fed to curl with CURLOPT_RESOLVE until their TTL is
+ * up) and TLS session tickets (imported into the share every transfer of
+ * the run uses, and exported back at the end).
+ */
+struct net_cache_host {
+  char *resolve; // "host:port:addr"
+  gint64 expires; // unix time
+  int loaded; // from the file, rather than learned this run
+};
+
+struct net_cache {
+  char *path;
+  CURLSH *share;
+  GMutex share_locks[CURL_LOCK_DATA_LAST];
+  GHashTable *hosts; // "host:port" -> struct net_cache_host
+  struct curl_slist *resolve; // the loaded hosts
+  GHashTable *imported; // base64 shmac -> "host:port" of each ticket put in share
+  int lookups; // new connections, each needing an address
+  int dns_hits; // ... that came from the cache
+  int handshakes; // new TLS connections
+  int tls_hits; // ... to a host there was a saved ticket for
+};
+
+/*
+ * Token bucket for a provider's rate_limit: bursts of up to burst posts,
+ * then rate posts a second.  A 429 or 503 empties it and blocks it until
+ * the Retry-After is up, so every post holds back, not just the throttled
+ * one.  With rate_shared=1 the state lives in a file under the cache dir,
+ * read and written under a flock for each post, so all processes posting
+ * to the provider draw on the same budget.
+ */
+struct rate_limiter {
+  double rate; // tokens a second, 0 for no limit
+  double burst;
+  double tokens;
+  gint64 updated; // real time in microseconds, which every process agrees on
+  gint64 blocked_until;
+  int fd; // the shared state, -1 if it is this process's own
+  GMutex lock; // clients post from many threads
+};
+
+/*
+ * A connection to the provider being set up in the background while the
+ * input is spooled (see warmup_start).
+ */
+struct warmup {
+  CURLSH *share; // the post picks the connection up from here
+  GMutex share_locks[CURL_LOCK_DATA_LAST];
+  CURLM *multi;
+  CURL *curl;
+  GThread *thread;
+  gint cancel;
+};
+
+/*
+ * A library client (see pastebinc.h): one provider's config, shared
+ * read-only by every paste, plus the curl state that is kept between them.
+ */
+struct pastebinc_client {
+  struct pastebinc_config config;
+  struct arena arena; // owns config's user fields
+  CURLSH *share; // connection pool, DNS and TLS session caches
+  GMutex share_locks[CURL_LOCK_DATA_LAST];
+  GMutex lock; // guards idle
+  CURL **idle; // easy handles ready for reuse
+  int nidle;
+  int size; // of idle
+};
+
+struct daemon_state {
+  GMutex lock;
+  GHashTable *providers; // provider name -> struct pastebinc_client
+  char *default_provider;
+  int verbose;
+};
+
+/* configuration */
+void config_init(struct pastebinc_config *config);
+void config_free(struct pastebinc_config *config);
+int read_config_files(struct pastebinc_config *config);
+void add_user_field(struct pastebinc_config *config, const char *name, const char *value);
+int add_user_field_spec(struct pastebinc_config *config, const char *spec);
+int add_config_user_field(struct pastebinc_config *config, const char *fieldname, const char *value);
+int add_trigger_pattern(struct pastebinc_config *config, const char *pattern);
+int add_batch_file(struct pastebinc_config *config, char *path);
+int read_batch_manifest(struct pastebinc_config *config, const char *manifest);
+int parse_size(const char *str, size_t *size);
+
+struct conf_image *conf_load(const char *path, int verbose);
+const struct conf_entry *conf_find(const struct conf_image *img, const char *group, const char *key);
+const char *conf_get(const struct conf_image *img, const char *group, const char *key);
+const struct conf_value *conf_find_option(const struct conf_image *img, const char *field, const char *post_value);
+const char *conf_str(const struct conf_image *img, uint32_t off);
+const struct conf_entry *conf_group(const struct conf_image *img, const char *group, uint32_t *count);
+const struct conf_value *conf_values(const struct conf_image *img);
+void conf_free(struct conf_image *img);
+
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+void arena_free(struct arena *arena);
+
+/* input and posting */
+void xxh64_init(struct xxh64_state *st);
+size_t redact_buffer(const struct redactor *redactor, char *buf, size_t len);
+ssize_t redact_input(struct pastebinc_config *config, int out);
+ssize_t keep_input(struct pastebinc_config *config, int out);
+void redactor_free(struct redactor *redactor);
+int write_input_to_paste_info(struct pastebinc_config *config, struct paste_info *pi);
+int dedupe_lookup(struct pastebinc_config *config, struct paste_info *pi);
+CURLSH *share_new(GMutex *locks);
+void net_cache_load(struct pastebinc_config *config);
+void net_cache_finish(struct pastebinc_config *config);
+void warmup_start(struct pastebinc_config *config);
+void warmup_finish(struct pastebinc_config *config);
+int pastebin_post(struct pastebinc_config *config, struct paste_info *pi);
+int pastebin_post_split(struct pastebinc_config *config, struct paste_info *pi, size_t size);
+int pastebin_post_batch(struct pastebinc_config *config);
+int pastebin_follow(struct pastebinc_config *config);
+int pastebin_record(struct pastebinc_config *config);
+int pastebin_fetch(struct pastebinc_config *config);
+char *post_hedged(struct pastebinc_config *config, struct paste_info *pi);
+void print_stats(struct pastebinc_config *config);
+
+/* clients and the daemon */
+struct pastebinc_client *client_new(struct pastebinc_config *config);
+char *client_post(struct pastebinc_client *client, const struct pastebinc_options *options, struct paste_info *pi);
+int run_daemon(struct pastebinc_config *config);
+int daemon_client_post(struct pastebinc_config *config);
+int outbox_commit(struct pastebinc_config *config, struct paste_info *pi);
+int outbox_flush(struct pastebinc_config *config, int lock);
+
+#endif
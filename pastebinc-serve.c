@@ -0,0 +1,1155 @@
+/* pastebinc-serve.c:
+ *
+ * Copyright (C) 2011 Jeremy Thomerson - http://www.jeremythomerson.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * pastebinc-serve: a paste site that takes exactly the posts a provider
+ * config describes, so a private pastebin (or a test) needs nothing else.
+ *
+ * One thread runs an epoll loop over non-blocking sockets.  Pastes are
+ * appended to a log file, which is never rewritten; an in-memory index
+ * (rebuilt from the mmap'd log at startup) maps each paste id to where its
+ * content is in the log, and reads are sent from there with sendfile.
+ */
+#include "pastebinc-internal.h"
+#include <netdb.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define SERVE_HEAD_MAX (16 * 1024) // longest request line plus headers
+#define SERVE_READ_CHUNK (64 * 1024)
+#define SERVE_EVENTS 256
+#define SERVE_MAX_BYTES (64 * 1024 * 1024) // default for -m
+#define SERVE_FORM_OVERHEAD (64 * 1024) // allowed on top of -m for the other fields
+#define SERVE_LOG "pastes.log"
+#define SERVE_LOG_MAGIC 0x31524250 // "PBR1"
+
+/*
+ * One paste in the log: this header, then the title, the format and the
+ * content.  crc (zlib's crc32) covers those three, so a record cut short by
+ * a crash is found and dropped at the next start.
+ */
+struct serve_record {
+  uint32_t magic;
+  uint32_t crc;
+  uint64_t id;
+  int64_t created;
+  int64_t expires; // unix time, 0 for never
+  uint64_t content_len;
+  uint32_t title_len;
+  uint32_t format_len;
+};
+
+/*
+ * What the index keeps of a paste.
+ */
+struct serve_paste {
+  off_t content; // offset in the log
+  uint64_t len;
+  int64_t expires;
+};
+
+/*
+ * A field of a posted multipart/form-data body; name and data point into
+ * the body.
+ */
+struct serve_part {
+  char *name;
+  const char *data;
+  size_t len;
+  int gzip;
+};
+
+struct serve_conn {
+  int fd;
+  char *in; // request bytes not handled yet
+  size_t in_len;
+  size_t in_alloc;
+  size_t head_len; // of the request head at the start of in, 0 until it is all there
+
+  // the request in in
+  char method[8];
+  char *path;
+  char *host;
+  char *content_type;
+  size_t content_length;
+  int chunked;
+  size_t chunk_pos; // where in in the next chunk (size line) starts
+  GString *body; // the decoded body of a chunked request
+
+  // the response: out, then file_left bytes of the log from file_pos
+  GString *out;
+  size_t out_pos;
+  off_t file_pos;
+  size_t file_left;
+  int keep_alive;
+  int syncing; // waiting for the log to reach the disk before answering
+};
+
+struct serve_state {
+  struct conf_image *conf;
+  char *listen; // host:port
+  char *post_path;
+  char *base_url; // -u, or NULL to use the Host header
+  const char *content_field;
+  const char *title_field;
+  const char *expiration_field;
+  const char *format_field;
+  const char *url_header; // [response] header
+  const char *json_pointer; // [response] json_pointer
+  int redirect;
+  size_t max_bytes;
+  int sync;
+  int verbose;
+  int epfd;
+  int log_fd;
+  off_t log_end;
+  GHashTable *index; // paste id (uint64_t *) -> struct serve_paste
+  GPtrArray *syncing; // connections whose answers wait for fdatasync
+};
+
+void serve_usage(void) {
+  fprintf(stderr,
+    "pastebinc-serve " VERSION "\n\n"
+   "Serves pastes the way a provider's config file describes them.\n"
+   "Options:\n\n"
+   "  -l [host:port] where to listen (default: the host and port of the\n"
+   "                   provider's url)\n"
+   "  -d [file]      the paste log (default ./" SERVE_LOG ")\n"
+   "  -u [url]       base of the paste URLs handed out (default: http:// and the\n"
+   "                   Host the paste was posted to)\n"
+   "  -r             answer posts with a 302 to the paste instead of its URL\n"
+   "  -m [size]      largest paste accepted (default 64m)\n"
+   "  -n             do not fdatasync the log before answering a post\n"
+   "  -v             'verbose', or print out debugging information as I work\n"
+   "  -h             print this usage message\n"
+   "\n"
+   "Usage: pastebinc-serve [options] provider   (a name from " CONFDIR ", or a\n"
+   "                                             path to a .conf file)\n"
+   "\n"
+   "Pastes are posted to the path of the provider's url and read back from\n"
+   "/p/<id>.  The fields in [fieldnames] and [standard_field_names] are\n"
+   "understood, [static_fields] must be sent as they are, [user_fields] values\n"
+   "must be one of those listed and [expiration_seconds] says how long each\n"
+   "expiration value lives.\n"
+   );
+}
+
+/*
+ * Reads the paste log into the index.  A record that is cut short or does
+ * not match its crc ends the log: it is what a crash in the middle of an
+ * append leaves, and it is truncated away so the next paste follows the
+ * last good one.
+ */
+int serve_load_log(struct serve_state *srv, const char *path) {
+  struct stat st;
+  const char *map = NULL;
+  off_t off = 0;
+  int64_t now = time(NULL);
+  size_t live = 0;
+
+  if ((srv->log_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) == -1) {
+    fprintf(stderr, "ERROR: Can not open paste log %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (fstat(srv->log_fd, &st) == -1) {
+    fprintf(stderr, "ERROR: Can not stat paste log %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (st.st_size > 0 && (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, srv->log_fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Can not map paste log %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (map != NULL)
+    madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+  while (off + (off_t) sizeof(struct serve_record) <= st.st_size) {
+    struct serve_record rec;
+    struct serve_paste *paste;
+    uint64_t *id;
+    off_t data = off + sizeof(struct serve_record);
+    uint64_t len;
+
+    memcpy(&rec, map + off, sizeof(rec));
+    len = (uint64_t) rec.title_len + rec.format_len + rec.content_len;
+    if (rec.magic != SERVE_LOG_MAGIC || len > (uint64_t) (st.st_size - data)
+        || crc32_z(0, (const Bytef *) map + data, len) != rec.crc)
+      break;
+
+    if (rec.expires == 0 || rec.expires > now) {
+      paste = malloc(sizeof(struct serve_paste));
+      paste->content = data + rec.title_len + rec.format_len;
+      paste->len = rec.content_len;
+      paste->expires = rec.expires;
+      id = malloc(sizeof(uint64_t));
+      *id = rec.id;
+      g_hash_table_replace(srv->index, id, paste);
+      live++;
+    }
+    off = data + len;
+  }
+
+  if (map != NULL)
+    munmap((void *) map, st.st_size);
+
+  if (off < st.st_size) {
+    fprintf(stderr, "ERROR: paste log %s is damaged after %lld bytes, dropping the rest\n", path, (long long) off);
+    if (ftruncate(srv->log_fd, off) == -1) {
+      fprintf(stderr, "ERROR: Can not truncate paste log %s: %s\n", path, strerror(errno));
+      return 1;
+    }
+  }
+  srv->log_end = off;
+
+  if (srv->verbose)
+    fprintf(stderr, "DEBUG: %zu pastes (%lld bytes) in %s\n", live, (long long) off, path);
+
+  return 0;
+}
+
+/*
+ * Appends a paste to the log and adds it to the index.  Returns its id, or
+ * 0 if it could not be written.
+ */
+uint64_t serve_append(struct serve_state *srv, const char *title, const char *format,
+                      const char *content, size_t len, int64_t lifetime) {
+  struct serve_record rec;
+  struct serve_paste *paste;
+  struct iovec iov[4];
+  uint64_t *id;
+  size_t left = sizeof(rec) + strlen(title) + strlen(format) + len;
+  ssize_t n;
+  int i = 0;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = SERVE_LOG_MAGIC;
+  do {
+    rec.id = ((uint64_t) g_random_int() << 16 ^ g_random_int()) & G_GUINT64_CONSTANT(0xffffffffffff);
+  } while (rec.id == 0 || g_hash_table_contains(srv->index, &rec.id));
+  rec.created = time(NULL);
+  rec.expires = lifetime > 0 ? rec.created + lifetime : 0;
+  rec.content_len = len;
+  rec.title_len = strlen(title);
+  rec.format_len = strlen(format);
+  rec.crc = crc32(0, (const Bytef *) title, rec.title_len);
+  rec.crc = crc32(rec.crc, (const Bytef *) format, rec.format_len);
+  rec.crc = crc32_z(rec.crc, (const Bytef *) content, len);
+
+  iov[0].iov_base = &rec;
+  iov[0].iov_len = sizeof(rec);
+  iov[1].iov_base = (void *) title;
+  iov[1].iov_len = rec.title_len;
+  iov[2].iov_base = (void *) format;
+  iov[2].iov_len = rec.format_len;
+  iov[3].iov_base = (void *) content;
+  iov[3].iov_len = len;
+
+  while (left > 0) {
+    if ((n = writev(srv->log_fd, iov + i, 4 - i)) == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "ERROR: Can not append to the paste log: %s\n", strerror(errno));
+      // don't leave half a record for the next paste to follow
+      if (ftruncate(srv->log_fd, srv->log_end) == -1)
+        fprintf(stderr, "ERROR: Can not truncate the paste log: %s\n", strerror(errno));
+      return 0;
+    }
+    left -= n;
+    while (i < 4 && (size_t) n >= iov[i].iov_len)
+      n -= iov[i++].iov_len;
+    if (i < 4) {
+      iov[i].iov_base = (char *) iov[i].iov_base + n;
+      iov[i].iov_len -= n;
+    }
+  }
+
+  paste = malloc(sizeof(struct serve_paste));
+  paste->content = srv->log_end + sizeof(rec) + rec.title_len + rec.format_len;
+  paste->len = len;
+  paste->expires = rec.expires;
+  id = malloc(sizeof(uint64_t));
+  *id = rec.id;
+  g_hash_table_replace(srv->index, id, paste);
+  srv->log_end = paste->content + len;
+
+  return rec.id;
+}
+
+/*
+ * Starts the answer to the current request: status line, headers and a
+ * body from memory (the file part, if any, is set by the caller).
+ */
+void serve_respond(struct serve_conn *conn, int status, const char *reason, const char *headers,
+                   const char *body, size_t len, size_t content_length) {
+  g_string_append_printf(conn->out, "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n%s%s\r\n",
+    status, reason, content_length, headers != NULL ? headers : "",
+    conn->keep_alive ? "" : "Connection: close\r\n");
+  if (body != NULL && strcmp(conn->method, "HEAD") != 0)
+    g_string_append_len(conn->out, body, len);
+}
+
+void serve_error(struct serve_conn *conn, int status, const char *reason, const char *message) {
+  char *body = g_strdup_printf("%s\n", message);
+  serve_respond(conn, status, reason, "Content-Type: text/plain\r\n", body, strlen(body), strlen(body));
+  g_free(body);
+}
+
+/*
+ * Value of a parameter (like boundary= or name=) in a header value, or NULL.
+ */
+char *serve_header_param(const char *value, const char *param) {
+  size_t plen = strlen(param);
+  const char *p = value;
+
+  while ((p = strchr(p, ';')) != NULL) {
+    p++;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (g_ascii_strncasecmp(p, param, plen) == 0 && p[plen] == '=') {
+      p += plen + 1;
+      if (*p == '"')
+        return g_strndup(p + 1, strcspn(p + 1, "\""));
+      return g_strndup(p, strcspn(p, "; \t\r\n"));
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Splits a multipart/form-data body into its fields.  Returns 0 if the body
+ * is well formed.
+ */
+int serve_parse_form(const char *body, size_t len, const char *boundary, GArray *parts) {
+  char *delim = g_strdup_printf("\r\n--%s", boundary);
+  size_t dlen = strlen(delim);
+  const char *end = body + len;
+  const char *p;
+  int abort = 1;
+
+  // the first delimiter may start the body, without the CRLF before it
+  if (len >= dlen - 2 && memcmp(body, delim + 2, dlen - 2) == 0)
+    p = body + dlen - 2;
+  else if ((p = memmem(body, len, delim, dlen)) != NULL)
+    p += dlen;
+
+  while (p != NULL && end - p >= 2) {
+    struct serve_part part;
+    const char *headers, *data, *next, *line, *eol;
+
+    if (memcmp(p, "--", 2) == 0) { // the closing delimiter
+      abort = 0;
+      break;
+    }
+    if (memcmp(p, "\r\n", 2) != 0)
+      break;
+    headers = p + 2;
+    if ((data = memmem(headers, end - headers, "\r\n\r\n", 4)) == NULL)
+      break;
+    data += 4;
+    if ((next = memmem(data, end - data, delim, dlen)) == NULL)
+      break;
+
+    memset(&part, 0, sizeof(part));
+    part.data = data;
+    part.len = next - data;
+    for (line = headers; line < data - 2; line = eol + 2) {
+      char *value;
+      // the body is not NUL terminated, and may have NULs of its own
+      if ((eol = memmem(line, data - 2 - line, "\r\n", 2)) == NULL || memchr(line, 0, eol - line) != NULL)
+        break;
+      value = g_strndup(line, eol - line);
+      if (g_ascii_strncasecmp(value, "Content-Disposition:", 20) == 0) {
+        g_free(part.name);
+        part.name = serve_header_param(value, "name");
+      } else if (g_ascii_strncasecmp(value, "Content-Encoding:", 17) == 0) {
+        part.gzip = strstr(value + 17, "gzip") != NULL;
+      }
+      g_free(value);
+    }
+    if (line < data - 2) { // a malformed header line
+      g_free(part.name);
+      break;
+    }
+    if (part.name != NULL)
+      g_array_append_val(parts, part);
+
+    p = next + dlen;
+  }
+
+  g_free(delim);
+  return abort;
+}
+
+const struct serve_part *serve_find_part(GArray *parts, const char *name) {
+  guint i;
+
+  for (i = 0; name != NULL && i < parts->len; i++) {
+    if (strcmp(g_array_index(parts, struct serve_part, i).name, name) == 0)
+      return &g_array_index(parts, struct serve_part, i);
+  }
+
+  return NULL;
+}
+
+/*
+ * A field's value as a string (fields are not NUL terminated in the body).
+ */
+char *serve_part_value(GArray *parts, const char *name, const char *def) {
+  const struct serve_part *part = serve_find_part(parts, name);
+  return part != NULL ? g_strndup(part->data, part->len) : g_strdup(def);
+}
+
+/*
+ * Inflates a gzip'd content field (pastebinc -z gzip).  Returns NULL if it
+ * is broken or more than max bytes.
+ */
+char *serve_gunzip(const struct serve_part *part, size_t max, size_t *len) {
+  z_stream z;
+  size_t alloc = MAX(part->len * 4, 4096);
+  char *out = malloc(alloc);
+  int res = Z_OK;
+
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 16) != Z_OK) {
+    free(out);
+    return NULL;
+  }
+  z.next_in = (Bytef *) part->data;
+  z.avail_in = part->len;
+  *len = 0;
+
+  while (res == Z_OK && *len <= max) {
+    if (*len == alloc) {
+      alloc *= 2;
+      out = realloc(out, alloc);
+    }
+    z.next_out = (Bytef *) out + *len;
+    z.avail_out = alloc - *len;
+    res = inflate(&z, Z_NO_FLUSH);
+    *len = alloc - z.avail_out;
+  }
+  inflateEnd(&z);
+
+  if (res != Z_STREAM_END || *len > max) {
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+/*
+ * The body an answer to a post carries: the URL itself, or with a
+ * [response] json_pointer, a JSON document that has it there.
+ */
+GString *serve_post_body(struct serve_state *srv, const char *url) {
+  GString *body = g_string_new(NULL);
+  gchar **tokens;
+  int i, n;
+
+  if (srv->json_pointer == NULL || srv->json_pointer[0] != '/') {
+    g_string_append(body, url);
+    return body;
+  }
+
+  tokens = g_strsplit(srv->json_pointer + 1, "/", -1);
+  n = g_strv_length(tokens);
+  for (i = 0; i < n; i++)
+    g_string_append_printf(body, "{\"%s\":", tokens[i]);
+  g_string_append_printf(body, "\"%s\"", url);
+  for (i = 0; i < n; i++)
+    g_string_append_c(body, '}');
+  g_strfreev(tokens);
+
+  return body;
+}
+
+/*
+ * Takes a paste.  The answer is only queued once the paste is safely in the
+ * log: with syncing on, after the fdatasync at the end of this loop round.
+ */
+void serve_post(struct serve_state *srv, struct serve_conn *conn, const char *body, size_t len) {
+  GArray *parts = g_array_new(FALSE, TRUE, sizeof(struct serve_part));
+  const struct serve_part *content;
+  const struct conf_entry *entries;
+  uint32_t count, i;
+  char *boundary = NULL, *value, *title = NULL, *format = NULL, *expiration = NULL;
+  char *inflated = NULL, *url, *headers, *message = NULL;
+  const char *seconds;
+  size_t content_len;
+  uint64_t id;
+  GString *answer;
+
+  if (conn->content_type == NULL || g_ascii_strncasecmp(conn->content_type, "multipart/form-data", 19) != 0
+      || (boundary = serve_header_param(conn->content_type, "boundary")) == NULL
+      || serve_parse_form(body, len, boundary, parts)) {
+    serve_error(conn, 400, "Bad Request", "expected a multipart/form-data post");
+    goto done;
+  }
+
+  if ((content = serve_find_part(parts, srv->content_field)) == NULL) {
+    message = g_strdup_printf("no %s field", srv->content_field);
+    serve_error(conn, 400, "Bad Request", message);
+    goto done;
+  }
+
+  // static fields are things like API keys: they have to be right
+  entries = conf_group(srv->conf, "static_fields", &count);
+  for (i = 0; i < count; i++) {
+    const char *name = conf_str(srv->conf, entries[i].key);
+    value = serve_part_value(parts, name, NULL);
+    if (value == NULL || strcmp(value, conf_str(srv->conf, entries[i].value)) != 0) {
+      g_free(value);
+      message = g_strdup_printf("bad or missing %s", name);
+      serve_error(conn, 403, "Forbidden", message);
+      goto done;
+    }
+    g_free(value);
+  }
+
+  // user fields that list their values take only those
+  for (i = 0; i < parts->len; i++) {
+    const struct serve_part *part = &g_array_index(parts, struct serve_part, i);
+    const struct conf_entry *entry = conf_find(srv->conf, "user_fields", part->name);
+    int ok;
+
+    if (part == content || entry == NULL || entry->nvalues == 0)
+      continue;
+    value = g_strndup(part->data, part->len);
+    ok = conf_find_option(srv->conf, part->name, value) != NULL;
+    g_free(value);
+    if (!ok) {
+      message = g_strdup_printf("bad value for %s", part->name);
+      serve_error(conn, 400, "Bad Request", message);
+      goto done;
+    }
+  }
+
+  expiration = serve_part_value(parts, srv->expiration_field, "default");
+  if ((seconds = conf_get(srv->conf, "expiration_seconds", expiration)) == NULL && strcmp(expiration, "default") != 0) {
+    message = g_strdup_printf("unknown expiration %s", expiration);
+    serve_error(conn, 400, "Bad Request", message);
+    goto done;
+  }
+
+  content_len = content->len;
+  if (content->gzip && (inflated = serve_gunzip(content, srv->max_bytes, &content_len)) == NULL) {
+    serve_error(conn, 400, "Bad Request", "broken or too big gzip content");
+    goto done;
+  }
+  if (content_len > srv->max_bytes) {
+    serve_error(conn, 413, "Payload Too Large", "paste too big");
+    goto done;
+  }
+
+  title = serve_part_value(parts, srv->title_field, "");
+  format = serve_part_value(parts, srv->format_field, "");
+  id = serve_append(srv, title, format, inflated != NULL ? inflated : content->data, content_len,
+                    seconds != NULL ? g_ascii_strtoll(seconds, NULL, 10) : 0);
+  if (id == 0) {
+    serve_error(conn, 500, "Internal Server Error", "can not store the paste");
+    goto done;
+  }
+
+  if (srv->base_url != NULL)
+    url = g_strdup_printf("%s/p/%012" G_GINT64_MODIFIER "x", srv->base_url, id);
+  else
+    url = g_strdup_printf("http://%s/p/%012" G_GINT64_MODIFIER "x", conn->host != NULL ? conn->host : srv->listen, id);
+  if (srv->verbose)
+    fprintf(stderr, "DEBUG: %zu byte paste %s (expiration %s)\n", content_len, url, expiration);
+
+  answer = serve_post_body(srv, url);
+  if (srv->redirect) {
+    headers = g_strdup_printf("Location: %s\r\n", url);
+    serve_respond(conn, 302, "Found", headers, NULL, 0, 0);
+  } else {
+    headers = g_strdup_printf("Content-Type: %s\r\n%s%s%s%s", srv->json_pointer != NULL ? "application/json" : "text/plain",
+      srv->url_header != NULL ? srv->url_header : "", srv->url_header != NULL ? ": " : "",
+      srv->url_header != NULL ? url : "", srv->url_header != NULL ? "\r\n" : "");
+    serve_respond(conn, 200, "OK", headers, answer->str, answer->len, answer->len);
+  }
+  g_free(headers);
+  g_string_free(answer, TRUE);
+  g_free(url);
+
+  if (srv->sync) {
+    conn->syncing = 1;
+    g_ptr_array_add(srv->syncing, conn);
+  }
+
+done:
+  for (i = 0; i < parts->len; i++)
+    g_free(g_array_index(parts, struct serve_part, i).name);
+  g_array_free(parts, TRUE);
+  g_free(boundary);
+  g_free(title);
+  g_free(format);
+  g_free(expiration);
+  g_free(message);
+  free(inflated);
+}
+
+/*
+ * Sends a paste back: the headers from memory, the content straight from
+ * the log's page cache.
+ */
+void serve_get(struct serve_state *srv, struct serve_conn *conn, const char *hex) {
+  struct serve_paste *paste;
+  uint64_t id;
+  char *end;
+
+  id = g_ascii_strtoull(hex, &end, 16);
+  if (*end != 0 || (paste = g_hash_table_lookup(srv->index, &id)) == NULL) {
+    serve_error(conn, 404, "Not Found", "no such paste");
+    return;
+  }
+  if (paste->expires != 0 && paste->expires <= time(NULL)) {
+    g_hash_table_remove(srv->index, &id);
+    serve_error(conn, 404, "Not Found", "no such paste (expired)");
+    return;
+  }
+
+  serve_respond(conn, 200, "OK", "Content-Type: text/plain; charset=utf-8\r\n", NULL, 0, paste->len);
+  if (strcmp(conn->method, "HEAD") != 0) {
+    conn->file_pos = paste->content;
+    conn->file_left = paste->len;
+  }
+}
+
+/*
+ * Answers a complete request.
+ */
+void serve_request(struct serve_state *srv, struct serve_conn *conn, const char *body, size_t len) {
+  char *query = strchr(conn->path, '?');
+
+  if (query != NULL)
+    *query = 0;
+
+  if (strcmp(conn->method, "POST") == 0 && strcmp(conn->path, srv->post_path) == 0) {
+    serve_post(srv, conn, body, len);
+  } else if ((strcmp(conn->method, "GET") == 0 || strcmp(conn->method, "HEAD") == 0)
+             && strncmp(conn->path, "/p/", 3) == 0) {
+    serve_get(srv, conn, conn->path + 3);
+  } else if (strcmp(conn->method, "HEAD") == 0 && strcmp(conn->path, srv->post_path) == 0) {
+    // pastebinc's connection warm-up
+    serve_respond(conn, 200, "OK", NULL, NULL, 0, 0);
+  } else if (strcmp(conn->path, srv->post_path) == 0) {
+    serve_error(conn, 405, "Method Not Allowed", "post pastes here");
+  } else {
+    serve_error(conn, 404, "Not Found", "not found");
+  }
+}
+
+/*
+ * Forgets the request that was just answered, keeping whatever of the next
+ * one (pipelined) came in after it.
+ */
+void serve_next_request(struct serve_conn *conn, size_t used) {
+  memmove(conn->in, conn->in + used, conn->in_len - used);
+  conn->in_len -= used;
+  conn->head_len = 0;
+  conn->method[0] = 0;
+  conn->content_length = 0;
+  conn->chunked = 0;
+  g_free(conn->path);
+  g_free(conn->host);
+  g_free(conn->content_type);
+  conn->path = conn->host = conn->content_type = NULL;
+  if (conn->body != NULL)
+    g_string_free(conn->body, TRUE);
+  conn->body = NULL;
+}
+
+/*
+ * Parses the request line and headers once in holds all of them.  Returns
+ * 0 if the head is not complete yet, 1 if it is parsed, -1 if it is bad
+ * (an error answer has then been queued).
+ */
+int serve_parse_head(struct serve_state *srv, struct serve_conn *conn) {
+  char *end = memmem(conn->in, conn->in_len, "\r\n\r\n", 4);
+  char *line, *next, *sp, *version;
+  int http10;
+
+  if (end == NULL) {
+    if (conn->in_len > SERVE_HEAD_MAX) {
+      conn->keep_alive = 0;
+      serve_error(conn, 431, "Request Header Fields Too Large", "request head too big");
+      serve_next_request(conn, conn->in_len);
+      return -1;
+    }
+    return 0;
+  }
+  *end = 0;
+  conn->head_len = end + 4 - conn->in;
+
+  // request line: METHOD path HTTP/1.x
+  next = strstr(conn->in, "\r\n");
+  if (next != NULL)
+    *next = 0;
+  sp = strchr(conn->in, ' ');
+  version = sp != NULL ? strrchr(sp + 1, ' ') : NULL;
+  if (sp == NULL || version == NULL || version == sp || sp - conn->in >= sizeof(conn->method)) {
+    conn->keep_alive = 0;
+    serve_error(conn, 400, "Bad Request", "bad request line");
+    serve_next_request(conn, conn->in_len);
+    return -1;
+  }
+  memcpy(conn->method, conn->in, sp - conn->in);
+  conn->method[sp - conn->in] = 0;
+  conn->path = g_strndup(sp + 1, version - sp - 1);
+  http10 = strcmp(version + 1, "HTTP/1.0") == 0;
+  conn->keep_alive = !http10;
+
+  for (line = next != NULL ? next + 2 : end; line < end; line = next + 2) {
+    char *value;
+
+    if ((next = strstr(line, "\r\n")) == NULL)
+      next = end;
+    *next = 0;
+    if ((value = strchr(line, ':')) == NULL)
+      continue;
+    *value++ = 0;
+    while (*value == ' ' || *value == '\t')
+      value++;
+
+    if (g_ascii_strcasecmp(line, "Host") == 0) {
+      g_free(conn->host);
+      conn->host = g_strdup(value);
+    } else if (g_ascii_strcasecmp(line, "Content-Type") == 0) {
+      g_free(conn->content_type);
+      conn->content_type = g_strdup(value);
+    } else if (g_ascii_strcasecmp(line, "Content-Length") == 0) {
+      conn->content_length = g_ascii_strtoull(value, NULL, 10);
+    } else if (g_ascii_strcasecmp(line, "Transfer-Encoding") == 0) {
+      conn->chunked = g_ascii_strcasecmp(value, "chunked") == 0;
+    } else if (g_ascii_strcasecmp(line, "Connection") == 0) {
+      if (g_ascii_strcasecmp(value, "close") == 0)
+        conn->keep_alive = 0;
+      else if (g_ascii_strcasecmp(value, "keep-alive") == 0)
+        conn->keep_alive = 1;
+    } else if (g_ascii_strcasecmp(line, "Expect") == 0 && g_ascii_strcasecmp(value, "100-continue") == 0) {
+      g_string_append(conn->out, "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+  }
+
+  if (conn->content_length > srv->max_bytes + SERVE_FORM_OVERHEAD) {
+    conn->keep_alive = 0;
+    serve_error(conn, 413, "Payload Too Large", "paste too big");
+    serve_next_request(conn, conn->in_len);
+    return -1;
+  }
+
+  conn->chunk_pos = conn->head_len;
+  if (conn->chunked)
+    conn->body = g_string_new(NULL);
+  return 1;
+}
+
+/*
+ * Decodes as many whole chunks of a chunked body as have arrived, and
+ * drops them from in.  Returns 1 once the last chunk (and any trailers) is
+ * in, 0 if more is needed, -1 if the body is bad and -2 if it is too big.
+ */
+int serve_dechunk(struct serve_state *srv, struct serve_conn *conn) {
+  char *p = conn->in + conn->chunk_pos;
+  char *end = conn->in + conn->in_len;
+  int done = 0;
+
+  while (!done) {
+    char *eol = memmem(p, end - p, "\r\n", 2);
+    char *stop;
+    size_t size;
+
+    if (eol == NULL)
+      break;
+    size = strtoul(p, &stop, 16);
+    if (stop == p)
+      return -1;
+
+    if (size == 0) {
+      // trailers, then an empty line
+      char *last = eol;
+      while (last != NULL && last + 4 <= end && memcmp(last, "\r\n\r\n", 4) != 0)
+        last = memmem(last + 2, end - last - 2, "\r\n", 2);
+      if (last == NULL || last + 4 > end)
+        break;
+      p = last + 4;
+      done = 1;
+    } else {
+      // checked before the chunk is all in, or in could grow past the limit
+      if (size > srv->max_bytes + SERVE_FORM_OVERHEAD - conn->body->len)
+        return -2;
+      if ((size_t) (end - eol) < size + 4)
+        break;
+      g_string_append_len(conn->body, eol + 2, size);
+      p = eol + 2 + size + 2;
+    }
+  }
+
+  // keep in small: only the head and what is not decoded yet stay
+  memmove(conn->in + conn->head_len, p, end - p);
+  conn->in_len = conn->head_len + (end - p);
+  conn->chunk_pos = conn->head_len;
+  return done;
+}
+
+void serve_close(struct serve_state *srv, struct serve_conn *conn) {
+  if (conn->syncing)
+    g_ptr_array_remove(srv->syncing, conn);
+  epoll_ctl(srv->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  serve_next_request(conn, conn->in_len);
+  free(conn->in);
+  g_string_free(conn->out, TRUE);
+  free(conn);
+}
+
+/*
+ * Waits for readable (nothing to send) or writable (an answer to send).
+ */
+void serve_watch(struct serve_state *srv, struct serve_conn *conn) {
+  struct epoll_event ev;
+
+  ev.events = conn->out->len > conn->out_pos || conn->file_left > 0 ? EPOLLOUT : EPOLLIN;
+  ev.data.ptr = conn;
+  epoll_ctl(srv->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/*
+ * Handles every complete request in in, as long as there is no answer
+ * still waiting to go out.
+ */
+void serve_process(struct serve_state *srv, struct serve_conn *conn) {
+  while (!conn->syncing && conn->out->len == conn->out_pos && conn->file_left == 0) {
+    int res;
+
+    // on errors the answer goes out, then the connection is closed
+    if (conn->head_len == 0 && serve_parse_head(srv, conn) <= 0)
+      return;
+
+    if (conn->chunked) {
+      if ((res = serve_dechunk(srv, conn)) == 0)
+        return;
+      if (res < 0) {
+        conn->keep_alive = 0;
+        if (res == -2)
+          serve_error(conn, 413, "Payload Too Large", "paste too big");
+        else
+          serve_error(conn, 400, "Bad Request", "bad chunked body");
+        serve_next_request(conn, conn->in_len);
+        return;
+      }
+      serve_request(srv, conn, conn->body->str, conn->body->len);
+      serve_next_request(conn, conn->head_len);
+    } else {
+      if (conn->in_len - conn->head_len < conn->content_length)
+        return;
+      serve_request(srv, conn, conn->in + conn->head_len, conn->content_length);
+      serve_next_request(conn, conn->head_len + conn->content_length);
+    }
+  }
+}
+
+/*
+ * Sends as much of the answer as the socket takes.  Returns -1 on errors or
+ * when the connection is done.
+ */
+int serve_flush(struct serve_state *srv, struct serve_conn *conn) {
+  ssize_t n;
+
+  while (!conn->syncing && (conn->out_pos < conn->out->len || conn->file_left > 0)) {
+    while (conn->out_pos < conn->out->len) {
+      if ((n = send(conn->fd, conn->out->str + conn->out_pos, conn->out->len - conn->out_pos, MSG_NOSIGNAL)) == -1)
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+      conn->out_pos += n;
+    }
+
+    while (conn->file_left > 0) {
+      if ((n = sendfile(conn->fd, srv->log_fd, &conn->file_pos, conn->file_left)) == -1)
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+      if (n == 0)
+        return -1; // the log is shorter than the index says
+      conn->file_left -= n;
+    }
+
+    g_string_truncate(conn->out, 0);
+    conn->out_pos = 0;
+    // a 100 Continue goes out while the request is still coming in
+    if (conn->head_len == 0 && !conn->keep_alive)
+      return -1;
+
+    // on to any pipelined request
+    serve_process(srv, conn);
+  }
+
+  return 0;
+}
+
+/*
+ * Reads what there is.  Returns -1 when the connection is to be closed.
+ */
+int serve_read(struct serve_state *srv, struct serve_conn *conn) {
+  ssize_t n;
+
+  // each read is handled before the next, so a chunked body is decoded (and
+  // dropped from in) as it comes, and a bad head is caught early
+  do {
+    if (conn->in_alloc - conn->in_len < SERVE_READ_CHUNK) {
+      conn->in_alloc = MAX(conn->in_alloc * 2, conn->in_len + SERVE_READ_CHUNK);
+      conn->in = realloc(conn->in, conn->in_alloc);
+    }
+    n = recv(conn->fd, conn->in + conn->in_len, conn->in_alloc - conn->in_len, 0);
+    if (n == 0)
+      return -1;
+    if (n == -1)
+      return errno == EAGAIN || errno == EINTR ? serve_flush(srv, conn) : -1;
+    conn->in_len += n;
+    serve_process(srv, conn);
+  } while (conn->out->len == 0 && conn->file_left == 0 && !conn->syncing);
+
+  return serve_flush(srv, conn);
+}
+
+void serve_accept(struct serve_state *srv, int listener) {
+  struct epoll_event ev;
+  struct serve_conn *conn;
+  int fd, one = 1;
+
+  while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    conn = calloc(1, sizeof(struct serve_conn));
+    conn->fd = fd;
+    conn->out = g_string_new(NULL);
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+/*
+ * Opens the listening socket on host:port.
+ */
+int serve_listen(struct serve_state *srv) {
+  struct addrinfo hints, *res, *ai;
+  char *host = g_strdup(srv->listen);
+  char *port = strrchr(host, ':');
+  int fd = -1, one = 1, err;
+
+  if (port == NULL) {
+    fprintf(stderr, "ERROR: bad listen address '%s' (use host:port)\n", srv->listen);
+    g_free(host);
+    return -1;
+  }
+  *port++ = 0;
+  if (host[0] == '[' && host[strlen(host) - 1] == ']') { // [::1]:8080
+    memmove(host, host + 1, strlen(host));
+    host[strlen(host) - 1] = 0;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ((err = getaddrinfo(host[0] != 0 ? host : NULL, port, &hints, &res)) != 0) {
+    fprintf(stderr, "ERROR: Can not resolve %s: %s\n", srv->listen, gai_strerror(err));
+    g_free(host);
+    return -1;
+  }
+
+  for (ai = res; ai != NULL && fd == -1; ai = ai->ai_next) {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol)) == -1)
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 || listen(fd, SOMAXCONN) == -1) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd == -1)
+    fprintf(stderr, "ERROR: Can not listen on %s: %s\n", srv->listen, strerror(errno));
+
+  freeaddrinfo(res);
+  g_free(host);
+  return fd;
+}
+
+/*
+ * Runs the server until it is killed.
+ */
+int serve_run(struct serve_state *srv, int listener) {
+  struct epoll_event ev, events[SERVE_EVENTS];
+  int n, i;
+
+  srv->epfd = epoll_create1(EPOLL_CLOEXEC);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(srv->epfd, EPOLL_CTL_ADD, listener, &ev);
+
+  if (srv->verbose)
+    fprintf(stderr, "DEBUG: listening on %s, pastes are posted to %s\n", srv->listen, srv->post_path);
+
+  for (;;) {
+    if ((n = epoll_wait(srv->epfd, events, SERVE_EVENTS, -1)) == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "ERROR: epoll_wait: %s\n", strerror(errno));
+      return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+      struct serve_conn *conn = events[i].data.ptr;
+      int res;
+
+      if (conn == NULL) {
+        serve_accept(srv, listener);
+        continue;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN))
+        res = -1;
+      else if (events[i].events & EPOLLOUT)
+        res = serve_flush(srv, conn);
+      else
+        res = serve_read(srv, conn);
+
+      if (res < 0)
+        serve_close(srv, conn);
+      else
+        serve_watch(srv, conn);
+    }
+
+    // one fdatasync for every paste taken this round, then their answers
+    if (srv->syncing->len > 0) {
+      if (fdatasync(srv->log_fd) == -1)
+        fprintf(stderr, "ERROR: Can not sync the paste log: %s\n", strerror(errno));
+      while (srv->syncing->len > 0) {
+        struct serve_conn *conn = g_ptr_array_remove_index_fast(srv->syncing, srv->syncing->len - 1);
+        conn->syncing = 0;
+        if (serve_flush(srv, conn) < 0)
+          serve_close(srv, conn);
+        else
+          serve_watch(srv, conn);
+      }
+    }
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct serve_state srv;
+  const char *log = SERVE_LOG;
+  const char *url, *p;
+  char *conffile;
+  int c, listener;
+
+  memset(&srv, 0, sizeof(srv));
+  srv.max_bytes = SERVE_MAX_BYTES;
+  srv.sync = 1;
+  opterr = 0;
+
+  while ((c = getopt(argc, argv, "l:d:u:rm:nvh")) != -1) {
+    switch (c) {
+      case 'l':
+        srv.listen = g_strdup(optarg);
+        break;
+      case 'd':
+        log = optarg;
+        break;
+      case 'u':
+        srv.base_url = g_strdup(optarg);
+        if (g_str_has_suffix(srv.base_url, "/"))
+          srv.base_url[strlen(srv.base_url) - 1] = 0;
+        break;
+      case 'r':
+        srv.redirect = 1;
+        break;
+      case 'm':
+        if (parse_size(optarg, &srv.max_bytes) || srv.max_bytes == 0) {
+          fprintf(stderr, "ERROR: bad size for -m: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'n':
+        srv.sync = 0;
+        break;
+      case 'v':
+        srv.verbose = 1;
+        break;
+      case 'h':
+        serve_usage();
+        return 0;
+      default:
+        fprintf(stderr, "ERROR: unknown option -%c\n", optopt);
+        serve_usage();
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1) {
+    serve_usage();
+    return 1;
+  }
+
+  // a provider name, or the path of its config file
+  if (strchr(argv[optind], '/') != NULL || g_str_has_suffix(argv[optind], ".conf"))
+    conffile = g_strdup(argv[optind]);
+  else
+    conffile = g_strdup_printf("%s/%s.conf", CONFDIR, argv[optind]);
+  if ((srv.conf = conf_load(conffile, srv.verbose)) == NULL) {
+    fprintf(stderr, "ERROR: Can not load config file: %s\n", conffile);
+    return 1;
+  }
+  g_free(conffile);
+
+  if ((url = conf_get(srv.conf, "server", "url")) == NULL || (p = strstr(url, "://")) == NULL) {
+    fprintf(stderr, "ERROR: the provider has no [server] url\n");
+    return 1;
+  }
+  p += 3;
+  srv.post_path = g_strdup(strchr(p, '/') != NULL ? strchr(p, '/') : "/");
+  if (strchr(srv.post_path, '?') != NULL)
+    *strchr(srv.post_path, '?') = 0;
+  if (srv.listen == NULL) {
+    char *hostport = g_strndup(p, strcspn(p, "/?"));
+    srv.listen = strchr(hostport, ':') != NULL && hostport[strlen(hostport) - 1] != ']'
+      ? hostport : g_strdup_printf("%s:%s", hostport, g_str_has_prefix(url, "https") ? "443" : "80");
+    if (srv.listen != hostport)
+      g_free(hostport);
+  }
+
+  srv.content_field = conf_get(srv.conf, "fieldnames", "content");
+  srv.title_field = conf_get(srv.conf, "fieldnames", "title");
+  srv.expiration_field = conf_get(srv.conf, "standard_field_names", "expiration");
+  srv.format_field = conf_get(srv.conf, "standard_field_names", "format");
+  srv.url_header = conf_get(srv.conf, "response", "header");
+  srv.json_pointer = conf_get(srv.conf, "response", "json_pointer");
+  if (srv.content_field == NULL) {
+    fprintf(stderr, "ERROR: the provider has no [fieldnames] content\n");
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  srv.index = g_hash_table_new_full(g_int64_hash, g_int64_equal, free, free);
+  srv.syncing = g_ptr_array_new();
+  if (serve_load_log(&srv, log) || (listener = serve_listen(&srv)) == -1)
+    return 1;
+
+  return serve_run(&srv, listener);
+}
@@ -14,305 +14,213 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
-#include <errno.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <string.h>
-
-#include <glib.h>
-#include <curl/curl.h>
-
-#ifndef PROGNAME
-#define PROGNAME "pastebinc"
-#endif
-
-#ifndef CONFDIR
-#define CONFDIR "./etc"
-#endif
-
-#ifndef CONFFILE
-#define CONFFILE "pastebinc.conf"
-#endif
-
-#ifndef VERSION
-#define VERSION "0.9"
-#endif
-
-#define BSIZE (8 * 1024)
-#define TMPNAME "/tmp/pastebinc.XXXXXX"
-#define TMPNAMELEN 22
-
-typedef struct user_field {
-  char *name;
-  char *value;
-  struct user_field *next;
-} t_user_field;
-
-typedef struct user_field_option {
-  char *name;
-  struct user_field_option_value *values;
-  struct user_field_option *next;
-} t_user_field_option;
-
-typedef struct user_field_option_value {
-  char *user_value;
-  char *post_value;
-  struct user_field_option_value *next;
-} t_user_field_option_value;
-
-struct pastebinc_config {
-  char *name;
-  int verbose;
-  int tee;
-  int bypass_proxy;
-  char *provider;
-  t_user_field_option *user_field_options;
-  t_user_field *user_fields;
-  GKeyFile *keyfile;
-};
-
-struct http_response {
-  char *body;
-  size_t body_size;
-  char *location;
-};
-
-struct paste_info {
-  char tmpname[TMPNAMELEN];
-  FILE *content;
-  int fd;
-};
+#include "pastebinc-internal.h"
+
+int get_configuration(struct pastebinc_config *config, int argc, char *argv[]);
+void display_usage(struct pastebinc_config *config, int show_extended);
 
 int main(int argc, char *argv[]) {
   struct paste_info pi;
   struct pastebinc_config config;
+  struct stat st;
+  gint64 started = g_get_monotonic_time();
   int abort = 0;
+  int configured;
+
+  pi.tmpname[0] = 0;
+  pi.fd = -1;
+  pi.content = NULL;
+  pi.tee = 0;
+  pi.bytes_read = 0;
+  pi.prefix = NULL;
+  pi.prefix_len = 0;
+  pi.gz = NULL;
+  pi.redact = NULL;
+  pi.normalize = NULL;
+  pi.crypt = NULL;
+  xxh64_init(&pi.hash);
 
   abort = get_configuration(&config, argc, argv);
+  configured = !abort;
+  config.stats.start = started;
+  config.stats.config_done = g_get_monotonic_time();
 
-  if (!abort && isatty(fileno(stdin))) {
-    fprintf(stderr, "ERROR: You must pipe data into " PROGNAME "\n");
-    display_usage(&config, 0);
-    abort = 1;
-  }
-
-  if (!abort && write_input_to_paste_info(&config, &pi))
-    abort = 1;
-
-  if (!abort)
-    abort = pastebin_post(&config, &pi);
-
-  // TODO: do I need to free the memory held by pi? or other variables?
-  unlink(pi.tmpname);
-  close(pi.fd);
-
-  if (config.keyfile)
-    g_key_file_free(config.keyfile);
-
-  return abort ? 1 : 0;
-}
+  curl_global_init(CURL_GLOBAL_ALL);
 
-/*
- * Takes stdin input and writes it to a temporary file that will be used
- * to post to a pastebin site.  Fills paste_info with the appropriate info
- * about what it did (file path and pointer to written file).
- */
-int write_input_to_paste_info(struct pastebinc_config *config, struct paste_info *pi) {
-  int readval;
-  char *buf;
+  // addresses and TLS sessions earlier runs saved (net_cache=1); the daemon
+  // and the outbox keep connections of their own
+  if (!abort && !config.daemon && !config.flush && !config.async)
+    net_cache_load(&config);
+
+  if (!abort && config.daemon) {
+    abort = run_daemon(&config);
+  } else if (!abort && config.flush) {
+    abort = outbox_flush(&config, -1);
+  } else if (!abort && config.fetch != NULL) {
+    abort = pastebin_fetch(&config);
+  } else if (!abort && config.batch_count > 0) {
+    config.stats.post_start = g_get_monotonic_time();
+    abort = pastebin_post_batch(&config);
+    config.stats.post_done = g_get_monotonic_time();
+  } else if (!abort) {
+    if (isatty(fileno(stdin))) {
+      fprintf(stderr, "ERROR: You must pipe data into " PROGNAME "\n");
+      display_usage(&config, 0);
+      abort = 1;
+    }
 
-  strcpy(pi->tmpname, TMPNAME);
+    // reading and posting overlap unless the input gets spooled first
+    config.stats.post_start = g_get_monotonic_time();
+
+    if (!abort && config.use_daemon) {
+      abort = daemon_client_post(&config);
+    } else if (!abort && config.follow) {
+      abort = pastebin_follow(&config);
+    } else if (!abort && config.record) {
+      abort = pastebin_record(&config);
+    } else if (!abort && config.stream) {
+      // no tmp file: curl pulls the content straight from stdin as it uploads
+      pi.fd = STDIN_FILENO;
+      pi.tee = config.tee;
+    } else if (!abort) {
+      // connect to the provider while the input is read, not after (unless
+      // the paste only goes to the outbox)
+      if (!config.async)
+        warmup_start(&config);
+      config.stats.input_start = g_get_monotonic_time();
+      abort = write_input_to_paste_info(&config, &pi);
+      config.stats.input_done = g_get_monotonic_time();
+      config.stats.post_start = config.stats.input_done;
+      // before the post, which may read the tmp file through pi again
+      config.stats.bytes_in = pi.bytes_read;
+    }
 
-  if ((pi->fd = mkstemp(pi->tmpname)) == -1 || (pi->content = fdopen(pi->fd, "w+")) == NULL) {
-    if (pi->fd != -1) {
-      unlink(pi->tmpname);
-      close(pi->fd);
+    if (abort || config.use_daemon || config.follow || config.record) {
+      // already posted (or failed)
+    } else if (config.async) {
+      abort = outbox_commit(&config, &pi);
+    } else if (!config.stream && dedupe_lookup(&config, &pi)) {
+      // this exact paste is still up, its URL has been printed
+    } else if (!config.stream && config.max_paste_bytes > 0
+        && fstat(pi.fd, &st) == 0 && st.st_size > config.max_paste_bytes) {
+      if (config.encrypt) {
+        // each part would need a key of its own in the index
+        fprintf(stderr, "ERROR: the input is bigger than max_paste_bytes (%zu) and encrypted pastes are not split\n",
+          config.max_paste_bytes);
+        abort = 1;
+      } else {
+        abort = pastebin_post_split(&config, &pi, st.st_size);
+      }
+    } else {
+      abort = pastebin_post(&config, &pi);
     }
-    fprintf(stderr, "Error opening tmp file (%s): %s\n", pi->tmpname, strerror(errno));
-    return 1;
+    config.stats.post_done = g_get_monotonic_time();
+    warmup_finish(&config);
+
+    if (config.stream)
+      config.stats.bytes_in = pi.bytes_read;
   }
 
-  if (config->verbose)
-    fprintf(stderr, "DEBUG: Writing to tmp file: %s\n", pi->tmpname);
+  if (configured && config.stats_format != NULL && !config.daemon)
+    print_stats(&config);
 
-  if ((buf = malloc((u_int)BSIZE)) == NULL) {
-    fprintf(stderr, "Error allocating %d memory for stdin read buffer: %s\n", ((u_int)BSIZE), strerror(errno));
-    return 1;
+  // TODO: do I need to free the memory held by pi? or other variables?
+  if (pi.tmpname[0]) {
+    unlink(pi.tmpname);
+    close(pi.fd);
   }
 
-  while ((readval = read(STDIN_FILENO, buf, BSIZE)) > 0)
-  {
-    if (config->tee)
-      fprintf(stdout, "%s", buf);
+  config_free(&config);
 
-    if (write(pi->fd, buf, readval) == -1)
-    {
-      fprintf(stderr, "Error writing to tmp file: %s", strerror(errno));
-      return 1;
-    }
-  }
+  curl_global_cleanup();
 
-  return 0;
+  return abort ? 1 : 0;
 }
 
 /*
- * Callback for curl that uses the http_response structure to build the response
- * of the HTTP post into a char array.
+ * Parses a follow window spec: a comma separated list of limits, each a
+ * size ("64k"), a number of lines ("100l") or a time ("5s", "500ms").
  */
-size_t http_resp_body_data_received(void *buffer, size_t size, size_t nmemb, void *userp) {
-  size_t realsize = size * nmemb;
-  struct http_response *resp = (struct http_response *) userp;
-
-  resp->body = realloc(resp->body, resp->body_size + realsize + 1);
-  if (resp->body == NULL) {
-    fprintf(stderr, "not enough memory to buffer pastebin response (realloc returned NULL)\n");
-    exit(1);
+int parse_window_spec(struct pastebinc_config *config, char *spec) {
+  char *item;
+
+  for (item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+    size_t len = strlen(item);
+
+    if (len > 2 && strcmp(item + len - 2, "ms") == 0) {
+      config->window_ms = atoi(item);
+    } else if (len > 1 && item[len - 1] == 's') {
+      config->window_ms = atoi(item) * 1000;
+    } else if (len > 1 && item[len - 1] == 'l') {
+      config->window_lines = strtoul(item, NULL, 10);
+    } else if (parse_size(item, &config->window_bytes) || config->window_bytes == 0) {
+      fprintf(stderr, "ERROR: bad window limit '%s' (use e.g. 64k, 100l, 5s or 500ms)\n", item);
+      return 1;
+    }
   }
 
-  memcpy(&(resp->body[resp->body_size]), buffer, realsize);
-  resp->body_size += realsize;
-  resp->body[resp->body_size] = 0;
-
-  return realsize;
+  return 0;
 }
 
 /*
- * Callback for curl that uses the http_response structure to save the location header
- * if one is sent.
+ * Parses one side of a -k spec: a size ("64k") or a number of lines ("100l").
  */
-size_t http_resp_header_received(void *buffer, size_t size, size_t nmemb, void *userp) {
-  struct http_response *resp = (struct http_response *) userp;
-  int loclen;
-
-  if (memcmp(buffer, "Location:", 9) == 0) {
-    loclen = strlen(buffer) - 12; // "Location: " plus the trailing newline and final null
-    resp->location = (char *) malloc(loclen + 1);
-    memcpy(resp->location, buffer + 10, loclen);
-    resp->location[loclen] = 0;
+int parse_keep_limit(const char *item, size_t *limit, int *lines) {
+  size_t len = strlen(item);
+  char *end;
+
+  if (len > 1 && item[len - 1] == 'l') {
+    *lines = 1;
+    *limit = strtoul(item, &end, 10);
+    return end != item + len - 1;
   }
 
-  return size * nmemb;
+  return parse_size(item, limit);
 }
 
 /*
- * Post the content contained within paste_info to the appropriate site (from config)
+ * Parses a -k spec: "head:tail", for what to keep of the input's start and
+ * end.  Either can be 0.
  */
-int pastebin_post(struct pastebinc_config *config, struct paste_info *pi) {
-  struct http_response resp;
-  char *paste_url = NULL;
-  resp.body = malloc(1);
-  resp.body_size = 0;
-  resp.location = malloc(1);
-
-  CURL *curl;
-  CURLcode res;
-  struct curl_httppost *post = NULL;
-  struct curl_httppost *last = NULL;
-  struct curl_slist *headers = NULL;
-  long http_resp_code = 0;
-  long curl_code;
-  int abort = 0;
-
-  char *url = g_key_file_get_string(config->keyfile, "server", "url", NULL);
-  char *content_fieldname = g_key_file_get_string(config->keyfile, "fieldnames", "content", NULL);
-  char *title_fieldname = g_key_file_get_string(config->keyfile, "fieldnames", "title", NULL);
-
-  // don't want to have the curl default "Expect: 100" header, so we override it:
-  headers = curl_slist_append(headers, "Expect:");
-
-  curl_global_init(CURL_GLOBAL_ALL);
-
-  curl_formadd(&post, &last, CURLFORM_COPYNAME, title_fieldname, CURLFORM_COPYCONTENTS, config->name, CURLFORM_END);
-  curl_formadd(&post, &last, CURLFORM_COPYNAME, content_fieldname, CURLFORM_FILECONTENT, pi->tmpname, CURLFORM_END);
-
-  // add static fields to request:
-  if (g_key_file_has_group(config->keyfile, "static_fields")) {
-    gchar** static_fields = NULL;
-    gchar** field = NULL;
+int parse_keep_spec(struct pastebinc_config *config, char *spec) {
+  char *tail = strchr(spec, ':');
 
-    static_fields = g_key_file_get_keys(config->keyfile, "static_fields", NULL, NULL);
-    field = static_fields;
-    while (*field != NULL) {
-      gchar* value = g_key_file_get_string(config->keyfile, "static_fields", *field, NULL);
-      curl_formadd(&post, &last, CURLFORM_COPYNAME, *field, CURLFORM_COPYCONTENTS, value, CURLFORM_END);
-      if (config->verbose)
-        fprintf(stderr, "DEBUG: adding static form field: %s = %s\n", *field, value);
+  if (tail != NULL)
+    *tail++ = 0;
 
-      field++;
-    }
-    g_strfreev(static_fields);
+  if (tail == NULL || parse_keep_limit(spec, &config->keep_head, &config->keep_head_lines)
+      || parse_keep_limit(tail, &config->keep_tail, &config->keep_tail_lines)) {
+    fprintf(stderr, "ERROR: bad -k spec (use head:tail, e.g. 1m:1m or 100l:500l)\n");
+    return 1;
   }
 
-  if (config->user_fields != NULL) {
-    t_user_field *uf = config->user_fields;
-    while (uf) {
-      if (config->verbose)
-        fprintf(stderr, "DEBUG: adding user field to curl: %s = %s\n", uf->name, uf->value);
-      curl_formadd(&post, &last, CURLFORM_COPYNAME, uf->name, CURLFORM_COPYCONTENTS, uf->value, CURLFORM_END);
-      uf = uf->next;
-    }
-  }
+  config->keep = 1;
+  return 0;
+}
 
-  curl = curl_easy_init();
-  if (curl) {
-    if (config->verbose)
-      fprintf(stderr,
-        "DEBUG: Posting to: %s\n"
-        "DEBUG: content fieldname: %s\n"
-        "DEBUG: title fieldname: %s\n",
-        url, content_fieldname, title_fieldname);
-
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_HTTPPOST, post);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&resp);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &http_resp_body_data_received);
-    curl_easy_setopt(curl, CURLOPT_WRITEHEADER, (void *)&resp);
-    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &http_resp_header_received);
-
-    if (config->bypass_proxy)
-      curl_easy_setopt(curl, CURLOPT_NOPROXY, "*");
-
-    res = curl_easy_perform(curl);
-
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_resp_code);
-    if (http_resp_code == 302) { // this provider uses a redirect to the paste
-      paste_url = resp.location;
-    } else if (http_resp_code != 200 || curl_code == CURLE_ABORTED_BY_CALLBACK) {
-      abort = 1; // call failed
-      fprintf(stderr, "ERROR: server response was %ld\n", http_resp_code);
-      if (config->verbose) {
-        fprintf(stderr, "DEBUG: Contents of response were: \n%s\n", resp.body);
-      }
+/*
+ * Parses a -N spec: a comma separated list of the normalization stages to
+ * run the input through.
+ */
+int parse_normalize_spec(struct pastebinc_config *config, char *spec) {
+  char *item;
+
+  for (item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+    if (strcmp(item, "utf8") == 0) {
+      config->normalize = (config->normalize & ~NORMALIZE_UTF8_FIX) | NORMALIZE_UTF8;
+    } else if (strcmp(item, "utf8fix") == 0) {
+      config->normalize = (config->normalize & ~NORMALIZE_UTF8) | NORMALIZE_UTF8_FIX;
+    } else if (strcmp(item, "ansi") == 0) {
+      config->normalize |= NORMALIZE_ANSI;
+    } else if (strcmp(item, "crlf") == 0) {
+      config->normalize |= NORMALIZE_CRLF;
     } else {
-      paste_url = resp.body;
+      fprintf(stderr, "ERROR: unknown normalization '%s' (use utf8, utf8fix, ansi or crlf)\n", item);
+      return 1;
     }
-
-    fprintf(stderr, (config->verbose || paste_url == NULL ? "Paste URL: %s\n" : "%s\n"), paste_url);
-
-    if (paste_url == NULL)
-      abort = 1; // failed
-
-    curl_easy_cleanup(curl);
-    curl_formfree(post);
-  } else {
-    fprintf(stderr, "Error initializing curl: %s\n", strerror(errno));
-    return 1;
   }
 
-  if(resp.body)
-    free(resp.body);
-
-  if (resp.location)
-    free(resp.location);
-
-  curl_global_cleanup();
-
-  return abort;
+  return 0;
 }
 
 /*
@@ -327,23 +235,19 @@ int get_configuration(struct pastebinc_config *config, int argc, char *argv[]) {
   opterr = 0;
   char *expiration = NULL;
   char *format = NULL;
+  char *manifest = NULL;
+  const char *base;
 
-  config->tee = 0;
-  config->verbose = 0;
-  config->bypass_proxy = 0;
-  config->name = NULL;
-  config->user_fields = NULL;
-  config->provider = NULL;
-  config->keyfile = NULL;
-  config->user_field_options = NULL;
+  config_init(config);
 
-  t_user_field *last_user_field = config->user_fields;
-
-  while ((c = getopt(argc, argv, "tvn:p:d:x:f:bBhH")) != -1) {
+  while ((c = getopt(argc, argv, "tsvn:p:d:x:f:j:m:z:Fw:k:N:R:T:uS:DcaAEg:bBhH")) != -1) {
     switch (c) {
       case 't':
         config->tee = 1;
         break;
+      case 's':
+        config->stream = 1;
+        break;
       case 'v':
         config->verbose = 1;
         break;
@@ -354,7 +258,8 @@ int get_configuration(struct pastebinc_config *config, int argc, char *argv[]) {
         config->provider = optarg;
         break;
       case 'd':
-        add_user_field(config, strtok(optarg, "="), strtok(NULL, "="));
+        if (add_user_field_spec(config, optarg))
+          return 1;
         break;
       case 'x':
         expiration = optarg;
@@ -362,6 +267,72 @@ int get_configuration(struct pastebinc_config *config, int argc, char *argv[]) {
       case 'f':
         format = optarg;
         break;
+      case 'j':
+        config->parallel = atoi(optarg);
+        if (config->parallel < 1) {
+          fprintf(stderr, "ERROR: -j needs a number of parallel uploads of at least 1\n");
+          return 1;
+        }
+        break;
+      case 'm':
+        manifest = optarg;
+        break;
+      case 'z':
+        config->compression = optarg;
+        break;
+      case 'S':
+        if (strcmp(optarg, "text") != 0 && strcmp(optarg, "json") != 0) {
+          fprintf(stderr, "ERROR: unknown stats format '%s' (use text or json)\n", optarg);
+          return 1;
+        }
+        config->stats_format = optarg;
+        break;
+      case 'F':
+        config->follow = 1;
+        break;
+      case 'w':
+        if (parse_window_spec(config, optarg))
+          return 1;
+        break;
+      case 'k':
+        if (parse_keep_spec(config, optarg))
+          return 1;
+        break;
+      case 'N':
+        if (parse_normalize_spec(config, optarg))
+          return 1;
+        break;
+      case 'R':
+        if (parse_size(optarg, &config->record) || config->record == 0) {
+          fprintf(stderr, "ERROR: bad -R size '%s' (use e.g. 4m)\n", optarg);
+          return 1;
+        }
+        break;
+      case 'T':
+        if (add_trigger_pattern(config, optarg))
+          return 1;
+        break;
+      case 'D':
+        config->daemon = 1;
+        break;
+      case 'c':
+        config->use_daemon = 1;
+        break;
+      case 'a':
+        config->async = 1;
+        break;
+      case 'A':
+        config->flush = 1;
+        break;
+      case 'E':
+        config->encrypt = 1;
+        break;
+      case 'g':
+        config->fetch = optarg;
+        break;
+      case 'u':
+        config->dedupe = 0;
+        break;
       case 'b':
         config->bypass_proxy = 1;
         break;
@@ -380,242 +351,154 @@ int get_configuration(struct pastebinc_config *config, int argc, char *argv[]) {
     }
   }
 
-  abort = read_config_files(config);
-  if (!abort && config->name == NULL) { // user didn't supply title, use provider's default
-    config->name = g_key_file_get_string(config->keyfile, "defaults", "title", NULL);
-  }
-
-  if (show_usage) {
-    display_usage(config, show_usage == 2);
-    abort = 1;
-  }
-
-  if (!abort)
-    abort = add_config_user_field(config, "expiration", expiration);
-
-  if (!abort)
-    abort = add_config_user_field(config, "format", format);
-
-  return abort;
-}
-
-int add_user_field(struct pastebinc_config *config, char *name, char *value) {
-  t_user_field *uf;
-  uf = (t_user_field *) malloc(sizeof(t_user_field));
-  uf->name = name;
-  uf->value = value;
-
-  if (config->verbose)
-    fprintf(stderr, "DEBUG: adding user field to config: '%s'='%s'\n", name, value);
-
-  uf->next = NULL;
-  if (config->user_fields == NULL) {
-    config->user_fields = uf;
-  } else {
-    t_user_field *last_uf = config->user_fields;
-    while (last_uf != NULL) {
-      if (last_uf->next == NULL) {
-        last_uf->next = uf;
-        break;
-      } else {
-        last_uf = last_uf->next;
-      }
-    }
+  // any remaining arguments are files to paste in batch mode
+  for (; optind < argc; optind++) {
+    if (add_batch_file(config, argv[optind]))
+      return 1;
   }
-}
 
-int add_config_user_field(struct pastebinc_config *config, char *fieldname, char *value) {
-  if (value == NULL)
-    return 0;
-
-  if (!g_key_file_has_key(config->keyfile, "standard_field_names", fieldname, NULL)) {
-    fprintf(stderr, "ERROR: this provider [%s] does not have a field configured for '%s'\n", config->provider, fieldname);
+  if (manifest != NULL && read_batch_manifest(config, manifest))
     return 1;
-  }
 
-  char *post_field_name = g_key_file_get_string(config->keyfile, "standard_field_names", fieldname, NULL);
-
-  t_user_field_option *ufo = config->user_field_options;
-  int found = 0;
-  while (ufo) {
-    if (strcmp(ufo->name, post_field_name) == 0) {
-      t_user_field_option_value *ufov = ufo->values;
-      while (ufov) {
-        if (strcmp(ufov->post_value, value) == 0) {
-          found = 1;
-          break;
-        }
-        ufov = ufov->next;
-      }
-    }
-    if (found)
-      break;
-    ufo = ufo->next;
-  }
-  if (!found) {
-    fprintf(stderr, "ERROR: invalid value for %s field.  Use -H for possible values\n", post_field_name);
+  if (config->keep && (config->stream || config->follow || config->use_daemon || config->batch_count > 0)) {
+    fprintf(stderr, "ERROR: -k can not be used with -s, -F, -c or batch mode\n");
     return 1;
   }
 
-  add_user_field(config, post_field_name, value);
-  return 0;
-}
-
-int read_config_files(struct pastebinc_config *config) {
-  GError *error;
-  GKeyFileFlags flags;
-  gsize length;
-  char conffile[256];
-  static const char *default_conf = CONFDIR "/" CONFFILE;
-  int bypass_proxy = 0; // temporary variable for global, then provider values
-
-  flags = G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS;
-
-  // read global config file and pull defaults from it before provider-specific settings override
-  config->keyfile = g_key_file_new();
-  error = NULL;
-
-  if (access(default_conf, R_OK) == -1) {
-    fprintf(stderr, "ERROR: Can not access defaults config file: %s\n", default_conf);
-    return 1;
-  }
-  if (!g_key_file_load_from_file(config->keyfile, default_conf, flags, &error)) {
-    g_error("Error loading default config file [%s]: %s\n", default_conf, error->message);
-    g_free(error);
+  if (config->normalize && (config->follow || config->use_daemon || config->batch_count > 0)) {
+    fprintf(stderr, "ERROR: -N can not be used with -F, -c or batch mode\n");
     return 1;
   }
 
-  // start reading global defaults
-  if (config->provider == NULL) { // use system default provider
-    config->provider = g_key_file_get_string(config->keyfile, "defaults", "provider", NULL);
+  if (config->record && (config->stream || config->follow || config->keep || config->normalize || config->use_daemon || config->async
+      || config->daemon || config->batch_count > 0)) {
+    fprintf(stderr, "ERROR: -R can not be used with -s, -F, -k, -N, -c, -a, -D or batch mode\n");
+    return 1;
   }
-  bypass_proxy = g_key_file_has_key(config->keyfile, "defaults", "bypass_proxy", NULL) ?
-                 g_key_file_get_integer(config->keyfile, "defaults", "bypass_proxy", NULL) :
-                 0;
-
-  // clean up the resources from the global config file
-  g_key_file_free(config->keyfile);
-  g_free(error);
-  config->keyfile = NULL;
 
-  // now start on the provider-specific configuration
-  sprintf(conffile, "%s/%s.conf", CONFDIR, config->provider);
-
-  if (config->verbose) {
-    fprintf(stderr, "DEBUG: Provider: %s\n", config->provider);
-    fprintf(stderr, "DEBUG: Config file: %s\n", conffile);
+  if (config->trigger != NULL && !config->record) {
+    fprintf(stderr, "ERROR: -T only works with -R\n");
+    return 1;
   }
 
-  if (access(conffile, R_OK) == -1) {
-    fprintf(stderr, "ERROR: Can not access config file: %s\n", conffile);
-    fprintf(stderr, "Perhaps the provider you specified (%s) does not exist?\n", config->provider);
+  if (config->async && (config->stream || config->follow || config->use_daemon || config->daemon || config->batch_count > 0)) {
+    fprintf(stderr, "ERROR: -a can not be used with -s, -F, -c, -D or batch mode\n");
     return 1;
   }
 
-  config->keyfile = g_key_file_new();
-  error = NULL;
-
-  if (!g_key_file_load_from_file(config->keyfile, conffile, flags, &error)) {
-    g_error("%s\n", error->message);
-    g_free(error);
+  if (config->encrypt && (config->follow || config->record || config->use_daemon || config->async || config->daemon || config->batch_count > 0)) {
+    fprintf(stderr, "ERROR: -E can not be used with -F, -R, -c, -a, -D or batch mode\n");
     return 1;
   }
 
-  // load the bypass_proxy value from the provider file:
-  bypass_proxy = g_key_file_has_key(config->keyfile, "server", "bypass_proxy", NULL) ?
-                 g_key_file_get_integer(config->keyfile, "server", "bypass_proxy", NULL) :
-                 bypass_proxy; // keep global value if we don't have one in this file
-
-  // if the user specified an option, it will be:
-  // -1 (force proxy use), or 1 (force bypass proxy)
-  // we don't override the user-specified value with one from config
-  if (config->bypass_proxy == -1) {
-    config->bypass_proxy = 0;
-  } else if (config->bypass_proxy == 0) {
-    // the user did not specify a flag, so we use defaults
-    config->bypass_proxy = bypass_proxy;
+  if (config->encrypt && config->compression != NULL && strcmp(config->compression, "none") != 0) {
+    fprintf(stderr, "ERROR: -E can not be used with -z (encrypted content does not compress)\n");
+    return 1;
   }
 
-  // load the user_fields from the provider file:
-  if (g_key_file_has_group(config->keyfile, "user_fields")) {
-    gchar **fields = NULL;
-    gchar **field = NULL;
-
-    t_user_field_option *last_ufo = NULL;
-    fields = g_key_file_get_keys(config->keyfile, "user_fields", NULL, NULL);
-    field = fields;
-    while (*field != NULL) {
-      t_user_field_option *ufo = (t_user_field_option *) malloc(sizeof(t_user_field_option));
-      gchar** values = NULL;
-      gchar** value = NULL;
-      int first = 1;
-
-      ufo->next = NULL;
-      ufo->values = NULL;
-      ufo->name = *field;
-
-      if (config->user_field_options == NULL)
-        config->user_field_options = ufo;
+  // a fresh key every time: the dedupe cache only knows plain URLs
+  if (config->encrypt)
+    config->dedupe = 0;
 
-      if (last_ufo != NULL)
-        last_ufo->next = ufo;
+  config->name_given = config->name != NULL;
 
-      last_ufo = ufo;
+  // run as the daemon when installed/invoked as pastebincd
+  base = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+  if (strcmp(base, PROGNAME "d") == 0)
+    config->daemon = 1;
 
-      t_user_field_option_value *last_ufov = NULL;
-      values = g_key_file_get_string_list(config->keyfile, "user_fields", *field, NULL, NULL);
-      value = values;
-
-      while (*value != NULL) {
-        t_user_field_option_value *ufov = (t_user_field_option_value *) malloc(sizeof(t_user_field_option_value));
-        ufov->post_value = strtok(*value, ":");
-        ufov->user_value = strtok(NULL, ":");
-        ufov->next = NULL;
-
-        if (ufo->values == NULL)
-          ufo->values = ufov;
+  if (config->use_daemon && !show_usage) {
+    // thin client: the daemon owns the configuration and validates the job
+    config->expiration = expiration;
+    config->format = format;
+    return 0;
+  }
 
-        if (last_ufov != NULL)
-          last_ufov->next = ufov;
+  abort = read_config_files(config);
+  if (!abort && config->name == NULL) { // user didn't supply title, use provider's default
+    config->name = (char *) conf_get(config->conf, "defaults", "title");
+  }
 
-        last_ufov = ufov;
+  if (show_usage) {
+    display_usage(config, show_usage == 2);
+    abort = 1;
+  }
 
-        value++;
-        first = 0;
-      }
+  if (!abort)
+    abort = add_config_user_field(config, "expiration", expiration);
 
-      // TODO: freeing these throws away the values I saved into ufov...
-      // g_strfreev(values);
-      field++;
-    }
-    // TODO: freeing these throws away the values I saved into ufo...
-    // g_strfreev(fields);
-  }
+  if (!abort)
+    abort = add_config_user_field(config, "format", format);
 
-  return 0;
+  return abort;
 }
 
 /*
  * Print basic usage information for users.
  */
-int display_usage(struct pastebinc_config *config, int show_extended) {
+void display_usage(struct pastebinc_config *config, int show_extended) {
   fprintf(stderr,
     PROGNAME " " VERSION "\n\n"
    "Pastes whatever is piped in to stdin to pastebin.com or similar site.\n"
    "Options:\n\n"
    "  -t             'tee', or print out all input from stdin to stdout\n"
+   "  -s             'stream', upload stdin as it is read instead of spooling it to\n"
+   "                   a tmp file first (uses chunked transfer encoding)\n"
    "  -v             'verbose', or print out debugging information as I work\n"
    "  -n [value]     the name (or title) of your paste\n"
    "  -p [value]     the provider (site) to paste to (i.e. pastebin.com)\n"
    "  -d [name=val]  custom form field data to send to this provider\n"
    "  -x [value]     the expiration value to send with your paste\n"
    "  -f [value]     the format of your paste\n"
+   "  -j [value]     batch mode: how many files to upload in parallel (default 4)\n"
+   "  -m [file]      batch mode: read the files to paste from this manifest, one\n"
+   "                   path per line (\"-\" for stdin)\n"
+   "  -z [value]     compress the paste content ('gzip' or 'none') for providers\n"
+   "                   that accept Content-Encoding on it\n"
+   "  -F             follow: keep reading stdin and post it as a series of pastes,\n"
+   "                   printing each URL as soon as it is ready\n"
+   "  -w [limits]    follow mode: when to close a paste, any of bytes (64k), lines\n"
+   "                   (100l) and time since its first byte (5s, 500ms); the\n"
+   "                   default is 1m,10s\n"
+   "  -k [head:tail] only keep the start and end of the input, each a size (1m)\n"
+   "                   or a number of lines (100l), with a marker for what was\n"
+   "                   left out; the tmp file stays that small however big the\n"
+   "                   input is\n"
+   "  -N [stages]    normalize the input before it is pasted, any of 'utf8' (refuse\n"
+   "                   input that is not valid UTF-8), 'utf8fix' (replace what is\n"
+   "                   not with U+FFFD), 'ansi' (strip terminal escape sequences)\n"
+   "                   and 'crlf' (turn CRLF and lone CR line endings into LF)\n"
+   "  -R [size]      flight recorder: keep reading stdin (pass it through with -t)\n"
+   "                   but only keep its last [size] bytes in memory, and paste\n"
+   "                   them whenever " PROGNAME " gets SIGUSR1 or a -T pattern\n"
+   "                   matches a line\n"
+   "  -T [regex]     flight recorder: also paste when a line matches this (can be\n"
+   "                   given more than once)\n"
+   "  -D             run as a daemon (" PROGNAME "d) that takes paste jobs over a\n"
+   "                   unix socket (PASTEBINCD_SOCKET, default\n"
+   "                   $XDG_RUNTIME_DIR/" DAEMON_SOCKET ")\n"
+   "  -S [format]    when done, print where the time went ('text', or 'json' for\n"
+   "                   one JSON line) to stderr\n"
+   "  -u             upload even if the same paste is in the dedupe cache\n"
+   "  -c             send this paste through a running " PROGNAME "d\n"
+   "  -a             queue the paste in the outbox (PASTEBINC_OUTBOX, default\n"
+   "                   ~/.local/share/" PROGNAME "/outbox) and print its job id\n"
+   "                   as soon as it is on disk; a background flusher posts it\n"
+   "                   and writes 'id url' to the outbox's done file\n"
+   "  -A             post everything queued in the outbox now, then exit\n"
+   "  -E             encrypt the paste (AES-256-GCM) before it is sent; the key\n"
+   "                   is only in the #fragment of the URL that is printed\n"
+   "  -g [url#key]   fetch a paste made with -E and print it, decrypted\n"
    "  -b             when this argument is present, we will bypass HTTP proxies\n"
    "  -B             when this argument is present, we will NOT bypass HTTP proxies\n"
    "                   even if the config file indicates that we should\n"
    "  -h             print this usage message\n"
    "  -H             print this usage message with extended provider information\n"
    "\n"
+   "Usage: " PROGNAME " [options] < input\n"
+   "       " PROGNAME " [options] file...   (batch mode, prints one URL per file)\n"
+   "       " PROGNAME " -g url#key > output\n"
+   "\n"
    "NOTE: To see custom form fields for a provider, use both -p [provider] and -H\n"
    "      This will also give you the valid values for this provider for the -x\n"
    "      and -f flags.\n"
@@ -625,62 +508,55 @@ int display_usage(struct pastebinc_config *config, int show_extended) {
     return;
   }
 
-  if (config->keyfile != NULL) {
+  if (config->conf != NULL) {
     fprintf(stderr,
       "\nYou are using the following provider: %s\n",
-      g_key_file_get_string(config->keyfile, "server", "name", NULL));
+      conf_get(config->conf, "server", "name"));
 
     fprintf(stderr,
       "It will post to the following URL: %s\n",
-      g_key_file_get_string(config->keyfile, "server", "url", NULL));
+      conf_get(config->conf, "server", "url"));
   }
 
-  t_user_field_option *ufo = config->user_field_options;
-  t_user_field_option *first_ufo = NULL;
-  t_user_field_option_value *first_ufov = NULL;
+  uint32_t nfields, i, j;
+  const struct conf_entry *fields = conf_group(config->conf, "user_fields", &nfields);
+  const struct conf_entry *first_field = NULL;
+  const struct conf_value *first_value = NULL;
 
   // TODO: should do this in a more flexible way so that I don't have to have these separate variables
   // and a list of if(...) checks below
-  char *format_field_name = g_key_file_has_key(config->keyfile, "standard_field_names", "format", NULL) ?
-                            g_key_file_get_string(config->keyfile, "standard_field_names", "format", NULL) :
-                            NULL;
-  char *expiration_field_name = g_key_file_has_key(config->keyfile, "standard_field_names", "expiration", NULL) ?
-                                g_key_file_get_string(config->keyfile, "standard_field_names", "expiration", NULL) :
-                                NULL;
-
-  if (ufo == NULL)
+  const char *format_field_name = conf_get(config->conf, "standard_field_names", "format");
+  const char *expiration_field_name = conf_get(config->conf, "standard_field_names", "expiration");
+
+  if (nfields == 0)
     fprintf(stderr, "\nThere are no fields that can be supplied by the user.\n");
   else
     fprintf(stderr, "\nThe following fields can have values supplied by the user on the command line:\n");
 
-  while (ufo != NULL) {
-    t_user_field_option_value *ufov = ufo->values;
+  for (i = 0; i < nfields; i++) {
+    const char *name = conf_str(config->conf, fields[i].key);
+    const struct conf_value *values = &conf_values(config->conf)[fields[i].first_value];
 
-    if (format_field_name != NULL && strcmp(ufo->name, format_field_name) == 0) {
+    if (format_field_name != NULL && strcmp(name, format_field_name) == 0) {
       fprintf(stderr, "\nFor this provider, the valid values for the -f (format) option are:\n");
-    } else if (expiration_field_name != NULL && strcmp(ufo->name, expiration_field_name) == 0) {
+    } else if (expiration_field_name != NULL && strcmp(name, expiration_field_name) == 0) {
       fprintf(stderr, "\nFor this provider, the valid values for the -x (expiration) option are:\n");
     } else {
-      fprintf(stderr, "\nField name: '%s'\n    Valid options:\n    --------------\n", ufo->name);
-      if (first_ufo == NULL)
-        first_ufo = ufo;
-      if (first_ufov == NULL)
-        first_ufov = ufov;
+      fprintf(stderr, "\nField name: '%s'\n    Valid options:\n    --------------\n", name);
+      if (first_field == NULL && fields[i].nvalues > 0) {
+        first_field = &fields[i];
+        first_value = values;
+      }
     }
 
-    while (ufov != NULL) {
-      fprintf(stderr, "    %s (%s)\n", ufov->post_value, ufov->user_value);
-      ufov = ufov->next;
-    }
-    ufo = ufo->next;
-    if (first_ufov == NULL)
-      first_ufo = NULL;
+    for (j = 0; j < fields[i].nvalues; j++)
+      fprintf(stderr, "    %s (%s)\n", conf_str(config->conf, values[j].post_value), conf_str(config->conf, values[j].user_value));
   }
 
-  if (first_ufo != NULL && first_ufov != NULL) {
+  if (first_field != NULL && first_value != NULL) {
     fprintf(stderr,
       "\nDo this by passing them after the -d argument, like this:\n"
       PROGNAME " -p %s -d \"%s=%s\"\n",
-      config->provider, first_ufo->name, first_ufov->post_value);
+      config->provider, conf_str(config->conf, first_field->key), conf_str(config->conf, first_value->post_value));
   }
 }
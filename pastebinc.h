@@ -0,0 +1,88 @@
+/* pastebinc.h:
+ *
+ * Copyright (C) 2011 Jeremy Thomerson - http://www.jeremythomerson.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * libpastebinc: paste from your own program, to any provider pastebinc has a
+ * config file for.
+ *
+ *   pastebinc_global_init();
+ *   client = pastebinc_client_new("pastebin.com", 0);
+ *   url = pastebinc_post_buffer(client, NULL, text, strlen(text));
+ *   ...
+ *   free(url);
+ *   pastebinc_client_free(client);
+ *
+ * A client reads its provider's config once and keeps its connections (and
+ * DNS and TLS session caches) open between pastes.  Any number of threads
+ * may post through the same client at the same time.  Errors are reported
+ * on stderr, like the pastebinc command does.
+ */
+#ifndef PASTEBINC_H
+#define PASTEBINC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define PASTEBINC_API __attribute__((visibility("default")))
+#else
+#define PASTEBINC_API
+#endif
+
+typedef struct pastebinc_client pastebinc_client;
+
+/*
+ * Per paste settings.  Anything left NULL gets the provider's default.
+ */
+struct pastebinc_options {
+  const char *title;
+  const char *expiration; // one of the provider's expiration values (pastebinc -H)
+  const char *format;
+  const char *const *fields; // NULL terminated list of "name=value" custom form fields
+};
+
+/*
+ * Call once, before any other thread is started, and pair it with
+ * pastebinc_global_cleanup() at exit.
+ */
+PASTEBINC_API int pastebinc_global_init(void);
+PASTEBINC_API void pastebinc_global_cleanup(void);
+
+/*
+ * Reads the config for a provider (NULL for the default one).  Returns NULL
+ * if the provider does not exist or its config is broken.
+ */
+PASTEBINC_API pastebinc_client *pastebinc_client_new(const char *provider, int verbose);
+PASTEBINC_API void pastebinc_client_free(pastebinc_client *client);
+
+/*
+ * Pastes len bytes from buf, or everything that can be read from fd (which
+ * is not closed).  options may be NULL.  Returns the paste URL, which the
+ * caller frees, or NULL if the paste failed.
+ */
+PASTEBINC_API char *pastebinc_post_buffer(pastebinc_client *client, const struct pastebinc_options *options,
+                                          const void *buf, size_t len);
+PASTEBINC_API char *pastebinc_post_fd(pastebinc_client *client, const struct pastebinc_options *options, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,704 @@
+#!/usr/bin/env python3
+"""
+Loopback tests for pastebinc (make check).
+
+Starts pastebinc-serve on loopback for the provider in tests/etc/test.conf
+and runs a pastebinc built to read tests/etc against it, checking what it
+printed against what the server kept (read back from /p/<id>).  Every test
+gets cache, data and outbox dirs nobody has used.
+"""
+
+import argparse
+import base64
+import gzip
+import http.client
+import os
+import re
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+PORT = 18766  # must match the url in tests/etc/test.conf
+MAX_PASTE_BYTES = 4096  # max_paste_bytes in tests/etc/test.conf
+
+TESTS = []
+
+
+def test(fn):
+    TESTS.append(fn)
+    return fn
+
+
+class Failure(Exception):
+    pass
+
+
+def check(cond, message):
+    if not cond:
+        raise Failure(message)
+
+
+def numbered_lines(size):
+    """Text lines of differing lengths, size bytes in all."""
+    out = []
+    total = 0
+    n = 0
+    while total < size:
+        line = b'%06d %s\n' % (n, b'pastebinc ' * (n % 23))
+        out.append(line)
+        total += len(line)
+        n += 1
+    return b''.join(out)[:size]
+
+
+class Harness:
+    def __init__(self, binary, serve, tmp):
+        self.binary = binary
+        self.serve = serve
+        self.tmp = tmp
+        self.server = None
+        self.env = None
+        self.opener = urllib.request.build_opener(urllib.request.ProxyHandler({}))
+
+    def fresh_env(self):
+        home = tempfile.mkdtemp(prefix='home-', dir=self.tmp)
+        env = dict(os.environ, HOME=home)
+        for name in ('XDG_CACHE_HOME', 'XDG_DATA_HOME', 'XDG_RUNTIME_DIR'):
+            env[name] = os.path.join(home, name.lower())
+        env['PASTEBINC_OUTBOX'] = os.path.join(home, 'outbox')
+        for name in ('http_proxy', 'https_proxy', 'all_proxy', 'PASTEBINCD_SOCKET'):
+            env.pop(name, None)
+        os.mkdir(env['XDG_RUNTIME_DIR'], 0o700)
+        self.env = env
+
+    def start_server(self):
+        conf = os.path.join(HERE, 'etc', 'test.conf')
+        log = os.path.join(self.tmp, 'pastes.log')
+        self.server = subprocess.Popen([self.serve, '-n', '-l', '127.0.0.1:%d' % PORT, '-d', log, conf],
+                                       stdout=subprocess.DEVNULL)
+        deadline = time.time() + 10
+        while time.time() < deadline:
+            try:
+                socket.create_connection(('127.0.0.1', PORT), timeout=1).close()
+                return
+            except OSError:
+                time.sleep(0.05)
+        self.stop_server()
+        sys.exit('pastebinc-serve did not start on port %d' % PORT)
+
+    def stop_server(self):
+        if self.server is not None:
+            self.server.terminate()
+            self.server.wait()
+            self.server = None
+
+    def run(self, args, data=b''):
+        """Runs pastebinc once.  Returns (exit code, stderr)."""
+        proc = subprocess.run([self.binary] + args, input=data, stdout=subprocess.DEVNULL,
+                              stderr=subprocess.PIPE, env=self.env, timeout=60)
+        return proc.returncode, proc.stderr.decode(errors='replace')
+
+    def decrypt(self, url):
+        """Runs pastebinc -g url.  Returns (exit code, stdout, stderr)."""
+        proc = subprocess.run([self.binary, '-g', url], stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+                              stderr=subprocess.PIPE, env=self.env, timeout=60)
+        return proc.returncode, proc.stdout, proc.stderr.decode(errors='replace')
+
+    def kill_strays(self):
+        """Kills what is left of pastebinc runs, like an outbox flusher."""
+        for pid in filter(str.isdigit, os.listdir('/proc')):
+            try:
+                with open('/proc/%s/environ' % pid, 'rb') as environ:
+                    if b'PASTEBINC_OUTBOX=' + self.tmp.encode() in environ.read():
+                        os.kill(int(pid), 9)
+            except OSError:
+                pass
+
+    def paste(self, args, data=b''):
+        """Runs pastebinc, which has to succeed, and returns the URL it printed."""
+        code, err = self.run(args, data)
+        check(code == 0, 'pastebinc %s exited %d: %s' % (' '.join(args), code, err.strip()))
+        urls = re.findall(r'^(?:Paste URL: )?(http://\S+)$', err, re.M)
+        check(urls, 'pastebinc %s printed no URL: %s' % (' '.join(args), err.strip()))
+        return urls[-1]
+
+    def fetch(self, url):
+        with self.opener.open(url, timeout=10) as resp:
+            return resp.read()
+
+    def parts(self, index_url):
+        """The URLs an index paste lists, in order."""
+        index = self.fetch(index_url).decode()
+        found = re.findall(r'^Part (\d+) of (\d+): (\S+)$', index, re.M)
+        check(found, 'not an index paste: %r' % index[:200])
+        check([int(n) for n, _, _ in found] == list(range(1, len(found) + 1)), 'parts out of order: %r' % index)
+        return [url for _, _, url in found]
+
+
+# -- splitting (max_paste_bytes) ---------------------------------------------
+
+@test
+def split_on_line_boundaries(h):
+    data = numbered_lines(5 * MAX_PASTE_BYTES + 123)
+    parts = [h.fetch(url) for url in h.parts(h.paste([], data))]
+    check(len(parts) > 5, 'only %d parts' % len(parts))
+    check(all(len(p) <= MAX_PASTE_BYTES for p in parts), 'a part is over the limit: %r' % [len(p) for p in parts])
+    check(all(p.endswith(b'\n') for p in parts[:-1]), 'a part does not end on a line boundary')
+    check(b''.join(parts) == data, 'the parts do not add up to the input')
+
+
+@test
+def split_long_line(h):
+    data = b'x' * (2 * MAX_PASTE_BYTES + 1808)
+    parts = [h.fetch(url) for url in h.parts(h.paste([], data))]
+    check([len(p) for p in parts] == [MAX_PASTE_BYTES, MAX_PASTE_BYTES, 1808], 'parts of %r' % [len(p) for p in parts])
+    check(b''.join(parts) == data, 'the parts do not add up to the input')
+
+
+@test
+def no_split_at_limit(h):
+    data = numbered_lines(MAX_PASTE_BYTES)
+    check(h.fetch(h.paste([], data)) == data, 'a paste of exactly max_paste_bytes was changed')
+
+
+@test
+def split_part_titles(h):
+    data = numbered_lines(2 * MAX_PASTE_BYTES)
+    index = h.fetch(h.paste(['-n', 'big'], data)).decode()
+    check(index.startswith('big was split into '), 'index starts %r' % index[:60])
+    # input without a title is called stdin
+    index = h.fetch(h.paste([], data)).decode()
+    check(index.startswith('stdin was split into '), 'index starts %r' % index[:60])
+
+
+# -- config cache --------------------------------------------------------------
+
+def conf_cache(h, err):
+    """The test provider's config cache and whether this run compiled it."""
+    found = re.search(r'^DEBUG: (compiled|using) config cache: (.*/test\.conf-[0-9a-f]{16}\.cache)$', err, re.M)
+    check(found, 'no config cache for test.conf: %s' % err.strip())
+    return found.group(2), found.group(1) == 'compiled'
+
+
+@test
+def conf_cache_round_trip(h):
+    data = numbered_lines(100)
+    code, err = h.run(['-v', '-u'], data)
+    path, compiled = conf_cache(h, err)
+    check(code == 0 and compiled, 'the first run did not compile the config')
+    code, err = h.run(['-v', '-u'], data)
+    check(code == 0 and conf_cache(h, err) == (path, False), 'the second run did not use the cache')
+    # the cache has to say what the config says: [user_fields] still checked
+    code, err = h.run(['-x', '1Y'], data)
+    check(code != 0, 'an expiration the config does not list was accepted')
+
+
+@test
+def conf_cache_rejects_bad_images(h):
+    data = numbered_lines(100)
+    code, err = h.run(['-v', '-u'], data)
+    path, _ = conf_cache(h, err)
+    with open(path, 'rb') as cache:
+        good = cache.read()
+
+    # struct conf_cache_header: 32 bytes of magic, version and source stat,
+    # then 16 uint32 sizes and offsets, strings (the string pool) last
+    def field(image, index, value):
+        return image[:32 + 4 * index] + struct.pack('<I', value) + image[36 + 4 * index:]
+
+    bad = {
+        'a truncated image': good[:100],
+        'the string pool past the end': field(good, 15, len(good) + 100),
+        'the entries inside the header': field(good, 4, 8),
+        'a misaligned group table': field(good, 2, struct.unpack_from('<I', good, 40)[0] + 1),
+        'a string pool without its last NUL': good[:-1] + b'x',
+        'garbage after the header': good[:96] + b'\xff' * (len(good) - 96),
+    }
+    for what, image in bad.items():
+        with open(path, 'wb') as cache:
+            cache.write(image)
+        code, err = h.run(['-v', '-u'], data)
+        check(code == 0, 'pastebinc failed with %s in the cache: %s' % (what, err.strip()))
+        check(conf_cache(h, err) == (path, True), 'a cache with %s was used' % what)
+
+
+@test
+def conf_duplicate_user_field_values(h):
+    # test-dupes lists N twice for paste_expire_date; the first one counts
+    data = numbered_lines(100)
+    check(h.fetch(h.paste(['-p', 'test-dupes', '-x', 'N'], data)) == data, 'the content came back changed')
+    code, err = h.run(['-p', 'test-dupes', '-x', '1Y'], data)
+    check(code != 0, 'an expiration the config does not list was accepted')
+    code, err = h.run(['-p', 'test-dupes', '-H'])
+    check('Never again' not in err, 'the second listing of N was kept: %s' % err.strip())
+
+
+# -- gzip (-z gzip) -----------------------------------------------------------
+
+GZIP_CHUNK = 128 * 1024  # GZIP_CHUNK in pastebinc-internal.h
+
+
+@test
+def gzip_chunks_join_up(h):
+    # one chunk, a chunk boundary either side, and many chunks compressed
+    # in parallel whose CRCs have to be combined
+    for size in (1, GZIP_CHUNK - 1, GZIP_CHUNK, GZIP_CHUNK + 1, 9 * GZIP_CHUNK + 12345):
+        data = numbered_lines(size)
+        for args in (['-z', 'gzip'], ['-z', 'gzip', '-s']):
+            check(h.fetch(h.paste(['-p', 'test-whole', '-u'] + args, data)) == data,
+                  'pastebinc %s of %d bytes came back changed' % (' '.join(args), size))
+
+
+@test
+def gzip_split_parts(h):
+    data = numbered_lines(3 * MAX_PASTE_BYTES)
+    parts = [h.fetch(url) for url in h.parts(h.paste(['-z', 'gzip'], data))]
+    check(b''.join(parts) == data, 'the parts do not add up to the input')
+
+
+# -- file arguments ------------------------------------------------------------
+
+def write_file(h, name, data):
+    path = os.path.join(h.env['HOME'], name)
+    with open(path, 'wb') as out:
+        out.write(data)
+    return path
+
+
+def file_urls(h, paths, options=()):
+    """Pastes files.  Returns (exit code, one URL or None per file, stderr)."""
+    code, err = h.run(['-v'] + list(options) + paths)
+    urls = dict(re.findall(r'^Paste URL \((.*)\): (\S+)$', err, re.M))
+    return code, [urls.get(path) for path in paths], err
+
+
+@test
+def files_split_and_dedupe(h):
+    small = numbered_lines(1000)
+    big = numbered_lines(4 * MAX_PASTE_BYTES + 7)
+    paths = [write_file(h, 'small.txt', small), write_file(h, 'big.txt', big)]
+
+    code, urls, err = file_urls(h, paths)
+    check(code == 0 and all(urls), 'pastebinc exited %d: %s' % (code, err.strip()))
+    check(h.fetch(urls[0]) == small, 'small.txt came back changed')
+    index = h.fetch(urls[1]).decode()
+    check(index.startswith('big.txt was split into '), 'big.txt was not split: %r' % index[:60])
+    check(b''.join(h.fetch(url) for url in h.parts(urls[1])) == big, 'the parts of big.txt do not add up')
+
+    code, again, err = file_urls(h, paths)
+    check(code == 0 and again == urls, 'the same files got %r, not %r' % (again, urls))
+    check(err.count('found in dedupe cache') == 2, 'the same files were uploaded again: %s' % err.strip())
+
+
+@test
+def files_keep_their_order(h):
+    paths = [write_file(h, 'f%d.txt' % i, numbered_lines(100 + i)) for i in range(6)]
+    paths.insert(3, os.path.join(h.env['HOME'], 'missing.txt'))
+    paths.insert(1, write_file(h, 'big.txt', numbered_lines(3 * MAX_PASTE_BYTES)))
+    code, urls, err = file_urls(h, paths, ['-j', '2'])
+    check(code != 0 and 'Can not read %s' % paths[4] in err, 'a missing file was not reported: %s' % err.strip())
+    check(urls[4] is None and all(urls[:4] + urls[5:]), 'URLs %r' % urls)
+    printed = [line for line in err.splitlines() if line.startswith('Paste URL (')]
+    check(printed == ['Paste URL (%s): %s' % (p, u) for p, u in zip(paths, urls) if u],
+          'the URLs were not printed in argument order: %r' % printed)
+
+
+# -- dedupe cache -------------------------------------------------------------
+
+def xxh64(data, seed=0):
+    """Reference XXH64, to check the one pastebinc keys its dedupe cache on."""
+    p1, p2, p3, p4, p5 = (0x9E3779B185EBCA87, 0xC2B2AE3D27D4EB4F, 0x165667B19E3779F9,
+                          0x85EBCA77C2B2AE63, 0x27D4EB2F165667C5)
+    mask = (1 << 64) - 1
+
+    def rotl(x, r):
+        return ((x << r) | (x >> (64 - r))) & mask
+
+    def round_(acc, lane):
+        return rotl((acc + lane * p2) & mask, 31) * p1 & mask
+
+    def merge(acc, val):
+        return ((acc ^ round_(0, val)) * p1 + p4) & mask
+
+    def u64(off):
+        return int.from_bytes(data[off:off + 8], 'little')
+
+    n = len(data)
+    off = 0
+    if n >= 32:
+        v = [(seed + p1 + p2) & mask, (seed + p2) & mask, seed, (seed - p1) & mask]
+        while off + 32 <= n:
+            v = [round_(v[i], u64(off + 8 * i)) for i in range(4)]
+            off += 32
+        h = (rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18)) & mask
+        for lane in v:
+            h = merge(h, lane)
+    else:
+        h = (seed + p5) & mask
+    h = (h + n) & mask
+    while off + 8 <= n:
+        h = (rotl(h ^ round_(0, u64(off)), 27) * p1 + p4) & mask
+        off += 8
+    if off + 4 <= n:
+        h = (rotl(h ^ (int.from_bytes(data[off:off + 4], 'little') * p1 & mask), 23) * p2 + p3) & mask
+        off += 4
+    while off < n:
+        h = rotl(h ^ (data[off] * p5 & mask), 11) * p1 & mask
+        off += 1
+    h = (h ^ (h >> 33)) * p2 & mask
+    h = (h ^ (h >> 29)) * p3 & mask
+    return h ^ (h >> 32)
+
+
+@test
+def xxh64_vectors(h):
+    check(xxh64(b'') == 0xef46db3751d8e999 and xxh64(b'abc') == 0x44bc2cf5ad770999,
+          'the reference XXH64 is wrong')
+    # every tail length, and inputs with and without whole 32 byte stripes
+    for size in list(range(1, 40)) + [63, 64, 65, 1000, 4095]:
+        data = numbered_lines(size)
+        code, err = h.run(['-v'], data)
+        found = re.search(r'^DEBUG: input xxh64:size is ([0-9a-f]+):(\d+)$', err, re.M)
+        check(code == 0 and found, 'no xxh64 for %d bytes: %s' % (size, err.strip()))
+        check((int(found.group(1), 16), int(found.group(2))) == (xxh64(data), size),
+              'xxh64 of %d bytes is %s, not %016x' % (size, found.group(0), xxh64(data)))
+
+
+@test
+def dedupe_reuses_url(h):
+    data = numbered_lines(1000)
+    first = h.paste([], data)
+    code, err = h.run(['-v'], data)
+    check(code == 0 and 'found in dedupe cache' in err, 'the second paste was uploaded: %s' % err.strip())
+    check(h.paste([], data) == first, 'the second paste got a different URL')
+    check(h.paste(['-u'], data) != first, '-u did not upload again')
+
+
+@test
+def dedupe_keys_on_title_and_expiration(h):
+    data = numbered_lines(1000)
+    untitled = h.paste([], data)
+    titled = h.paste(['-n', 'one'], data)
+    urls = [untitled, titled, h.paste(['-n', 'two'], data), h.paste(['-x', '10M'], data)]
+    check(len(set(urls)) == len(urls), 'different pastes shared a URL: %r' % urls)
+    check(h.paste([], data) == untitled and h.paste(['-n', 'one'], data) == titled,
+          'a repeated paste was not found')
+
+
+@test
+def dedupe_split_input(h):
+    data = numbered_lines(3 * MAX_PASTE_BYTES)
+    first = h.paste([], data)
+    check(h.paste([], data) == first, 'a split paste was uploaded again')
+
+
+# -- normalization (-N) -------------------------------------------------------
+
+NORMALIZE_CHUNK = 256 * 1024  # NORMALIZE_CHUNK in pastebinc-internal.h
+FFFD = '\ufffd'.encode()
+
+
+@test
+def normalize_crlf(h):
+    data = b'one\r\ntwo\rthree\n\r\n'
+    check(h.fetch(h.paste(['-N', 'crlf'], data)) == b'one\ntwo\nthree\n\n', 'CRLF was not folded')
+    check(h.fetch(h.paste([], data)) == data, 'CRLF was folded without -N crlf')
+    # a CR that ends one chunk and its LF that starts the next are one ending
+    pad = b'x' * (NORMALIZE_CHUNK - 1)
+    check(h.fetch(h.paste(['-p', 'test-whole', '-N', 'crlf'], pad + b'\r\nend\r\n')) == pad + b'\nend\n',
+          'a CRLF across chunks came back changed')
+
+
+@test
+def normalize_keeps_trailing_whitespace(h):
+    data = b'tab\t\nspaces  \r\n \t\nlast  '
+    want = b'tab\t\nspaces  \n \t\nlast  '
+    check(h.fetch(h.paste(['-N', 'utf8,ansi,crlf'], data)) == want, 'trailing whitespace came back changed')
+
+
+@test
+def normalize_invalid_utf8(h):
+    # a stray byte, a byte that can't start anything, a sequence cut short by
+    # a newline and one cut short by the end of the input
+    data = b'ok \xc3\xa9 bad \xff\xfe end \xe2\x82\ntail \xf0\x9f\x98'
+    want = b'ok \xc3\xa9 bad ' + FFFD + FFFD + b' end ' + FFFD + b'\ntail ' + FFFD
+    code, err = h.run(['-N', 'utf8'], data)
+    check(code != 0, '-N utf8 took invalid UTF-8')
+    check('not valid UTF-8 (at byte 10)' in err, '-N utf8 did not say where: %s' % err.strip())
+    check(h.fetch(h.paste(['-N', 'utf8fix'], data)) == want, '-N utf8fix came back wrong')
+    # valid sequences pass, even across chunks
+    good = b'x' * (NORMALIZE_CHUNK - 1) + b'\xc3\xa9\n'
+    check(h.fetch(h.paste(['-p', 'test-whole', '-N', 'utf8'], good)) == good, 'valid UTF-8 came back changed')
+
+
+# -- encryption (-E, -g) -------------------------------------------------------
+
+ENCRYPT_CHUNK = 64 * 1024  # ENCRYPT_CHUNK in pastebinc-internal.h
+ENCRYPT_TAG = 16
+ENCRYPT_PREFIX = 7
+ENCRYPT_HEADER = b'pastebinc-aes-256-gcm-1\n'
+
+
+def sealed(h, url):
+    """The decoded bytes of an encrypted paste: nonce prefix, then chunks."""
+    text = h.fetch(url.split('#')[0])
+    check(text.startswith(ENCRYPT_HEADER), 'not an encrypted paste: %r' % text[:100])
+    return base64.b64decode(b''.join(text[len(ENCRYPT_HEADER):].split()))
+
+
+def repaste_sealed(data):
+    """Pastes encrypted bytes as pastebinc -E would.  Returns the URL."""
+    text = ENCRYPT_HEADER + base64.encodebytes(data)
+    status, answer = post(form([field('paste_code', text)]))
+    check(status == 200, 'answered %d: %r' % (status, answer))
+    return answer.decode().strip()
+
+
+def check_undecryptable(h, url, what):
+    code, out, err = h.decrypt(url)
+    check(code != 0, '-g of %s exited 0' % what)
+    check('ERROR:' in err, '-g of %s printed no error: %s' % (what, err.strip()))
+
+
+@test
+def encrypt_round_trip(h):
+    # nothing, one full chunk, and a full chunk with one byte to spare
+    for size in (0, ENCRYPT_CHUNK, ENCRYPT_CHUNK + 1):
+        data = numbered_lines(size)
+        url = h.paste(['-p', 'test-whole', '-E'], data)
+        check('#' in url, '-E printed no key: %s' % url)
+        check(h.fetch(url.split('#')[0]) != data or not data, 'the paste was not encrypted')
+        code, out, err = h.decrypt(url)
+        check(code == 0, '-g exited %d: %s' % (code, err.strip()))
+        check(out == data, '%d bytes came back changed' % size)
+
+
+@test
+def encrypt_rejects_damage(h):
+    data = numbered_lines(ENCRYPT_CHUNK + 1)
+    url = h.paste(['-p', 'test-whole', '-E'], data)
+    key = url.split('#')[1]
+    raw = sealed(h, url)
+    check(len(raw) == ENCRYPT_PREFIX + len(data) + 2 * ENCRYPT_TAG, 'the paste is %d bytes' % len(raw))
+
+    tampered = bytearray(raw)
+    tampered[ENCRYPT_PREFIX + 100] ^= 1
+    check_undecryptable(h, repaste_sealed(bytes(tampered)) + '#' + key, 'a changed paste')
+    # the first chunk on its own, which was not sealed as the last one
+    cut = raw[:ENCRYPT_PREFIX + ENCRYPT_CHUNK + ENCRYPT_TAG]
+    check_undecryptable(h, repaste_sealed(cut) + '#' + key, 'a paste cut at a chunk boundary')
+    wrong = base64.urlsafe_b64encode(bytes(32)).decode().rstrip('=')
+    check_undecryptable(h, url.split('#')[0] + '#' + wrong, 'a wrong key')
+    check_undecryptable(h, url.split('#')[0], 'no key')
+
+
+# -- redaction ([redact]) -----------------------------------------------------
+
+@test
+def redact_own_groups(h):
+    # the first group is masked; key= only matches when its value repeats
+    data = b'tok_abc key=xy;xy pw:hunter pass:two key=xy;zz\n'
+    want = b'tok_*** key=**;xy pw:****** pass:*** key=xy;zz\n'
+    check(h.fetch(h.paste(['-p', 'test-redact'], data)) == want, 'the content came back changed')
+
+
+# -- pastebinc-serve's form parser ---------------------------------------------
+
+BOUNDARY = 'pastebinc-test-boundary'
+
+
+def form(fields, boundary=BOUNDARY):
+    """A multipart/form-data body; fields are (headers, value) pairs."""
+    body = b''
+    for headers, value in fields:
+        body += b'--%s\r\n%s\r\n\r\n%s\r\n' % (boundary.encode(), headers, value)
+    return body + b'--%s--\r\n' % boundary.encode()
+
+
+def field(name, value):
+    return (b'Content-Disposition: form-data; name="%s"' % name.encode(), value)
+
+
+def post(body, content_type='multipart/form-data; boundary=' + BOUNDARY):
+    """Posts body to the server as it is.  Returns (status, answer)."""
+    conn = http.client.HTTPConnection('127.0.0.1', PORT, timeout=10)
+    try:
+        conn.request('POST', '/api', body, {'Content-Type': content_type})
+        resp = conn.getresponse()
+        return resp.status, resp.read()
+    finally:
+        conn.close()
+
+
+@test
+def serve_stores_form_content(h):
+    # the content may have NULs, CRLFs and things that look like delimiters
+    data = b'a\0b\r\n--%s\r\nc\r\n\r\n' % BOUNDARY[:-1].encode()
+    status, answer = post(form([field('paste_name', b'raw'), field('paste_code', data)]))
+    check(status == 200, 'answered %d: %r' % (status, answer))
+    check(h.fetch(answer.decode().strip()) == data, 'the content came back changed')
+
+
+@test
+def serve_rejects_malformed_forms(h):
+    good = form([field('paste_code', b'hello')])
+    bad = {
+        'a NUL in a part header': form([(b'Content-Disposition: form-data;\0 name="paste_code"', b'hello')]),
+        'a part header with no end': b'--%s\r\nContent-Disposition: form-data; name="paste_code"' % BOUNDARY.encode(),
+        'no closing delimiter': good[:-len(b'--%s--\r\n' % BOUNDARY.encode())],
+        'no content field': form([field('paste_name', b'hello')]),
+        'a user field value not listed': form([field('paste_code', b'hello'), field('paste_expire_date', b'1Y')]),
+        'broken gzip content': form([(b'Content-Disposition: form-data; name="paste_code"\r\nContent-Encoding: gzip',
+                                      b'\x1f\x8b not really gzip')]),
+    }
+    for what, body in bad.items():
+        status, answer = post(body)
+        check(status == 400, '%s was answered %d: %r' % (what, status, answer))
+    status, answer = post(good, 'application/x-www-form-urlencoded')
+    check(status == 400, 'a post that is not multipart was answered %d' % status)
+    # and the server is still there
+    status, answer = post(good)
+    check(status == 200, 'a good post after the bad ones was answered %d' % status)
+
+
+@test
+def serve_gzip_content(h):
+    data = numbered_lines(3000)
+    status, answer = post(form([(b'Content-Disposition: form-data; name="paste_code"\r\nContent-Encoding: gzip',
+                                 gzip.compress(data))]))
+    check(status == 200, 'answered %d: %r' % (status, answer))
+    check(h.fetch(answer.decode().strip()) == data, 'the content came back changed')
+
+
+@test
+def serve_streamed_post(h):
+    # -s uploads with chunked transfer encoding
+    data = numbered_lines(3000)
+    check(h.fetch(h.paste(['-s'], data)) == data, 'the content came back changed')
+
+
+# -- daemon (-D, -c) ----------------------------------------------------------
+
+@test
+def daemon_takes_pastes(h):
+    sock = os.path.join(h.env['XDG_RUNTIME_DIR'], 'pastebincd.sock')
+    code, err = h.run(['-c'], b'hello\n')
+    check(code != 0, '-c with no daemon running exited 0')
+
+    daemon = subprocess.Popen([h.binary, '-D'], stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL, env=h.env)
+    try:
+        deadline = time.time() + 10
+        while not os.path.exists(sock) and daemon.poll() is None and time.time() < deadline:
+            time.sleep(0.05)
+        check(os.path.exists(sock), 'the daemon did not make its socket')
+        data = numbered_lines(2000)
+        check(h.fetch(h.paste(['-c'], data)) == data, 'the content came back changed')
+        # a provider the daemon has not loaded yet
+        data = numbered_lines(3 * MAX_PASTE_BYTES)
+        check(h.fetch(h.paste(['-c', '-p', 'test-whole'], data)) == data, 'the content came back changed')
+    finally:
+        daemon.terminate()
+        daemon.wait()
+
+
+# -- outbox (-a, -A) ----------------------------------------------------------
+
+def queue(h, data):
+    """Queues a paste with -a and returns its job id."""
+    code, err = h.run(['-a'], data)
+    check(code == 0 and re.match(r'^[0-9a-f]+\n$', err), '-a exited %d: %s' % (code, err.strip()))
+    return err.strip()
+
+
+def outbox_done(h):
+    """The outbox's done file, as a dict of job id to URL."""
+    try:
+        with open(os.path.join(h.env['PASTEBINC_OUTBOX'], 'done')) as done:
+            return dict(line.split() for line in done if line.strip())
+    except FileNotFoundError:
+        return {}
+
+
+@test
+def outbox_posts_in_background(h):
+    data = numbered_lines(2000)
+    job = queue(h, data)
+    deadline = time.time() + 20
+    while job not in outbox_done(h) and time.time() < deadline:
+        time.sleep(0.05)
+    check(job in outbox_done(h), 'job %s was not posted' % job)
+    check(h.fetch(outbox_done(h)[job]) == data, 'the content came back changed')
+
+
+@test
+def outbox_recovers_torn_tail(h):
+    datas = [numbered_lines(1500), numbered_lines(2500)]
+    h.stop_server()
+    try:
+        jobs = [queue(h, data) for data in datas]
+        h.kill_strays()  # the flusher, still waiting for the server
+    finally:
+        h.start_server()
+
+    # what a power cut in the middle of a third append leaves: a state file
+    # that can't be trusted and half a record at the end of the journal
+    ob = h.env['PASTEBINC_OUTBOX']
+    with open(os.path.join(ob, 'journal'), 'r+b') as journal:
+        torn = journal.read(20)
+        journal.seek(0, os.SEEK_END)
+        journal.write(torn)
+    with open(os.path.join(ob, 'state'), 'r+b') as state:
+        state.write(b'\0' * 64)
+
+    code, err = h.run(['-A'])
+    check(code == 0, '-A exited %d: %s' % (code, err.strip()))
+    check('dropping 20 bytes of unfinished outbox records' in err, 'the torn record was not dropped: %s' % err.strip())
+    done = outbox_done(h)
+    for job, data in zip(jobs, datas):
+        check(job in done, 'job %s was not posted' % job)
+        check(h.fetch(done[job]) == data, 'job %s came back changed' % job)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--binary', default=os.path.join(HERE, 'pastebinc'))
+    parser.add_argument('--serve', default=os.path.join(HERE, '..', 'pastebinc-serve'))
+    parser.add_argument('-k', dest='pattern', help='only run the tests whose name contains this')
+    args = parser.parse_args()
+
+    tmp = tempfile.mkdtemp(prefix='pastebinc-tests-')
+    h = Harness(os.path.abspath(args.binary), os.path.abspath(args.serve), tmp)
+    failed = 0
+    h.start_server()
+    try:
+        for fn in TESTS:
+            if args.pattern and args.pattern not in fn.__name__:
+                continue
+            h.fresh_env()
+            try:
+                fn(h)
+                print('%-40s ok' % fn.__name__)
+            except (Failure, OSError, subprocess.SubprocessError) as e:
+                failed += 1
+                print('%-40s FAILED: %s' % (fn.__name__, e))
+            sys.stdout.flush()
+    finally:
+        h.stop_server()
+        h.kill_strays()
+        if not failed:
+            shutil.rmtree(tmp, ignore_errors=True)
+
+    if failed:
+        print('%d of the tests failed, files are in %s' % (failed, tmp))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())